@@ -0,0 +1,270 @@
+// Shared-memory view of the latest order book snapshot.
+//
+// The reconstructor (--shm NAME) publishes every snapshot into a POSIX
+// shared-memory segment guarded by a seqlock. Readers map the segment and copy
+// the snapshot without locks or syscalls; the writer never waits for them.
+//
+//     BookReader reader;
+//     if (book_reader_open(reader, "/obr_book")) {
+//         ShmBookSnapshot snap;
+//         if (book_reader_read(reader, snap)) { ... snap.bids[0].price ... }
+//         book_reader_close(reader);
+//     }
+//
+// It also decodes the compressed outputs written with --compress:
+//
+//     ObzReader in;
+//     if (obz_reader_open(in, "book_new.csv.obz")) {
+//         char buf[65536];
+//         size_t n;
+//         while ((n = obz_reader_read(in, buf, sizeof(buf))) > 0) { ... }
+//         obz_reader_close(in);     // false if the file was damaged
+//     }
+#ifndef BOOK_READER_H
+#define BOOK_READER_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+const uint32_t SHM_BOOK_MAGIC = 0x4f425231;     // "OBR1"
+const uint32_t SHM_BOOK_VERSION = 1;
+const int SHM_BOOK_DEPTH = 5;
+
+struct ShmBookLevel {
+    double price;
+    long long qty;
+};
+
+// Copy of one snapshot: best levels, market statistics, indicative auction
+struct ShmBookSnapshot {
+    long long clockatarrival;
+    long long transacttime;
+    int num_bids;
+    int num_asks;
+    ShmBookLevel bids[SHM_BOOK_DEPTH];      // best first
+    ShmBookLevel asks[SHM_BOOK_DEPTH];
+    long long cvl;
+    double lpr;
+    long long cto;
+    long long nts;
+    double opx;
+    int has_auction;
+    double iap;
+    long long iav;
+    long long iai;
+};
+
+// Shared segment. seq is odd while the writer is updating snapshot.
+struct ShmBook {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> seq;
+    uint64_t published;         // snapshots published so far
+    ShmBookSnapshot snapshot;
+};
+
+// Writer side: begin and end one update
+inline void shm_book_write_begin(ShmBook* shm) {
+    shm->seq.store(shm->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void shm_book_write_end(ShmBook* shm) {
+    shm->seq.store(shm->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Consistent copy of the latest snapshot, false if nothing was published yet.
+// Retries while the writer is mid-update.
+inline bool shm_book_read(const ShmBook* shm, ShmBookSnapshot& out, uint64_t* published = 0) {
+    for (;;) {
+        uint64_t before = shm->seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        uint64_t count = shm->published;
+        std::memcpy(&out, &shm->snapshot, sizeof(out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shm->seq.load(std::memory_order_relaxed) != before) continue;
+        if (published) *published = count;
+        return count > 0;
+    }
+}
+
+struct BookReader {
+    int fd;
+    const ShmBook* shm;
+};
+
+#ifndef _WIN32
+// Map a published segment read-only, false if it does not exist or is foreign
+inline bool book_reader_open(BookReader& reader, const char* name) {
+    reader.shm = 0;
+    reader.fd = shm_open(name, O_RDONLY, 0);
+    if (reader.fd < 0) return false;
+    void* p = mmap(0, sizeof(ShmBook), PROT_READ, MAP_SHARED, reader.fd, 0);
+    if (p == MAP_FAILED) {
+        close(reader.fd);
+        reader.fd = -1;
+        return false;
+    }
+    reader.shm = (const ShmBook*)p;
+    if (reader.shm->magic != SHM_BOOK_MAGIC || reader.shm->version != SHM_BOOK_VERSION) {
+        munmap(p, sizeof(ShmBook));
+        close(reader.fd);
+        reader.shm = 0;
+        reader.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+inline void book_reader_close(BookReader& reader) {
+    if (reader.shm) munmap((void*)reader.shm, sizeof(ShmBook));
+    if (reader.fd >= 0) close(reader.fd);
+    reader.shm = 0;
+    reader.fd = -1;
+}
+#endif
+
+inline bool book_reader_read(const BookReader& reader, ShmBookSnapshot& out, uint64_t* published = 0) {
+    return reader.shm != 0 && shm_book_read(reader.shm, out, published);
+}
+
+// Compressed output: "OBZ1", then blocks of at most OBZ_MAX_BLOCK bytes, each
+// as [uint32 raw size][uint32 stored size][stored bytes]. A block whose stored
+// size equals its raw size is stored as is, otherwise it is a run of LZ77
+// sequences: a token (literal count << 4 | match length - 4), the literals,
+// a 2-byte little-endian match offset and the match. Counts of 15 continue in
+// bytes of 255 up to a final smaller byte. The last sequence has no match.
+const char OBZ_MAGIC[4] = {'O', 'B', 'Z', '1'};
+const uint32_t OBZ_MAX_BLOCK = 4 << 20;
+const size_t OBZ_MIN_MATCH = 4;
+
+// Count continued in bytes of 255, false past end
+inline bool obz_read_length(const unsigned char*& p, const unsigned char* end, size_t& len) {
+    unsigned char b;
+    do {
+        if (p == end) return false;
+        b = *p++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decode one block, false if it is damaged or does not fill exactly dst_size bytes
+inline bool obz_decode_block(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size) {
+    if (src_size == dst_size) {
+        std::memcpy(dst, src, dst_size);
+        return true;
+    }
+    const unsigned char* end = src + src_size;
+    size_t out = 0;
+    while (src < end) {
+        unsigned char token = *src++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !obz_read_length(src, end, literals)) return false;
+        if (literals > (size_t)(end - src) || literals > dst_size - out) return false;
+        std::memcpy(dst + out, src, literals);
+        src += literals;
+        out += literals;
+        if (src == end) break;
+        
+        if (end - src < 2) return false;
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        size_t match = token & 15;
+        if (match == 15 && !obz_read_length(src, end, match)) return false;
+        match += OBZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match > dst_size - out) return false;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match; i++, out++) dst[out] = dst[out - offset];
+    }
+    return out == dst_size;
+}
+
+// Signed integers of the delta-coded binary formats are zigzag varints:
+// 7 bits per byte, low bits first, high bit set on all but the last byte
+inline bool obz_read_varint(const unsigned char*& p, const unsigned char* end, int64_t& value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end) return false;
+        unsigned char b = *p++;
+        v |= (uint64_t)(b & 127) << shift;
+        if (!(b & 128)) {
+            value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Streaming reader of a compressed file; holds one decoded block
+struct ObzReader {
+    FILE* file;
+    unsigned char* stored;
+    unsigned char* block;
+    size_t size;            // decoded bytes in block
+    size_t pos;             // bytes of block already returned
+    bool damaged;
+};
+
+inline bool obz_reader_open(ObzReader& reader, const char* path) {
+    reader.stored = 0;
+    reader.block = 0;
+    reader.size = reader.pos = 0;
+    reader.damaged = false;
+    reader.file = std::fopen(path, "rb");
+    if (!reader.file) return false;
+    char magic[4];
+    if (std::fread(magic, 1, 4, reader.file) != 4 || std::memcmp(magic, OBZ_MAGIC, 4) != 0) {
+        std::fclose(reader.file);
+        reader.file = 0;
+        return false;
+    }
+    reader.stored = (unsigned char*)std::malloc(OBZ_MAX_BLOCK);
+    reader.block = (unsigned char*)std::malloc(OBZ_MAX_BLOCK);
+    return reader.stored && reader.block;
+}
+
+// Copy up to n decoded bytes into buf, 0 at the end of the file or on damage
+inline size_t obz_reader_read(ObzReader& reader, char* buf, size_t n) {
+    size_t copied = 0;
+    while (copied < n && !reader.damaged) {
+        if (reader.pos == reader.size) {
+            uint32_t sizes[2];
+            size_t got = std::fread(sizes, 1, sizeof(sizes), reader.file);
+            if (got == 0) break;
+            reader.damaged = got != sizeof(sizes) || sizes[0] > OBZ_MAX_BLOCK || sizes[1] > sizes[0] ||
+                             std::fread(reader.stored, 1, sizes[1], reader.file) != sizes[1] ||
+                             !obz_decode_block(reader.stored, sizes[1], reader.block, sizes[0]);
+            reader.size = reader.damaged ? 0 : sizes[0];
+            reader.pos = 0;
+            continue;
+        }
+        size_t take = reader.size - reader.pos < n - copied ? reader.size - reader.pos : n - copied;
+        std::memcpy(buf + copied, reader.block + reader.pos, take);
+        reader.pos += take;
+        copied += take;
+    }
+    return copied;
+}
+
+// False if the file was damaged
+inline bool obz_reader_close(ObzReader& reader) {
+    if (reader.file) std::fclose(reader.file);
+    std::free(reader.stored);
+    std::free(reader.block);
+    reader.file = 0;
+    reader.stored = reader.block = 0;
+    return !reader.damaged;
+}
+
+#endif
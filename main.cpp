@@ -7,12 +7,43 @@
 #include <algorithm>
 #include <iomanip>
 #include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <cstring>
+#include <climits>
+#include <csignal>
+#include <ctime>
+#include <new>
+#include "book_reader.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+
+// Progress messages on std::cout (turned off by the batch driver)
+static bool verbose_log = true;
 
 // Order structure
 struct Order {
     long long clockatarrival;
     int sequenceno;
-    long long transacttime;
+    long long transacttime;  // HHMMSSmmm as received, kept for output
+    long long time_ms;       // transacttime as milliseconds since midnight
     int applseqnum;
     int side;                // 1=buy, 2=sell
     char ordertype;          // '1'=market, '2'=limit, 'u'=best
@@ -24,7 +55,8 @@ struct Order {
 struct Trade {
     long long clockatarrival;
     int sequenceno;
-    long long transacttime;
+    long long transacttime;  // HHMMSSmmm as received, kept for output
+    long long time_ms;       // transacttime as milliseconds since midnight
     int applseqnum;
     char exectype;           // 'f'=filled, '4'=cancelled
     double tradeprice;
@@ -34,6 +66,17 @@ struct Trade {
     int offerapplseqnum;
 };
 
+// Microstructure features of the top of the book
+struct TopFeatures {
+    bool two_sided;         // both sides have a level; the price features need it
+    double mid;
+    double spread;
+    double imbalance;       // (bid qty - ask qty) / (bid qty + ask qty) at the best levels
+    double microprice;      // best prices weighted by the opposite side's qty
+    double weighted_mid;    // mean of the qty-weighted bid and ask prices over the top 5 levels
+    long long ofi;          // cumulative order-flow imbalance
+};
+
 // Order book snapshot structure
 struct BookSnapshot {
     long long clockatarrival;
@@ -49,6 +92,21 @@ struct BookSnapshot {
     int cto;                // Cumulative Trade Orders: total number of orders that traded
     int nts;                // Number of Trades: total number of trades executed
     double opx;             // Opening Price: first trade price of the session
+    
+    // Call-auction indicative values, only set in call-auction phases
+    bool has_auction;
+    double iap;             // Indicative Auction Price
+    long long iav;          // Indicative Auction Volume: volume matched at iap
+    long long iai;          // Indicative Auction Imbalance: unmatched volume at iap, >0 buy surplus
+    
+    // Microstructure features, only set when features are tracked
+    bool has_features;
+    TopFeatures features;
+    
+    // Orders resting at each of the best levels, only set when order counts are tracked
+    bool has_order_counts;
+    std::vector<int> best_bid_orders;
+    std::vector<int> best_ask_orders;
 };
 
 // Order in book
@@ -56,25 +114,562 @@ struct BookOrder {
     int applseqnum;
     double price;
     int qty;
-    long long order_time;
+    long long order_time;    // milliseconds since midnight
+    long long arrival;       // book-wide arrival rank, lower ranks queue ahead
+};
+
+// Quantity change applied to one price level
+struct LevelChange {
+    double price;
+    int qty_delta;      // 0 if no resting order was touched
+    long long arrival;  // arrival rank of the touched order
+};
+
+// Minimum price increment of 1 / ticks_per_unit, set by --tick before any
+// input is read (default 0.01). Prices are mapped to integer ticks of this
+// size and printed with price_decimals decimals.
+long long ticks_per_unit = 100;
+int price_decimals = 2;
+
+long long price_to_tick(double price) {
+    return (long long)std::floor(price * ticks_per_unit + 0.5);
+}
+
+// Inverse of price_to_tick. Dividing by the exact tick count gives the same
+// double as parsing the decimal price.
+double tick_to_price(long long tick) {
+    return tick / (double)ticks_per_unit;
+}
+
+// Use a tick of the given size, which must be 1 / N of a unit with at most
+// 8 decimals, e.g. 0.001 or 0.05
+bool set_price_tick(const std::string& text) {
+    double tick = std::atof(text.c_str());
+    long long n = tick > 0 && tick <= 1 ? (long long)std::floor(1 / tick + 0.5) : 0;
+    long long scale = 1;
+    int decimals = 0;
+    while (n > 0 && scale % n != 0 && decimals < 8) {
+        scale *= 10;
+        decimals++;
+    }
+    if (n == 0 || std::fabs(n * tick - 1) > 1e-9 || scale % n != 0) {
+        std::cerr << "Tick must be 1/N of a price unit with at most 8 decimals: " << text << std::endl;
+        return false;
+    }
+    ticks_per_unit = n;
+    price_decimals = decimals;
+    return true;
+}
+
+// True if price is a whole number of ticks. The input columns hold prices as
+// ticks, so a finer price would be merged into the nearest level; inputs with
+// one are rejected rather than silently rounded.
+bool on_price_tick(double price) {
+    return tick_to_price(price_to_tick(price)) == price;
+}
+
+void print_tick_error(const std::string& filename, long long line_num, double price) {
+    std::cerr << "Error: " << filename << " line " << line_num << ": price " << std::setprecision(10) << price
+              << " is not a multiple of the " << std::fixed << std::setprecision(price_decimals) << tick_to_price(1)
+              << " tick" << std::endl;
+}
+
+// Parsed order stream, one dense column per field (42 bytes per order against
+// 64 for std::vector<Order>). Passes that scan times or ids read one column;
+// the book gets whole rows from get().
+struct OrderColumns {
+    std::vector<long long> clockatarrival;
+    std::vector<int> sequenceno;
+    std::vector<long long> transacttime;
+    std::vector<int> time_ms;
+    std::vector<int> applseqnum;
+    std::vector<int8_t> side;
+    std::vector<char> ordertype;
+    std::vector<long long> price_tick;
+    std::vector<int> orderqty;
+    
+    size_t size() const { return applseqnum.size(); }
+    bool empty() const { return applseqnum.empty(); }
+    
+    void clear() {
+        clockatarrival.clear();
+        sequenceno.clear();
+        transacttime.clear();
+        time_ms.clear();
+        applseqnum.clear();
+        side.clear();
+        ordertype.clear();
+        price_tick.clear();
+        orderqty.clear();
+    }
+    
+    void push_back(const Order& order) {
+        clockatarrival.push_back(order.clockatarrival);
+        sequenceno.push_back(order.sequenceno);
+        transacttime.push_back(order.transacttime);
+        time_ms.push_back((int)order.time_ms);
+        applseqnum.push_back(order.applseqnum);
+        side.push_back((int8_t)order.side);
+        ordertype.push_back(order.ordertype);
+        price_tick.push_back(price_to_tick(order.price));
+        orderqty.push_back(order.orderqty);
+    }
+    
+    Order get(size_t i) const {
+        Order order;
+        order.clockatarrival = clockatarrival[i];
+        order.sequenceno = sequenceno[i];
+        order.transacttime = transacttime[i];
+        order.time_ms = time_ms[i];
+        order.applseqnum = applseqnum[i];
+        order.side = side[i];
+        order.ordertype = ordertype[i];
+        order.price = tick_to_price(price_tick[i]);
+        order.orderqty = orderqty[i];
+        return order;
+    }
+};
+
+// Parsed trade stream, one dense column per field (57 bytes per trade against 72)
+struct TradeColumns {
+    std::vector<long long> clockatarrival;
+    std::vector<int> sequenceno;
+    std::vector<long long> transacttime;
+    std::vector<int> time_ms;
+    std::vector<int> applseqnum;
+    std::vector<char> exectype;
+    std::vector<long long> price_tick;
+    std::vector<int> tradeqty;
+    std::vector<double> trademoney;
+    std::vector<int> bidapplseqnum;
+    std::vector<int> offerapplseqnum;
+    
+    size_t size() const { return applseqnum.size(); }
+    bool empty() const { return applseqnum.empty(); }
+    
+    void clear() {
+        clockatarrival.clear();
+        sequenceno.clear();
+        transacttime.clear();
+        time_ms.clear();
+        applseqnum.clear();
+        exectype.clear();
+        price_tick.clear();
+        tradeqty.clear();
+        trademoney.clear();
+        bidapplseqnum.clear();
+        offerapplseqnum.clear();
+    }
+    
+    void push_back(const Trade& trade) {
+        clockatarrival.push_back(trade.clockatarrival);
+        sequenceno.push_back(trade.sequenceno);
+        transacttime.push_back(trade.transacttime);
+        time_ms.push_back((int)trade.time_ms);
+        applseqnum.push_back(trade.applseqnum);
+        exectype.push_back(trade.exectype);
+        price_tick.push_back(price_to_tick(trade.tradeprice));
+        tradeqty.push_back(trade.tradeqty);
+        trademoney.push_back(trade.trademoney);
+        bidapplseqnum.push_back(trade.bidapplseqnum);
+        offerapplseqnum.push_back(trade.offerapplseqnum);
+    }
+    
+    Trade get(size_t i) const {
+        Trade trade;
+        trade.clockatarrival = clockatarrival[i];
+        trade.sequenceno = sequenceno[i];
+        trade.transacttime = transacttime[i];
+        trade.time_ms = time_ms[i];
+        trade.applseqnum = applseqnum[i];
+        trade.exectype = exectype[i];
+        trade.tradeprice = tick_to_price(price_tick[i]);
+        trade.tradeqty = tradeqty[i];
+        trade.trademoney = trademoney[i];
+        trade.bidapplseqnum = bidapplseqnum[i];
+        trade.offerapplseqnum = offerapplseqnum[i];
+        return trade;
+    }
+};
+
+// Quantity per price tick of one side, kept in a Fenwick tree so the
+// cumulative volume below any price is O(log n)
+struct VolumeLadder {
+    std::vector<long long> tree;    // Fenwick tree, 1-based
+    std::vector<long long> qty;     // plain quantity per tick
+    long long total;
+};
+
+// Call-auction calculator: bid and ask ladders over a shared tick range
+struct AuctionLadder {
+    long long base_tick;            // tick of ladder index 0
+    VolumeLadder bids;
+    VolumeLadder asks;
+};
+
+// Indicative result of the call auction
+struct AuctionResult {
+    double price;           // 0 when the book is not crossed
+    long long volume;       // matched volume at price
+    long long imbalance;    // unmatched volume at price, >0 bid surplus, <0 ask surplus
+};
+
+void init_volume_ladder(VolumeLadder& v, size_t size) {
+    v.tree.assign(size + 1, 0);
+    v.qty.assign(size, 0);
+    v.total = 0;
+}
+
+void init_auction_ladder(AuctionLadder& ladder) {
+    ladder.base_tick = 0;
+    init_volume_ladder(ladder.bids, 0);
+    init_volume_ladder(ladder.asks, 0);
+}
+
+void ladder_add(VolumeLadder& v, long long index, long long delta) {
+    v.qty[index] += delta;
+    v.total += delta;
+    for (size_t i = (size_t)index + 1; i < v.tree.size(); i += i & (0 - i)) {
+        v.tree[i] += delta;
+    }
+}
+
+// Sum of quantity at ladder indices [0, index]
+long long ladder_prefix(const VolumeLadder& v, long long index) {
+    if (index < 0) return 0;
+    if (index >= (long long)v.qty.size()) return v.total;
+    long long sum = 0;
+    for (size_t i = (size_t)index + 1; i > 0; i -= i & (0 - i)) {
+        sum += v.tree[i];
+    }
+    return sum;
+}
+
+// Smallest index whose prefix sum reaches k (1 <= k <= total)
+long long ladder_lower_bound(const VolumeLadder& v, long long k) {
+    size_t n = v.qty.size();
+    size_t step = 1;
+    while (step * 2 <= n) step *= 2;
+    
+    size_t pos = 0;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= n && v.tree[pos + step] < k) {
+            pos += step;
+            k -= v.tree[pos];
+        }
+    }
+    return (long long)pos;
+}
+
+// Rebuild one side over a new tick range in O(n)
+void rebuild_volume_ladder(VolumeLadder& v, long long shift, size_t size) {
+    std::vector<long long> old_qty;
+    old_qty.swap(v.qty);
+    init_volume_ladder(v, size);
+    
+    for (size_t i = 0; i < old_qty.size(); i++) {
+        v.qty[i + shift] = old_qty[i];
+        v.total += old_qty[i];
+    }
+    for (size_t i = 1; i <= size; i++) {
+        v.tree[i] += v.qty[i - 1];
+        size_t parent = i + (i & (0 - i));
+        if (parent <= size) v.tree[parent] += v.tree[i];
+    }
+}
+
+// Grow the tick range so it covers tick, doubling to keep rebuilds rare
+void ensure_ladder_range(AuctionLadder& ladder, long long tick) {
+    long long size = (long long)ladder.bids.qty.size();
+    if (size > 0 && tick >= ladder.base_tick && tick < ladder.base_tick + size) return;
+    
+    long long lo = size > 0 ? std::min(ladder.base_tick, tick) : tick;
+    long long hi = size > 0 ? std::max(ladder.base_tick + size, tick + 1) : tick + 1;
+    long long new_size = std::max(size * 2, (long long)1024);
+    while (new_size < (hi - lo) * 2) new_size *= 2;
+    
+    long long new_base = lo - (new_size - (hi - lo)) / 2;
+    if (new_base < 0) new_base = 0;
+    long long shift = size > 0 ? ladder.base_tick - new_base : 0;
+    
+    rebuild_volume_ladder(ladder.bids, shift, (size_t)new_size);
+    rebuild_volume_ladder(ladder.asks, shift, (size_t)new_size);
+    ladder.base_tick = new_base;
+}
+
+// Apply a resting quantity change, side 1=buy, 2=sell
+void auction_update(AuctionLadder& ladder, int side, double price, long long qty_delta) {
+    long long tick = price_to_tick(price);
+    if (tick < 0) return;
+    ensure_ladder_range(ladder, tick);
+    ladder_add(side == 1 ? ladder.bids : ladder.asks, tick - ladder.base_tick, qty_delta);
+}
+
+// Indicative auction price, matched volume and imbalance in O(log^2 n):
+// maximum matched volume, then minimum imbalance, then the middle of the
+// remaining price range
+AuctionResult compute_auction(const AuctionLadder& ladder) {
+    AuctionResult result;
+    result.price = 0;
+    result.volume = 0;
+    result.imbalance = 0;
+    
+    const VolumeLadder& bids = ladder.bids;
+    const VolumeLadder& asks = ladder.asks;
+    if (bids.total <= 0 || asks.total <= 0) return result;
+    
+    // demand(p) = bids at or above p, supply(p) = asks at or below p.
+    // Find the last index where demand still covers supply.
+    long long lo = -1;
+    long long hi = (long long)bids.qty.size();
+    while (hi - lo > 1) {
+        long long mid = lo + (hi - lo) / 2;
+        long long demand = bids.total - ladder_prefix(bids, mid - 1);
+        if (demand >= ladder_prefix(asks, mid)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    long long cross = lo;
+    
+    long long left_volume = ladder_prefix(asks, cross);                    // volume at cross
+    long long right_volume = bids.total - ladder_prefix(bids, cross);      // volume at cross + 1
+    long long volume = std::max(left_volume, right_volume);
+    if (volume <= 0) return result;
+    
+    bool use_left = left_volume == volume;
+    bool use_right = right_volume == volume;
+    long long left_imbalance = 0;
+    long long right_imbalance = 0;
+    long long range_lo = 0;
+    long long range_hi = 0;
+    
+    if (use_left) {
+        // Same supply down to the highest ask at or below cross, same demand
+        // down to just above the highest bid below cross
+        left_imbalance = bids.total - ladder_prefix(bids, cross - 1) - volume;
+        long long ask_lo = ladder_lower_bound(asks, left_volume);
+        long long bids_below = ladder_prefix(bids, cross - 1);
+        long long bid_lo = bids_below > 0 ? ladder_lower_bound(bids, bids_below) + 1 : 0;
+        range_lo = std::max(ask_lo, bid_lo);
+        range_hi = cross;
+    }
+    if (use_right) {
+        // Same demand up to the lowest bid above cross, same supply up to
+        // just below the next ask
+        right_imbalance = ladder_prefix(asks, cross + 1) - volume;
+        long long bid_hi = ladder_lower_bound(bids, ladder_prefix(bids, cross) + 1);
+        long long asks_upto = ladder_prefix(asks, cross + 1);
+        long long ask_hi = asks_upto < asks.total ? ladder_lower_bound(asks, asks_upto + 1) - 1
+                                                  : (long long)asks.qty.size() - 1;
+        if (use_left && left_imbalance != right_imbalance) {
+            if (right_imbalance < left_imbalance) {
+                use_left = false;
+            } else {
+                use_right = false;
+            }
+        }
+        if (use_right) {
+            if (!use_left) range_lo = cross + 1;
+            range_hi = std::min(bid_hi, ask_hi);
+        }
+    }
+    
+    long long tick = range_lo + (range_hi - range_lo) / 2;
+    result.price = tick_to_price(ladder.base_tick + tick);
+    result.volume = volume;
+    result.imbalance = tick <= cross ? left_imbalance : -right_imbalance;
+    return result;
+}
+
+// Aggregated resting interest at one price
+struct PriceLevel {
+    int qty;
+    int orders;             // number of resting orders
+    
+    PriceLevel() : qty(0), orders(0) {}
+};
+
+// Add qty_delta and order_delta to a price level, dropping the level once it is empty
+void adjust_level(std::map<double, PriceLevel>& levels, double price, int qty_delta, int order_delta) {
+    PriceLevel& level = levels[price];
+    level.qty += qty_delta;
+    level.orders += order_delta;
+    if (level.qty <= 0) levels.erase(price);
+}
+
+// Simulated own order resting in the shadow book of a backtest
+struct SimOrder {
+    int id;
+    int side;               // 1=buy, 2=sell
+    long long tick;
+    int qty;
+    int leaves;             // qty still open
+    long long ahead;        // real qty queued in front of this order
+    long long placed_arrival;   // real orders with a lower arrival rank are ahead
+    char state;             // 'p' in flight, 'l' live, 'f' filled, 'c' cancelled, 'r' rejected
+};
+
+// One fill of a simulated order
+struct SimFill {
+    long long time_ms;
+    long long transacttime;
+    int order_id;
+    int side;
+    long long tick;
+    int qty;
+    int leaves;
+    char liquidity;         // 'q' reached the queue front, 't' traded through, 'x' crossed by a resting order, 'T' took liquidity
+};
+
+// Simulated orders kept beside the real book; they never change the real levels
+struct SimBook {
+    std::vector<SimOrder> orders;
+    std::map<long long, std::vector<int> > bids;   // tick -> live order ids, oldest first
+    std::map<long long, std::vector<int> > asks;
+    std::vector<SimFill> fills;
+    bool matching;          // simulated orders only execute while this is set
 };
 
+void init_sim_book(SimBook& sim) {
+    sim.orders.clear();
+    sim.bids.clear();
+    sim.asks.clear();
+    sim.fills.clear();
+    sim.matching = false;
+}
+
+// Fill qty of a live simulated order, dropping it from its level once done
+void sim_fill(SimBook& sim, int id, int qty, long long tick, char liquidity,
+              long long time_ms, long long transacttime) {
+    SimOrder& order = sim.orders[id];
+    order.leaves -= qty;
+    
+    SimFill fill;
+    fill.time_ms = time_ms;
+    fill.transacttime = transacttime;
+    fill.order_id = id;
+    fill.side = order.side;
+    fill.tick = tick;
+    fill.qty = qty;
+    fill.leaves = order.leaves;
+    fill.liquidity = liquidity;
+    sim.fills.push_back(fill);
+    
+    if (order.leaves > 0) return;
+    bool resting = order.state == 'l';
+    order.state = 'f';
+    if (!resting) return;
+    std::map<long long, std::vector<int> >& levels = order.side == 1 ? sim.bids : sim.asks;
+    std::map<long long, std::vector<int> >::iterator level_it = levels.find(order.tick);
+    std::vector<int>& ids = level_it->second;
+    ids.erase(std::find(ids.begin(), ids.end(), id));
+    if (ids.empty()) levels.erase(level_it);
+}
+
+// A real order left or shrank at a level; simulated orders behind it move up
+// the queue, and fills of orders queued behind them fill them instead
+void sim_on_level_decrease(SimBook& sim, int side, const LevelChange& change, bool is_fill,
+                           long long time_ms, long long transacttime) {
+    if (change.qty_delta >= 0) return;
+    std::map<long long, std::vector<int> >& levels = side == 1 ? sim.bids : sim.asks;
+    if (levels.empty()) return;
+    long long tick = price_to_tick(change.price);
+    std::map<long long, std::vector<int> >::iterator level_it = levels.find(tick);
+    if (level_it == levels.end()) return;
+    
+    // Copy, since a completed fill edits the level
+    std::vector<int> ids = level_it->second;
+    long long removed = -change.qty_delta;
+    for (size_t i = 0; i < ids.size() && removed > 0; i++) {
+        SimOrder& order = sim.orders[ids[i]];
+        if (change.arrival < order.placed_arrival) {
+            order.ahead -= std::min(order.ahead, removed);
+        } else if (is_fill && sim.matching && order.ahead == 0) {
+            int qty = (int)std::min((long long)order.leaves, removed);
+            removed -= qty;
+            sim_fill(sim, ids[i], qty, order.tick, 'q', time_ms, transacttime);
+        }
+    }
+}
+
+// A fill printed at a price worse than a simulated order's: that order would have
+// been hit first
+void sim_on_trade(SimBook& sim, const Trade& trade) {
+    if (!sim.matching) return;
+    long long tick = price_to_tick(trade.tradeprice);
+    long long left = trade.tradeqty;
+    
+    while (left > 0 && !sim.bids.empty() && sim.bids.rbegin()->first > tick) {
+        int id = sim.bids.rbegin()->second.front();
+        int qty = (int)std::min((long long)sim.orders[id].leaves, left);
+        left -= qty;
+        sim_fill(sim, id, qty, sim.orders[id].tick, 't', trade.time_ms, trade.transacttime);
+    }
+    left = trade.tradeqty;
+    while (left > 0 && !sim.asks.empty() && sim.asks.begin()->first < tick) {
+        int id = sim.asks.begin()->second.front();
+        int qty = (int)std::min((long long)sim.orders[id].leaves, left);
+        left -= qty;
+        sim_fill(sim, id, qty, sim.orders[id].tick, 't', trade.time_ms, trade.transacttime);
+    }
+}
+
+// A real order came to rest at or through a simulated order on the other side.
+// Orders crossing the real book trade with it instead, see sim_on_trade.
+void sim_on_resting_order(SimBook& sim, int side, const BookOrder& order, double opposite_best,
+                          long long transacttime) {
+    if (!sim.matching) return;
+    if (opposite_best > 0 && (side == 2 ? opposite_best >= order.price : opposite_best <= order.price)) return;
+    long long tick = price_to_tick(order.price);
+    long long left = order.qty;
+    
+    if (side == 2) {
+        while (left > 0 && !sim.bids.empty() && sim.bids.rbegin()->first >= tick) {
+            int id = sim.bids.rbegin()->second.front();
+            int qty = (int)std::min((long long)sim.orders[id].leaves, left);
+            left -= qty;
+            sim_fill(sim, id, qty, sim.orders[id].tick, 'x', order.order_time, transacttime);
+        }
+    } else {
+        while (left > 0 && !sim.asks.empty() && sim.asks.begin()->first <= tick) {
+            int id = sim.asks.begin()->second.front();
+            int qty = (int)std::min((long long)sim.orders[id].leaves, left);
+            left -= qty;
+            sim_fill(sim, id, qty, sim.orders[id].tick, 'x', order.order_time, transacttime);
+        }
+    }
+}
+
 // Bid order book
 struct BidBook {
     std::map<int, BookOrder> orders;
+    std::map<double, PriceLevel> levels;
     double get_best_price() const;
-    void add_order(const BookOrder& order);
-    void remove_order(int applseqnum);
-    bool update_qty(int applseqnum, int qty_change);
+    LevelChange add_order(const BookOrder& order);
+    LevelChange remove_order(int applseqnum);
+    LevelChange update_qty(int applseqnum, int qty_change);
 };
 
 // Ask order book
 struct AskBook {
     std::map<int, BookOrder> orders;
+    std::map<double, PriceLevel> levels;
     double get_best_price() const;
-    void add_order(const BookOrder& order);
-    void remove_order(int applseqnum);
-    bool update_qty(int applseqnum, int qty_change);
+    LevelChange add_order(const BookOrder& order);
+    LevelChange remove_order(int applseqnum);
+    LevelChange update_qty(int applseqnum, int qty_change);
+};
+
+// Best levels after the previous event, for order-flow imbalance
+struct FeatureState {
+    bool started;
+    double bid;
+    long long bid_qty;
+    double ask;
+    long long ask_qty;
+    long long ofi;
 };
 
 // Order book structure
@@ -90,81 +685,142 @@ struct OrderBook {
     int number_of_trades;
     double opening_price;
     bool has_opening_price;
+    
+    // Call-auction calculator, maintained only when track_auction is set
+    bool track_auction;
+    AuctionLadder auction;
+    
+    // Order-flow imbalance state, maintained only when track_features is set
+    bool track_features;
+    FeatureState features;
+    
+    // Copy the per-level order counts into snapshots
+    bool track_order_counts;
+    
+    // Arrival rank handed to the next resting order
+    long long next_arrival;
+    
+    // Shadow orders of a backtest, NULL when not backtesting
+    SimBook* sim;
 };
 
 // BidBook implementations
 double BidBook::get_best_price() const {
-    if (orders.empty()) return 0;
-    double best = 0;
-    std::map<int, BookOrder>::const_iterator it;
-    for (it = orders.begin(); it != orders.end(); ++it) {
-        if (it->second.price > best) {
-            best = it->second.price;
-        }
-    }
-    return best;
+    if (levels.empty()) return 0;
+    return levels.rbegin()->first;
 }
 
-void BidBook::add_order(const BookOrder& order) {
+LevelChange BidBook::add_order(const BookOrder& order) {
+    LevelChange change;
+    change.price = order.price;
+    change.qty_delta = order.qty;
+    change.arrival = order.arrival;
     orders[order.applseqnum] = order;
+    adjust_level(levels, order.price, order.qty, 1);
+    return change;
 }
 
-void BidBook::remove_order(int applseqnum) {
-    orders.erase(applseqnum);
+LevelChange BidBook::remove_order(int applseqnum) {
+    LevelChange change;
+    change.price = 0;
+    change.qty_delta = 0;
+    change.arrival = 0;
+    std::map<int, BookOrder>::iterator it = orders.find(applseqnum);
+    if (it != orders.end()) {
+        change.price = it->second.price;
+        change.arrival = it->second.arrival;
+        change.qty_delta = -it->second.qty;
+        adjust_level(levels, change.price, change.qty_delta, -1);
+        orders.erase(it);
+    }
+    return change;
 }
 
-bool BidBook::update_qty(int applseqnum, int qty_change) {
+LevelChange BidBook::update_qty(int applseqnum, int qty_change) {
+    LevelChange change;
+    change.price = 0;
+    change.qty_delta = 0;
+    change.arrival = 0;
     std::map<int, BookOrder>::iterator it = orders.find(applseqnum);
     if (it != orders.end()) {
+        change.price = it->second.price;
+        change.arrival = it->second.arrival;
+        int old_qty = it->second.qty;
+        int order_delta = 0;
         it->second.qty += qty_change;
         if (it->second.qty <= 0) {
+            change.qty_delta = -old_qty;
+            order_delta = -1;
             orders.erase(it);
-            return true;
+        } else {
+            change.qty_delta = qty_change;
         }
-        return false;
+        adjust_level(levels, change.price, change.qty_delta, order_delta);
     }
-    return true;
+    return change;
 }
 
 // AskBook implementations
 double AskBook::get_best_price() const {
-    if (orders.empty()) return 0;
-    double best = 1e9;
-    std::map<int, BookOrder>::const_iterator it;
-    for (it = orders.begin(); it != orders.end(); ++it) {
-        if (it->second.price < best) {
-            best = it->second.price;
-        }
-    }
-    return best == 1e9 ? 0 : best;
+    if (levels.empty()) return 0;
+    return levels.begin()->first;
 }
 
-void AskBook::add_order(const BookOrder& order) {
+LevelChange AskBook::add_order(const BookOrder& order) {
+    LevelChange change;
+    change.price = order.price;
+    change.qty_delta = order.qty;
+    change.arrival = order.arrival;
     orders[order.applseqnum] = order;
+    adjust_level(levels, order.price, order.qty, 1);
+    return change;
 }
 
-void AskBook::remove_order(int applseqnum) {
-    orders.erase(applseqnum);
+LevelChange AskBook::remove_order(int applseqnum) {
+    LevelChange change;
+    change.price = 0;
+    change.qty_delta = 0;
+    change.arrival = 0;
+    std::map<int, BookOrder>::iterator it = orders.find(applseqnum);
+    if (it != orders.end()) {
+        change.price = it->second.price;
+        change.arrival = it->second.arrival;
+        change.qty_delta = -it->second.qty;
+        adjust_level(levels, change.price, change.qty_delta, -1);
+        orders.erase(it);
+    }
+    return change;
 }
 
-bool AskBook::update_qty(int applseqnum, int qty_change) {
+LevelChange AskBook::update_qty(int applseqnum, int qty_change) {
+    LevelChange change;
+    change.price = 0;
+    change.qty_delta = 0;
+    change.arrival = 0;
     std::map<int, BookOrder>::iterator it = orders.find(applseqnum);
     if (it != orders.end()) {
+        change.price = it->second.price;
+        change.arrival = it->second.arrival;
+        int old_qty = it->second.qty;
+        int order_delta = 0;
         it->second.qty += qty_change;
         if (it->second.qty <= 0) {
+            change.qty_delta = -old_qty;
+            order_delta = -1;
             orders.erase(it);
-            return true;
+        } else {
+            change.qty_delta = qty_change;
         }
-        return false;
+        adjust_level(levels, change.price, change.qty_delta, order_delta);
     }
-    return true;
+    return change;
 }
 
 // Event structure
 struct Event {
-    std::string type;
-    long long time;
+    long long time;          // milliseconds since midnight
     int index;
+    bool is_order;           // index is into the orders, else into the trades
 };
 
 // Initialize order book
@@ -175,6 +831,28 @@ void init_orderbook(OrderBook& book) {
     book.number_of_trades = 0;
     book.opening_price = 0.0;
     book.has_opening_price = false;
+    book.track_auction = false;
+    init_auction_ladder(book.auction);
+    book.track_features = false;
+    book.track_order_counts = false;
+    book.features.started = false;
+    book.features.bid = 0;
+    book.features.bid_qty = 0;
+    book.features.ask = 0;
+    book.features.ask_qty = 0;
+    book.features.ofi = 0;
+    book.next_arrival = 0;
+    book.sim = NULL;
+}
+
+// Reset order book for the next replay, keeping allocated snapshot memory
+void reset_orderbook(OrderBook& book) {
+    book.bid_book.orders.clear();
+    book.bid_book.levels.clear();
+    book.ask_book.orders.clear();
+    book.ask_book.levels.clear();
+    book.snapshots.clear();
+    init_orderbook(book);
 }
 
 // Get best bid price
@@ -187,15 +865,161 @@ double get_best_ask_price(const OrderBook& book) {
     return book.ask_book.get_best_price();
 }
 
+// Add the order-flow imbalance of the last event (Cont, Kukanov and Stoikov):
+// bid qty added at a same or better best bid minus bid qty lost at a same or
+// worse one, and the mirror for asks. O(1) from the best levels.
+void update_features(OrderBook& book) {
+    FeatureState& f = book.features;
+    double bid = 0;
+    long long bid_qty = 0;
+    double ask = 0;
+    long long ask_qty = 0;
+    if (!book.bid_book.levels.empty()) {
+        bid = book.bid_book.levels.rbegin()->first;
+        bid_qty = book.bid_book.levels.rbegin()->second.qty;
+    }
+    if (!book.ask_book.levels.empty()) {
+        ask = book.ask_book.levels.begin()->first;
+        ask_qty = book.ask_book.levels.begin()->second.qty;
+    }
+    
+    if (f.started) {
+        long long e = 0;
+        if (bid >= f.bid) e += bid_qty;
+        if (bid <= f.bid) e -= f.bid_qty;
+        // An empty ask side counts as an infinitely high ask
+        bool ask_lower = ask_qty == 0 ? false : (f.ask_qty == 0 || ask <= f.ask);
+        bool ask_higher = f.ask_qty == 0 ? false : (ask_qty == 0 || ask >= f.ask);
+        if (ask_lower) e -= ask_qty;
+        if (ask_higher) e += f.ask_qty;
+        f.ofi += e;
+    }
+    f.started = true;
+    f.bid = bid;
+    f.bid_qty = bid_qty;
+    f.ask = ask;
+    f.ask_qty = ask_qty;
+}
+
+// Quantity-weighted price of the given levels
+double weighted_price(const std::vector<std::pair<double, int> >& levels) {
+    double value = 0;
+    long long qty = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        value += levels[i].first * levels[i].second;
+        qty += levels[i].second;
+    }
+    return qty > 0 ? value / qty : 0;
+}
+
+// Features from the top 5 levels of each side and the tracked order-flow imbalance
+TopFeatures compute_features(const std::vector<std::pair<double, int> >& bids,
+                             const std::vector<std::pair<double, int> >& asks, long long ofi) {
+    TopFeatures f;
+    f.two_sided = !bids.empty() && !asks.empty();
+    f.mid = 0;
+    f.spread = 0;
+    f.imbalance = 0;
+    f.microprice = 0;
+    f.weighted_mid = 0;
+    f.ofi = ofi;
+    if (!f.two_sided) return f;
+    
+    double bid = bids[0].first;
+    double ask = asks[0].first;
+    double bid_qty = bids[0].second;
+    double ask_qty = asks[0].second;
+    f.mid = (bid + ask) / 2;
+    f.spread = ask - bid;
+    f.imbalance = (bid_qty - ask_qty) / (bid_qty + ask_qty);
+    f.microprice = (bid * ask_qty + ask * bid_qty) / (bid_qty + ask_qty);
+    f.weighted_mid = (weighted_price(bids) + weighted_price(asks)) / 2;
+    return f;
+}
+
+// Base of book event handlers. A handler derives as
+//     struct MyHandler : BookEventSink<MyHandler> { void on_fill(...) {...} };
+// and hides only the hooks it needs; the rest stay empty inline functions, so
+// replay code templated on the handler type pays nothing for them.
+// on_order runs for every order message before the book sees it; on_add,
+// on_fill and on_cancel run after the book was updated.
+template <typename Derived>
+struct BookEventSink {
+    void on_order(const OrderBook&, const Order&) {}
+    void on_add(const OrderBook&, const Order&) {}
+    void on_fill(const OrderBook&, const Trade&) {}
+    void on_cancel(const OrderBook&, const Trade&) {}
+    void on_level_change(const OrderBook&, int, const LevelChange&) {}
+    void on_snapshot(const OrderBook&, const BookSnapshot&) {}
+};
+
+// Handler with no hooks, used by the plain replay
+struct NullSink : BookEventSink<NullSink> {};
+
+// Two handlers called in order, nest for more: SinkPair<A, SinkPair<B, C> >
+template <typename First, typename Second>
+struct SinkPair : BookEventSink<SinkPair<First, Second> > {
+    First& first;
+    Second& second;
+    
+    SinkPair(First& a, Second& b) : first(a), second(b) {}
+    void on_order(const OrderBook& book, const Order& order) {
+        first.on_order(book, order);
+        second.on_order(book, order);
+    }
+    void on_add(const OrderBook& book, const Order& order) {
+        first.on_add(book, order);
+        second.on_add(book, order);
+    }
+    void on_fill(const OrderBook& book, const Trade& trade) {
+        first.on_fill(book, trade);
+        second.on_fill(book, trade);
+    }
+    void on_cancel(const OrderBook& book, const Trade& trade) {
+        first.on_cancel(book, trade);
+        second.on_cancel(book, trade);
+    }
+    void on_level_change(const OrderBook& book, int side, const LevelChange& change) {
+        first.on_level_change(book, side, change);
+        second.on_level_change(book, side, change);
+    }
+    void on_snapshot(const OrderBook& book, const BookSnapshot& snapshot) {
+        first.on_snapshot(book, snapshot);
+        second.on_snapshot(book, snapshot);
+    }
+};
+
+template <typename First, typename Second>
+SinkPair<First, Second> make_sink_pair(First& a, Second& b) {
+    return SinkPair<First, Second>(a, b);
+}
+
+// Record a resting quantity change, side 1=buy, 2=sell
+template <typename Sink>
+void on_level_change(OrderBook& book, int side, const LevelChange& change, Sink& sink) {
+    if (change.qty_delta == 0) return;
+    if (book.track_auction) {
+        auction_update(book.auction, side, change.price, change.qty_delta);
+    }
+    sink.on_level_change(book, side, change);
+}
+
+void on_level_change(OrderBook& book, int side, const LevelChange& change) {
+    NullSink none;
+    on_level_change(book, side, change, none);
+}
+
 // Add order to book
-void add_order(OrderBook& book, const Order& order) {
+template <typename Sink>
+void add_order(OrderBook& book, const Order& order, Sink& sink) {
     if (order.orderqty <= 0) return;
     
     BookOrder book_order;
     book_order.applseqnum = order.applseqnum;
     book_order.price = order.price;
     book_order.qty = order.orderqty;
-    book_order.order_time = order.transacttime;
+    book_order.order_time = order.time_ms;
+    book_order.arrival = book.next_arrival++;
     
     // Handle market and best orders
     if (order.ordertype == '1') {  // Market order
@@ -232,16 +1056,30 @@ void add_order(OrderBook& book, const Order& order) {
         }
     }
     
-    // Add to order book
+    // Add to order book, replacing an order that reused the applseqnum
     if (order.side == 1) {
-        book.bid_book.add_order(book_order);
+        on_level_change(book, 1, book.bid_book.remove_order(book_order.applseqnum), sink);
+        on_level_change(book, 1, book.bid_book.add_order(book_order), sink);
     } else {
-        book.ask_book.add_order(book_order);
+        on_level_change(book, 2, book.ask_book.remove_order(book_order.applseqnum), sink);
+        on_level_change(book, 2, book.ask_book.add_order(book_order), sink);
     }
+    
+    if (book.sim) {
+        double opposite_best = order.side == 1 ? get_best_ask_price(book) : get_best_bid_price(book);
+        sim_on_resting_order(*book.sim, order.side, book_order, opposite_best, order.transacttime);
+    }
+    sink.on_add(book, order);
+}
+
+void add_order(OrderBook& book, const Order& order) {
+    NullSink none;
+    add_order(book, order, none);
 }
 
 // Execute trade
-void execute_trade(OrderBook& book, const Trade& trade) {
+template <typename Sink>
+void execute_trade(OrderBook& book, const Trade& trade, Sink& sink) {
     if (trade.exectype == 'f') {  // Filled
         // Update market statistics
         book.cumulative_volume += trade.tradeqty;
@@ -264,120 +1102,95 @@ void execute_trade(OrderBook& book, const Trade& trade) {
         
         // Update order book
         if (trade.bidapplseqnum != 0) {
-            book.bid_book.update_qty(trade.bidapplseqnum, -trade.tradeqty);
+            LevelChange change = book.bid_book.update_qty(trade.bidapplseqnum, -trade.tradeqty);
+            on_level_change(book, 1, change, sink);
+            if (book.sim) sim_on_level_decrease(*book.sim, 1, change, true, trade.time_ms, trade.transacttime);
         }
         
         if (trade.offerapplseqnum != 0) {
-            book.ask_book.update_qty(trade.offerapplseqnum, -trade.tradeqty);
+            LevelChange change = book.ask_book.update_qty(trade.offerapplseqnum, -trade.tradeqty);
+            on_level_change(book, 2, change, sink);
+            if (book.sim) sim_on_level_decrease(*book.sim, 2, change, true, trade.time_ms, trade.transacttime);
         }
+        
+        if (book.sim) sim_on_trade(*book.sim, trade);
+        sink.on_fill(book, trade);
     } else if (trade.exectype == '4') {  // Cancelled
         if (trade.bidapplseqnum != 0) {
-            book.bid_book.remove_order(trade.bidapplseqnum);
+            LevelChange change = book.bid_book.remove_order(trade.bidapplseqnum);
+            on_level_change(book, 1, change, sink);
+            if (book.sim) sim_on_level_decrease(*book.sim, 1, change, false, trade.time_ms, trade.transacttime);
         }
         if (trade.offerapplseqnum != 0) {
-            book.ask_book.remove_order(trade.offerapplseqnum);
+            LevelChange change = book.ask_book.remove_order(trade.offerapplseqnum);
+            on_level_change(book, 2, change, sink);
+            if (book.sim) sim_on_level_decrease(*book.sim, 2, change, false, trade.time_ms, trade.transacttime);
         }
+        sink.on_cancel(book, trade);
     }
 }
 
-// Comparison function for sorting bids (high to low)
-bool compare_bids_desc(const std::pair<double, int>& a, const std::pair<double, int>& b) {
-    return a.first > b.first;
-}
-
-// Comparison function for sorting asks (low to high)
-bool compare_asks_asc(const std::pair<double, int>& a, const std::pair<double, int>& b) {
-    return a.first < b.first;
+void execute_trade(OrderBook& book, const Trade& trade) {
+    NullSink none;
+    execute_trade(book, trade, none);
 }
 
 // Get top bids
 std::vector<std::pair<double, int> > get_top_bids(const OrderBook& book, int n) {
-    std::map<double, int> price_levels;
-    std::map<int, BookOrder>::const_iterator it;
-    
-    for (it = book.bid_book.orders.begin(); it != book.bid_book.orders.end(); ++it) {
-        price_levels[it->second.price] += it->second.qty;
-    }
-    
     std::vector<std::pair<double, int> > result;
-    std::map<double, int>::iterator level_it;
-    for (level_it = price_levels.begin(); level_it != price_levels.end(); ++level_it) {
-        result.push_back(*level_it);
-    }
-    
-    std::sort(result.begin(), result.end(), compare_bids_desc);
-    
-    if (result.size() > (size_t)n) {
-        result.resize(n);
+    std::map<double, PriceLevel>::const_reverse_iterator it;
+    for (it = book.bid_book.levels.rbegin(); it != book.bid_book.levels.rend() && (int)result.size() < n; ++it) {
+        result.push_back(std::make_pair(it->first, it->second.qty));
     }
     return result;
 }
 
 // Get top asks
 std::vector<std::pair<double, int> > get_top_asks(const OrderBook& book, int n) {
-    std::map<double, int> price_levels;
-    std::map<int, BookOrder>::const_iterator it;
-    
-    for (it = book.ask_book.orders.begin(); it != book.ask_book.orders.end(); ++it) {
-        price_levels[it->second.price] += it->second.qty;
-    }
-    
     std::vector<std::pair<double, int> > result;
-    std::map<double, int>::iterator level_it;
-    for (level_it = price_levels.begin(); level_it != price_levels.end(); ++level_it) {
-        result.push_back(*level_it);
-    }
-    
-    std::sort(result.begin(), result.end(), compare_asks_asc);
-    
-    if (result.size() > (size_t)n) {
-        result.resize(n);
+    std::map<double, PriceLevel>::const_iterator it;
+    for (it = book.ask_book.levels.begin(); it != book.ask_book.levels.end() && (int)result.size() < n; ++it) {
+        result.push_back(std::make_pair(it->first, it->second.qty));
     }
     return result;
 }
 
 // Get bottom bids (lowest prices)
 std::vector<std::pair<double, int> > get_bottom_bids(const OrderBook& book, int n) {
-    std::map<double, int> price_levels;
-    std::map<int, BookOrder>::const_iterator it;
-    
-    for (it = book.bid_book.orders.begin(); it != book.bid_book.orders.end(); ++it) {
-        price_levels[it->second.price] += it->second.qty;
-    }
-    
     std::vector<std::pair<double, int> > result;
-    std::map<double, int>::iterator level_it;
-    for (level_it = price_levels.begin(); level_it != price_levels.end(); ++level_it) {
-        result.push_back(*level_it);
-    }
-    
-    std::sort(result.begin(), result.end(), compare_asks_asc);  // Low to high
-    
-    if (result.size() > (size_t)n) {
-        result.resize(n);
+    std::map<double, PriceLevel>::const_iterator it;
+    for (it = book.bid_book.levels.begin(); it != book.bid_book.levels.end() && (int)result.size() < n; ++it) {
+        result.push_back(std::make_pair(it->first, it->second.qty));
     }
     return result;
 }
 
 // Get bottom asks (highest prices)
 std::vector<std::pair<double, int> > get_bottom_asks(const OrderBook& book, int n) {
-    std::map<double, int> price_levels;
-    std::map<int, BookOrder>::const_iterator it;
-    
-    for (it = book.ask_book.orders.begin(); it != book.ask_book.orders.end(); ++it) {
-        price_levels[it->second.price] += it->second.qty;
-    }
-    
     std::vector<std::pair<double, int> > result;
-    std::map<double, int>::iterator level_it;
-    for (level_it = price_levels.begin(); level_it != price_levels.end(); ++level_it) {
-        result.push_back(*level_it);
+    std::map<double, PriceLevel>::const_reverse_iterator it;
+    for (it = book.ask_book.levels.rbegin(); it != book.ask_book.levels.rend() && (int)result.size() < n; ++it) {
+        result.push_back(std::make_pair(it->first, it->second.qty));
     }
-    
-    std::sort(result.begin(), result.end(), compare_bids_desc);  // High to low
-    
-    if (result.size() > (size_t)n) {
-        result.resize(n);
+    return result;
+}
+
+// Order counts of the top bid levels, best first
+std::vector<int> get_top_bid_orders(const OrderBook& book, int n) {
+    std::vector<int> result;
+    std::map<double, PriceLevel>::const_reverse_iterator it;
+    for (it = book.bid_book.levels.rbegin(); it != book.bid_book.levels.rend() && (int)result.size() < n; ++it) {
+        result.push_back(it->second.orders);
+    }
+    return result;
+}
+
+// Order counts of the top ask levels, best first
+std::vector<int> get_top_ask_orders(const OrderBook& book, int n) {
+    std::vector<int> result;
+    std::map<double, PriceLevel>::const_iterator it;
+    for (it = book.ask_book.levels.begin(); it != book.ask_book.levels.end() && (int)result.size() < n; ++it) {
+        result.push_back(it->second.orders);
     }
     return result;
 }
@@ -399,286 +1212,5457 @@ void take_snapshot(OrderBook& book, long long clockatarrival, long long transact
     snapshot.nts = book.number_of_trades;
     snapshot.opx = book.opening_price;
     
+    snapshot.has_auction = false;
+    snapshot.iap = 0;
+    snapshot.iav = 0;
+    snapshot.iai = 0;
+    
+    snapshot.has_features = book.track_features;
+    snapshot.features = TopFeatures();
+    if (book.track_features) {
+        snapshot.features = compute_features(snapshot.best_bids, snapshot.best_asks, book.features.ofi);
+    }
+    
+    snapshot.has_order_counts = book.track_order_counts;
+    if (book.track_order_counts) {
+        snapshot.best_bid_orders = get_top_bid_orders(book, 5);
+        snapshot.best_ask_orders = get_top_ask_orders(book, 5);
+    }
+    
     book.snapshots.push_back(snapshot);
 }
 
-// Read orders
-void read_order_file(const std::string& filename, std::vector<Order>& orders) {
-    std::ifstream file(filename.c_str());
+// Reusable line and field buffers for the CSV readers
+struct ParseBuffers {
+    std::string line;
+    std::vector<std::string> fields;
+};
+
+// Split a CSV line into fields, reusing the field strings already allocated
+size_t split_csv_line(const std::string& line, std::vector<std::string>& fields) {
+    size_t count = 0;
+    if (fields.empty()) fields.resize(1);
+    fields[0].clear();
     
-    if (!file.is_open()) {
-        std::cout << "Cannot open file: " << filename << std::endl;
-        return;
+    for (size_t i = 0; i < line.length(); i++) {
+        char c = line[i];
+        if (c == ',') {
+            count++;
+            if (count >= fields.size()) fields.resize(count + 1);
+            fields[count].clear();
+        } else if (c != '\r') {
+            fields[count] += c;
+        }
     }
+    return count + 1;
+}
+
+// Convert an HHMMSSmmm time such as 93000100 to milliseconds since midnight
+long long hhmmssmmm_to_ms(long long t) {
+    long long hours = t / 10000000;
+    long long minutes = t / 100000 % 100;
+    long long seconds = t / 1000 % 100;
+    long long millis = t % 1000;
+    return ((hours * 60 + minutes) * 60 + seconds) * 1000 + millis;
+}
+
+// Convert milliseconds since midnight back to HHMMSSmmm
+long long ms_to_hhmmssmmm(long long ms) {
+    long long hours = ms / 3600000;
+    long long minutes = ms / 60000 % 60;
+    long long seconds = ms / 1000 % 60;
+    return hours * 10000000 + minutes * 100000 + seconds * 1000 + ms % 1000;
+}
+
+// Fill an order from split CSV fields, false if the row is too short
+bool parse_order_fields(const std::vector<std::string>& fields, size_t field_count, Order& order) {
+    if (field_count < 8) return false;
     
-    std::string line;
-    std::getline(file, line);  // Skip header
-    std::cout << "Header: " << line << std::endl;
+    order.clockatarrival = std::atoll(fields[0].c_str());
+    order.sequenceno = std::atoi(fields[1].c_str());
+    order.transacttime = std::atoll(fields[2].c_str());
+    order.time_ms = hhmmssmmm_to_ms(order.transacttime);
+    order.applseqnum = std::atoi(fields[3].c_str());
+    order.side = std::atoi(fields[4].c_str());
+    order.ordertype = fields[5][0];
+    order.price = std::atof(fields[6].c_str());
+    order.orderqty = std::atoi(fields[7].c_str());
+    return true;
+}
+
+// Fill a trade from split CSV fields, false if the row is too short
+bool parse_trade_fields(const std::vector<std::string>& fields, size_t field_count, Trade& trade) {
+    if (field_count < 10) return false;
     
-    int line_num = 1;
+    trade.clockatarrival = std::atoll(fields[0].c_str());
+    trade.sequenceno = std::atoi(fields[1].c_str());
+    trade.transacttime = std::atoll(fields[2].c_str());
+    trade.time_ms = hhmmssmmm_to_ms(trade.transacttime);
+    trade.applseqnum = std::atoi(fields[3].c_str());
+    trade.exectype = fields[4][0];
+    trade.tradeprice = std::atof(fields[5].c_str());
+    trade.tradeqty = std::atoi(fields[6].c_str());
+    trade.trademoney = std::atof(fields[7].c_str());
+    trade.bidapplseqnum = std::atoi(fields[8].c_str());
+    trade.offerapplseqnum = std::atoi(fields[9].c_str());
+    return true;
+}
+
+// Read orders, false if a price is off the tick grid. A file that
+// cannot be opened reads as empty.
+bool read_order_file(const std::string& filename, OrderColumns& orders, ParseBuffers& buf) {
+    std::ifstream file(filename.c_str());
+    
+    if (!file.is_open()) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return true;
+    }
+    
+    std::string& line = buf.line;
+    std::vector<std::string>& fields = buf.fields;
+    std::getline(file, line);  // Skip header
+    if (verbose_log) std::cout << "Header: " << line << std::endl;
+    
+    int line_num = 1;
     while (std::getline(file, line)) {
         line_num++;
         if (line.empty()) continue;
         
         try {
-            std::vector<std::string> fields;
-            std::string field = "";
+            size_t field_count = split_csv_line(line, fields);
             
-            for (size_t i = 0; i < line.length(); i++) {
-                char c = line[i];
-                if (c == ',' || c == '\r') {
-                    if (c == ',') {
-                        fields.push_back(field);
-                        field = "";
-                    }
-                } else {
-                    field += c;
+            Order order;
+            if (parse_order_fields(fields, field_count, order)) {
+                if (!on_price_tick(order.price)) {
+                    print_tick_error(filename, line_num, order.price);
+                    return false;
                 }
+                orders.push_back(order);
+            } else {
+                std::cerr << "Warning: Line " << line_num << " has only " << field_count << " fields" << std::endl;
             }
-            fields.push_back(field);  // Last field
+        } catch (const std::exception& e) {
+            std::cerr << "Error parsing line " << line_num << ": " << e.what() << std::endl;
+            std::cerr << "Line content: " << line << std::endl;
+        }
+    }
+    
+    file.close();
+    if (verbose_log) std::cout << "Read " << orders.size() << " orders" << std::endl;
+    return true;
+}
+
+bool read_order_file(const std::string& filename, OrderColumns& orders) {
+    ParseBuffers buf;
+    return read_order_file(filename, orders, buf);
+}
+
+// Read trades, false if a price is off the tick grid. A file that
+// cannot be opened reads as empty.
+bool read_trade_file(const std::string& filename, TradeColumns& trades, ParseBuffers& buf) {
+    std::ifstream file(filename.c_str());
+    
+    if (!file.is_open()) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return true;
+    }
+    
+    std::string& line = buf.line;
+    std::vector<std::string>& fields = buf.fields;
+    std::getline(file, line);  // Skip header
+    if (verbose_log) std::cout << "Header: " << line << std::endl;
+    
+    int line_num = 1;
+    while (std::getline(file, line)) {
+        line_num++;
+        if (line.empty()) continue;
+        
+        try {
+            size_t field_count = split_csv_line(line, fields);
             
-            if (fields.size() >= 8) {
-                Order order;
-                order.clockatarrival = std::atoll(fields[0].c_str());
-                order.sequenceno = std::atoi(fields[1].c_str());
-                order.transacttime = std::atoll(fields[2].c_str());
-                order.applseqnum = std::atoi(fields[3].c_str());
-                order.side = std::atoi(fields[4].c_str());
-                order.ordertype = fields[5][0];
-                order.price = std::atof(fields[6].c_str());
-                order.orderqty = std::atoi(fields[7].c_str());
-                
-                orders.push_back(order);
+            Trade trade;
+            if (parse_trade_fields(fields, field_count, trade)) {
+                if (!on_price_tick(trade.tradeprice)) {
+                    print_tick_error(filename, line_num, trade.tradeprice);
+                    return false;
+                }
+                trades.push_back(trade);
             } else {
-                std::cout << "Warning: Line " << line_num << " has only " << fields.size() << " fields" << std::endl;
+                std::cerr << "Warning: Line " << line_num << " has only " << field_count << " fields" << std::endl;
             }
         } catch (const std::exception& e) {
-            std::cout << "Error parsing line " << line_num << ": " << e.what() << std::endl;
-            std::cout << "Line content: " << line << std::endl;
+            std::cerr << "Error parsing line " << line_num << ": " << e.what() << std::endl;
+            std::cerr << "Line content: " << line << std::endl;
+        }
+    }
+    
+    file.close();
+    if (verbose_log) std::cout << "Read " << trades.size() << " trades" << std::endl;
+    return true;
+}
+
+bool read_trade_file(const std::string& filename, TradeColumns& trades) {
+    ParseBuffers buf;
+    return read_trade_file(filename, trades, buf);
+}
+
+bool parse_row(const std::vector<std::string>& fields, size_t field_count, Order& order) {
+    return parse_order_fields(fields, field_count, order);
+}
+
+bool parse_row(const std::vector<std::string>& fields, size_t field_count, Trade& trade) {
+    return parse_trade_fields(fields, field_count, trade);
+}
+
+long long row_time_ms(const Order& order) { return order.time_ms; }
+long long row_time_ms(const Trade& trade) { return trade.time_ms; }
+
+double row_price(const Order& order) { return order.price; }
+double row_price(const Trade& trade) { return trade.tradeprice; }
+
+// Sidecar index of an input file (<file>.idx), built on first use: one entry
+// per INPUT_INDEX_BLOCK rows with the byte offset and the time and applseqnum
+// range of the block. Rows are counted like the readers count them.
+const char INPUT_INDEX_MAGIC[4] = {'O', 'B', 'I', 'X'};
+const int INPUT_INDEX_VERSION = 2;
+const long long INPUT_INDEX_BLOCK = 4096;
+
+struct IndexBlock {
+    long long offset;       // byte offset of the block's first row
+    long long row;          // number of that row, 0 is the first after the header
+    int min_time_ms;
+    int max_time_ms;
+    int min_seq;            // applseqnum range
+    int max_seq;
+};
+
+struct InputIndex {
+    long long file_size;    // the file the index was built from
+    long long file_mtime;
+    long long num_rows;
+    int time_sorted;        // 1 if row times never decrease, needed to stop reading at a time
+    long long ticks_per_unit;   // tick the prices were checked against, see set_price_tick
+    std::vector<IndexBlock> blocks;
+};
+
+// Size and modification time of a file, false if it cannot be read
+bool file_stamp(const std::string& filename, long long& size, long long& mtime) {
+#ifndef _WIN32
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return false;
+    size = (long long)st.st_size;
+    mtime = (long long)st.st_mtime;
+    return true;
+#else
+    std::ifstream in(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!in.is_open()) return false;
+    size = (long long)in.tellg();
+    mtime = 0;
+    return true;
+#endif
+}
+
+template <typename Record>
+bool build_input_index(const std::string& filename, InputIndex& index) {
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file.is_open()) return false;
+    index.num_rows = 0;
+    index.time_sorted = 1;
+    index.ticks_per_unit = ticks_per_unit;
+    index.blocks.clear();
+    
+    ParseBuffers buf;
+    std::getline(file, buf.line);  // Skip header
+    long long offset = (long long)buf.line.size() + 1;
+    long long line_num = 1;
+    long long last_time = -1;
+    Record record;
+    while (std::getline(file, buf.line)) {
+        long long line_offset = offset;
+        offset += (long long)buf.line.size() + 1;
+        line_num++;
+        if (buf.line.empty()) continue;
+        size_t field_count = split_csv_line(buf.line, buf.fields);
+        if (!parse_row(buf.fields, field_count, record)) continue;
+        if (!on_price_tick(row_price(record))) {
+            print_tick_error(filename, line_num, row_price(record));
+            return false;
+        }
+        
+        int time_ms = (int)row_time_ms(record);
+        if (index.num_rows % INPUT_INDEX_BLOCK == 0) {
+            IndexBlock block;
+            block.offset = line_offset;
+            block.row = index.num_rows;
+            block.min_time_ms = block.max_time_ms = time_ms;
+            block.min_seq = block.max_seq = record.applseqnum;
+            index.blocks.push_back(block);
+        }
+        IndexBlock& block = index.blocks.back();
+        block.min_time_ms = std::min(block.min_time_ms, time_ms);
+        block.max_time_ms = std::max(block.max_time_ms, time_ms);
+        block.min_seq = std::min(block.min_seq, record.applseqnum);
+        block.max_seq = std::max(block.max_seq, record.applseqnum);
+        if (time_ms < last_time) index.time_sorted = 0;
+        last_time = time_ms;
+        index.num_rows++;
+    }
+    return true;
+}
+
+bool read_input_index(const std::string& filename, InputIndex& index) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    char magic[4];
+    int version = 0;
+    long long num_blocks = 0;
+    in.read(magic, 4);
+    in.read((char*)&version, sizeof(version));
+    in.read((char*)&index.file_size, sizeof(index.file_size));
+    in.read((char*)&index.file_mtime, sizeof(index.file_mtime));
+    in.read((char*)&index.num_rows, sizeof(index.num_rows));
+    in.read((char*)&index.time_sorted, sizeof(index.time_sorted));
+    in.read((char*)&index.ticks_per_unit, sizeof(index.ticks_per_unit));
+    in.read((char*)&num_blocks, sizeof(num_blocks));
+    if (!in || std::memcmp(magic, INPUT_INDEX_MAGIC, 4) != 0 || version != INPUT_INDEX_VERSION ||
+        num_blocks < 0 || num_blocks > index.num_rows / INPUT_INDEX_BLOCK + 1) {
+        return false;
+    }
+    index.blocks.resize((size_t)num_blocks);
+    if (num_blocks > 0) in.read((char*)&index.blocks[0], num_blocks * sizeof(IndexBlock));
+    return (bool)in;
+}
+
+bool write_input_index(const std::string& filename, const InputIndex& index) {
+    std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+    long long num_blocks = (long long)index.blocks.size();
+    out.write(INPUT_INDEX_MAGIC, 4);
+    out.write((const char*)&INPUT_INDEX_VERSION, sizeof(INPUT_INDEX_VERSION));
+    out.write((const char*)&index.file_size, sizeof(index.file_size));
+    out.write((const char*)&index.file_mtime, sizeof(index.file_mtime));
+    out.write((const char*)&index.num_rows, sizeof(index.num_rows));
+    out.write((const char*)&index.time_sorted, sizeof(index.time_sorted));
+    out.write((const char*)&index.ticks_per_unit, sizeof(index.ticks_per_unit));
+    out.write((const char*)&num_blocks, sizeof(num_blocks));
+    if (num_blocks > 0) out.write((const char*)&index.blocks[0], num_blocks * sizeof(IndexBlock));
+    return out.good();
+}
+
+// Index of an input file from its sidecar, rebuilt when missing or stale; a
+// rebuild checks every price against the tick
+template <typename Record>
+bool load_input_index(const std::string& filename, InputIndex& index) {
+    long long size = 0;
+    long long mtime = 0;
+    if (!file_stamp(filename, size, mtime)) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    std::string index_file = filename + ".idx";
+    if (read_input_index(index_file, index) && index.file_size == size && index.file_mtime == mtime &&
+        index.ticks_per_unit == ticks_per_unit) {
+        return true;
+    }
+    
+    if (!build_input_index<Record>(filename, index)) return false;
+    index.file_size = size;
+    index.file_mtime = mtime;
+    if (!write_input_index(index_file, index) && verbose_log) {
+        std::cout << "Cannot write index " << index_file << ", it will be rebuilt next time" << std::endl;
+    }
+    return true;
+}
+
+// Read rows first_row onwards, seeking to the block that holds first_row, until
+// the first row later than max_time_ms (when the file is time sorted). Returns
+// true if the file was read to its end.
+template <typename Record, typename Columns>
+bool read_rows(const std::string& filename, const InputIndex& index, long long first_row,
+               long long max_time_ms, Columns& rows) {
+    rows.clear();
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file.is_open()) return true;
+    
+    ParseBuffers buf;
+    long long row = 0;
+    size_t b = 0;
+    while (b + 1 < index.blocks.size() && index.blocks[b + 1].row <= first_row) b++;
+    if (b < index.blocks.size() && index.blocks[b].row <= first_row) {
+        file.seekg(index.blocks[b].offset);
+        row = index.blocks[b].row;
+    } else {
+        std::getline(file, buf.line);  // Skip header
+    }
+    
+    Record record;
+    while (std::getline(file, buf.line)) {
+        if (buf.line.empty()) continue;
+        size_t field_count = split_csv_line(buf.line, buf.fields);
+        if (!parse_row(buf.fields, field_count, record)) continue;
+        if (row++ < first_row) continue;
+        if (index.time_sorted && row_time_ms(record) > max_time_ms) return false;
+        rows.push_back(record);
+    }
+    return true;
+}
+
+// Comparison function for sorting events
+// Ties keep file order, so any run of consecutive rows sorts the same way on its own
+bool compare_events(const Event& a, const Event& b) {
+    if (a.time != b.time) return a.time < b.time;
+    if (a.is_order != b.is_order) return a.is_order;
+    return a.index < b.index;
+}
+
+// Merge orders and trades into one time-ordered event list
+void build_events(const OrderColumns& orders,
+                  const TradeColumns& trades,
+                  std::vector<Event>& events) {
+    events.clear();
+    events.reserve(orders.size() + trades.size());
+    
+    const std::vector<int>& order_times = orders.time_ms;
+    for (size_t i = 0; i < order_times.size(); i++) {
+        Event e;
+        e.is_order = true;
+        e.time = order_times[i];
+        e.index = i;
+        events.push_back(e);
+    }
+    
+    const std::vector<int>& trade_times = trades.time_ms;
+    for (size_t i = 0; i < trade_times.size(); i++) {
+        Event e;
+        e.is_order = false;
+        e.time = trade_times[i];
+        e.index = i;
+        events.push_back(e);
+    }
+    
+    std::sort(events.begin(), events.end(), compare_events);
+}
+
+// Define opening time (9:30:00), in milliseconds since midnight
+const long long OPENING_TIME = (9 * 3600 + 30 * 60) * 1000LL;
+
+// Max distance in milliseconds between an order and a trade for the trade to count as its immediate fill
+const long long IMMEDIATE_TRADE_WINDOW = 1000;
+
+// Trading session phases, in time order
+enum SessionPhase {
+    PHASE_PRE_OPEN,
+    PHASE_OPENING_AUCTION,
+    PHASE_PAUSE,
+    PHASE_CONTINUOUS_AM,
+    PHASE_LUNCH_BREAK,
+    PHASE_CONTINUOUS_PM,
+    PHASE_CLOSING_AUCTION,
+    PHASE_CLOSED,
+    NUM_PHASES
+};
+
+// Static description of a session phase
+struct PhaseInfo {
+    const char* name;               // used on the command line
+    const char* label;
+    long long start_ms;             // milliseconds since midnight
+    bool rests_immediate_orders;    // market/best orders rest in the book even if filled at once
+    bool call_auction;              // book holds crossed orders waiting for an auction
+};
+
+const PhaseInfo PHASE_INFO[NUM_PHASES] = {
+    { "preopen", "Pre-open",             0,                                true,  false },
+    { "auction", "Opening call auction", (9 * 3600 + 15 * 60) * 1000LL,    true,  true  },
+    { "pause",   "Pause",                (9 * 3600 + 25 * 60) * 1000LL,    true,  false },
+    { "am",      "Continuous morning",   OPENING_TIME,                     false, false },
+    { "lunch",   "Lunch break",          (11 * 3600 + 30 * 60) * 1000LL,   false, false },
+    { "pm",      "Continuous afternoon", 13 * 3600 * 1000LL,               false, false },
+    { "close",   "Closing call auction", (14 * 3600 + 57 * 60) * 1000LL,   false, true  },
+    { "closed",  "Closed",               15 * 3600 * 1000LL,               false, false }
+};
+
+// Phase a time (milliseconds since midnight) falls in
+SessionPhase get_session_phase(long long time_ms) {
+    int phase = NUM_PHASES - 1;
+    while (phase > 0 && time_ms < PHASE_INFO[phase].start_ms) phase--;
+    return (SessionPhase)phase;
+}
+
+// Look up a phase by its command line name, NUM_PHASES if unknown
+SessionPhase find_session_phase(const std::string& name) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        if (name == PHASE_INFO[i].name) return (SessionPhase)i;
+    }
+    return NUM_PHASES;
+}
+
+// Which events take a snapshot in each phase
+struct SessionPolicy {
+    bool snapshot_orders[NUM_PHASES];
+    bool snapshot_trades[NUM_PHASES];
+};
+
+// Default policy: orders snapshot from the open on, trades always
+void init_session_policy(SessionPolicy& policy) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        policy.snapshot_orders[i] = i >= PHASE_CONTINUOUS_AM;
+        policy.snapshot_trades[i] = true;
+    }
+}
+
+// Snapshot orders and trades only in the listed phases, e.g. "am,pm"
+bool set_snapshot_phases(SessionPolicy& policy, const std::string& list) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        policy.snapshot_orders[i] = false;
+        policy.snapshot_trades[i] = false;
+    }
+    
+    std::vector<std::string> names;
+    size_t count = split_csv_line(list, names);
+    for (size_t i = 0; i < count; i++) {
+        SessionPhase phase = find_session_phase(names[i]);
+        if (phase == NUM_PHASES) {
+            std::cerr << "Unknown session phase: " << names[i] << std::endl;
+            return false;
+        }
+        policy.snapshot_orders[phase] = true;
+        policy.snapshot_trades[phase] = true;
+    }
+    return true;
+}
+
+// Event counts of one phase
+struct PhaseStats {
+    long long orders;
+    long long fills;
+    long long cancels;
+    long long volume;
+    long long snapshots;
+};
+
+// Session tracking carried across the events of one replay
+struct SessionState {
+    SessionPolicy policy;
+    SessionPhase phase;     // phase of the last event
+    bool started;
+    PhaseStats stats[NUM_PHASES];
+};
+
+void init_session_state(SessionState& session, const SessionPolicy& policy) {
+    session.policy = policy;
+    session.phase = PHASE_PRE_OPEN;
+    session.started = false;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        PhaseStats& s = session.stats[i];
+        s.orders = 0;
+        s.fills = 0;
+        s.cancels = 0;
+        s.volume = 0;
+        s.snapshots = 0;
+    }
+}
+
+// Advance the session to the phase of an event time
+SessionPhase enter_phase(SessionState& session, long long time_ms) {
+    SessionPhase phase = get_session_phase(time_ms);
+    if (!session.started || phase != session.phase) {
+        if (verbose_log) std::cout << "Session phase: " << PHASE_INFO[phase].label << std::endl;
+        session.phase = phase;
+        session.started = true;
+    }
+    return phase;
+}
+
+void print_phase_stats(const SessionState& session, std::ostream& out) {
+    out << std::left << std::setw(22) << "phase"
+        << std::right << std::setw(10) << "orders" << std::setw(10) << "fills"
+        << std::setw(10) << "cancels" << std::setw(14) << "volume"
+        << std::setw(11) << "snapshots" << std::endl;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        const PhaseStats& s = session.stats[i];
+        if (s.orders == 0 && s.fills == 0 && s.cancels == 0) continue;
+        out << std::left << std::setw(22) << PHASE_INFO[i].label
+            << std::right << std::setw(10) << s.orders << std::setw(10) << s.fills
+            << std::setw(10) << s.cancels << std::setw(14) << s.volume
+            << std::setw(11) << s.snapshots << std::endl;
+    }
+}
+
+// Allocations of the process, counted only for the run report (--report).
+// Each thread adds to its own counter, linked into a list that the report
+// sums once the other threads are done, so counting writes nothing shared.
+// Counters come from malloc and are never freed, since operator new cannot
+// allocate them.
+struct AllocationCounter {
+    long long count;
+    long long bytes;
+    AllocationCounter* next;
+};
+
+bool count_allocations = false;     // set before any thread starts
+std::atomic<AllocationCounter*> allocation_counters(NULL);
+thread_local AllocationCounter* thread_allocations = NULL;
+
+void count_allocation(size_t size) {
+    AllocationCounter* c = thread_allocations;
+    if (c == NULL) {
+        c = (AllocationCounter*)std::calloc(1, sizeof(AllocationCounter));
+        if (c == NULL) return;
+        c->next = allocation_counters.load();
+        while (!allocation_counters.compare_exchange_weak(c->next, c)) {}
+        thread_allocations = c;
+    }
+    c->count++;
+    c->bytes += (long long)size;
+}
+
+void sum_allocations(long long& count, long long& bytes) {
+    count = 0;
+    bytes = 0;
+    for (AllocationCounter* c = allocation_counters.load(); c != NULL; c = c->next) {
+        count += c->count;
+        bytes += c->bytes;
+    }
+}
+
+// Kept out of line: GCC would otherwise inline the free below into callers
+// and warn that it releases memory from operator new (-Wmismatched-new-delete)
+#ifdef __GNUC__
+#define ALLOCATOR_NOINLINE __attribute__((noinline))
+#else
+#define ALLOCATOR_NOINLINE
+#endif
+
+ALLOCATOR_NOINLINE void* operator new(size_t size) {
+    if (count_allocations) count_allocation(size);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+ALLOCATOR_NOINLINE void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+// Wall and CPU time of one stage of a run (--report). Stages interleaved in
+// the replay loop are timed per call and have no CPU time (cpu_s < 0).
+struct StageStats {
+    std::string name;
+    double wall_s;
+    double cpu_s;
+    long long items;        // orders, trades, events or snapshots
+    long long bytes;        // bytes read or written, 0 when not applicable
+};
+
+struct RunReport {
+    std::vector<StageStats> stages;
+    std::chrono::steady_clock::time_point start;
+    double start_cpu_s;     // process CPU time at start
+    double join_s;          // replay loop time in the look-ahead window
+    double write_s;         // replay loop time handing snapshot rows to the output
+};
+
+// CPU time of the calling thread
+double thread_cpu_seconds() {
+#if defined(_WIN32) || !defined(CLOCK_THREAD_CPUTIME_ID)
+    return (double)std::clock() / CLOCKS_PER_SEC;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// CPU time of every thread of the process
+double process_cpu_seconds() {
+    return (double)std::clock() / CLOCKS_PER_SEC;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// Peak resident set size in bytes, 0 where unknown
+long long peak_rss_bytes() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (long long)usage.ru_maxrss;
+#else
+    return (long long)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void init_run_report(RunReport& report) {
+    report.stages.clear();
+    report.start = std::chrono::steady_clock::now();
+    report.start_cpu_s = process_cpu_seconds();
+    report.join_s = 0;
+    report.write_s = 0;
+}
+
+// Start and end of one stage run on the calling thread
+struct StageTimer {
+    std::chrono::steady_clock::time_point wall;
+    double cpu;
+};
+
+void start_stage(StageTimer& t) {
+    t.wall = std::chrono::steady_clock::now();
+    t.cpu = thread_cpu_seconds();
+}
+
+void add_stage(RunReport* report, const char* name, double wall_s, double cpu_s, long long items, long long bytes) {
+    if (!report) return;
+    StageStats s;
+    s.name = name;
+    s.wall_s = wall_s;
+    s.cpu_s = cpu_s;
+    s.items = items;
+    s.bytes = bytes;
+    report->stages.push_back(s);
+}
+
+void end_stage(RunReport* report, const char* name, const StageTimer& t, long long items, long long bytes) {
+    if (report) add_stage(report, name, seconds_since(t.wall), thread_cpu_seconds() - t.cpu, items, bytes);
+}
+
+// Options shared by every replay mode
+struct ReplayOptions {
+    SessionPolicy session;
+    bool phase_stats;       // print per-phase statistics after the replay
+    bool auction;           // maintain the call-auction calculator, add iap/iav/iai columns
+    long long checkpoint_every;     // applied events between checkpoints, 0 for none
+    bool resume;            // continue from the last checkpoint of the output
+    std::string shm_name;   // shared memory to publish each snapshot to, empty for none
+    bool features;          // add microstructure feature columns to the snapshots
+    std::string feature_stream;     // file for a feature row after every event, empty for none
+    bool order_counts;      // add per-level order count columns to the snapshots
+    bool async_output;      // write the snapshot output from a writer thread
+    bool direct_io;         // open the output with O_DIRECT, bypassing the page cache
+    int format_threads;     // threads formatting snapshot rows, -1 for one per spare core
+    bool compress;          // compress the outputs, see OBZ_MAGIC in book_reader.h
+    RunReport* report;      // stage timings are added here when set (--report)
+};
+
+void init_replay_options(ReplayOptions& opts) {
+    init_session_policy(opts.session);
+    opts.phase_stats = false;
+    opts.auction = false;
+    opts.checkpoint_every = 0;
+    opts.resume = false;
+    opts.shm_name.clear();
+    opts.features = false;
+    opts.feature_stream.clear();
+    opts.order_counts = false;
+    opts.async_output = true;
+    opts.direct_io = false;
+    opts.format_threads = -1;
+    opts.compress = false;
+    opts.report = NULL;
+}
+
+// Take a snapshot for an event in the given phase
+void take_event_snapshot(OrderBook& book, long long clockatarrival, long long transacttime,
+                         SessionPhase phase) {
+    take_snapshot(book, clockatarrival, transacttime);
+    
+    if (book.track_auction && PHASE_INFO[phase].call_auction) {
+        AuctionResult auction = compute_auction(book.auction);
+        BookSnapshot& snapshot = book.snapshots.back();
+        snapshot.has_auction = true;
+        snapshot.iap = auction.price;
+        snapshot.iav = auction.volume;
+        snapshot.iai = auction.imbalance;
+    }
+}
+
+// Market ('1') and best ('u') orders are priced from the book when they arrive
+bool is_market_or_best(const Order& order) {
+    return order.ordertype == '1' || order.ordertype == 'u';
+}
+
+// Apply one order event, returns true if a snapshot was taken
+template <typename Sink>
+bool apply_order_event(OrderBook& book, const Order& order,
+                       bool is_immediate_market_order, SessionState& session, Sink& sink) {
+    SessionPhase phase = enter_phase(session, order.time_ms);
+    PhaseStats& stats = session.stats[phase];
+    stats.orders++;
+    sink.on_order(book, order);
+    
+    if (PHASE_INFO[phase].rests_immediate_orders || !is_immediate_market_order) {
+        add_order(book, order, sink);
+    }
+    if (book.track_features) update_features(book);
+    
+    if (session.policy.snapshot_orders[phase] && !is_immediate_market_order) {
+        take_event_snapshot(book, order.clockatarrival, order.transacttime, phase);
+        sink.on_snapshot(book, book.snapshots.back());
+        stats.snapshots++;
+        return true;
+    }
+    return false;
+}
+
+// Apply one trade event, returns true if a snapshot was taken
+template <typename Sink>
+bool apply_trade_event(OrderBook& book, const Trade& trade, SessionState& session, Sink& sink) {
+    SessionPhase phase = enter_phase(session, trade.time_ms);
+    PhaseStats& stats = session.stats[phase];
+    if (trade.exectype == 'f') {
+        stats.fills++;
+        stats.volume += trade.tradeqty;
+    } else if (trade.exectype == '4') {
+        stats.cancels++;
+    }
+    
+    execute_trade(book, trade, sink);
+    if (book.track_features) update_features(book);
+    
+    if (session.policy.snapshot_trades[phase]) {
+        take_event_snapshot(book, trade.clockatarrival, trade.transacttime, phase);
+        sink.on_snapshot(book, book.snapshots.back());
+        stats.snapshots++;
+        return true;
+    }
+    return false;
+}
+
+// Write snapshot CSV header
+void write_snapshot_header(std::ostream& out, const ReplayOptions& opts) {
+    out << "clockatarrival,transacttime,"
+        << "best_bid_1_price,best_bid_1_qty,best_bid_2_price,best_bid_2_qty,"
+        << "best_bid_3_price,best_bid_3_qty,best_bid_4_price,best_bid_4_qty,"
+        << "best_bid_5_price,best_bid_5_qty,"
+        << "best_ask_1_price,best_ask_1_qty,best_ask_2_price,best_ask_2_qty,"
+        << "best_ask_3_price,best_ask_3_qty,best_ask_4_price,best_ask_4_qty,"
+        << "best_ask_5_price,best_ask_5_qty,"
+        << "worst_bid_1_price,worst_bid_1_qty,worst_bid_2_price,worst_bid_2_qty,"
+        << "worst_bid_3_price,worst_bid_3_qty,worst_bid_4_price,worst_bid_4_qty,"
+        << "worst_bid_5_price,worst_bid_5_qty,"
+        << "worst_ask_1_price,worst_ask_1_qty,worst_ask_2_price,worst_ask_2_qty,"
+        << "worst_ask_3_price,worst_ask_3_qty,worst_ask_4_price,worst_ask_4_qty,"
+        << "worst_ask_5_price,worst_ask_5_qty,"
+        << "cvl,lpr,cto,nts,opx";
+    if (opts.auction) out << ",iap,iav,iai";
+    if (opts.features) out << ",mid,spread,imb,micro,wmid,ofi";
+    if (opts.order_counts) {
+        out << ",best_bid_1_orders,best_bid_2_orders,best_bid_3_orders,best_bid_4_orders,best_bid_5_orders"
+            << ",best_ask_1_orders,best_ask_2_orders,best_ask_3_orders,best_ask_4_orders,best_ask_5_orders";
+    }
+    out << "\n";
+}
+
+// Write one level group (5 price/qty pairs, empty when missing)
+void write_levels(std::ostream& out, const std::vector<std::pair<double, int> >& levels) {
+    for (int i = 0; i < 5; i++) {
+        if (i < (int)levels.size()) {
+            out << "," << std::fixed << std::setprecision(price_decimals)
+                << levels[i].first << "," << levels[i].second;
+        } else {
+            out << ",,";
+        }
+    }
+}
+
+// Write the feature columns; the price features are empty for a one-sided book
+void write_features(std::ostream& out, const TopFeatures& f) {
+    if (f.two_sided) {
+        out << "," << std::fixed << std::setprecision(price_decimals + 1) << f.mid
+            << "," << std::setprecision(price_decimals) << f.spread
+            << "," << std::setprecision(4) << f.imbalance
+            << "," << f.microprice
+            << "," << f.weighted_mid;
+    } else {
+        out << ",,,,,";
+    }
+    out << "," << f.ofi;
+}
+
+// Write 5 level order counts, empty when missing
+void write_counts(std::ostream& out, const std::vector<int>& counts) {
+    for (int i = 0; i < 5; i++) {
+        out << ",";
+        if (i < (int)counts.size()) out << counts[i];
+    }
+}
+
+// Write one snapshot CSV row
+void write_snapshot_row(std::ostream& out, const BookSnapshot& snapshot, const ReplayOptions& opts) {
+    out << snapshot.clockatarrival << "," << snapshot.transacttime;
+    
+    write_levels(out, snapshot.best_bids);
+    write_levels(out, snapshot.best_asks);
+    write_levels(out, snapshot.worst_bids);
+    write_levels(out, snapshot.worst_asks);
+    
+    out << "," << snapshot.cvl
+        << "," << std::fixed << std::setprecision(price_decimals) << snapshot.lpr
+        << "," << snapshot.cto
+        << "," << snapshot.nts
+        << "," << std::fixed << std::setprecision(price_decimals) << snapshot.opx;
+    
+    if (opts.auction) {
+        if (snapshot.has_auction) {
+            out << "," << std::fixed << std::setprecision(price_decimals) << snapshot.iap
+                << "," << snapshot.iav << "," << snapshot.iai;
+        } else {
+            out << ",,,";
+        }
+    }
+    if (opts.features) {
+        if (snapshot.has_features) {
+            write_features(out, snapshot.features);
+        } else {
+            out << ",,,,,,";
+        }
+    }
+    if (opts.order_counts) {
+        if (snapshot.has_order_counts) {
+            write_counts(out, snapshot.best_bid_orders);
+            write_counts(out, snapshot.best_ask_orders);
+        } else {
+            out << ",,,,,,,,,,";
+        }
+    }
+    
+    out << "\n";
+}
+
+// Output buffer written to disk by its own thread (process_events). Full
+// buffers are queued for the writer thread and the book thread continues in
+// a free one; it only waits when every buffer is queued, i.e. the disk has
+// fallen ASYNC_BUFFERS buffers behind, and on flush(), which returns once all
+// bytes are in the file. With O_DIRECT the page cache is bypassed: buffers are
+// aligned and written in whole blocks, and the unaligned tail goes through a
+// second, buffered descriptor and is rewritten with the next block.
+const size_t ASYNC_BUFFER_SIZE = OBZ_MAX_BLOCK;
+const int ASYNC_BUFFERS = 4;
+const size_t DIRECT_IO_ALIGN = 4096;
+
+// Block compressor of the OBZ format (book_reader.h). Greedy LZ77 over a hash
+// of the next 4 bytes, one candidate per hash; CSV rows repeat prices, qtys
+// and timestamp prefixes within a few rows, well inside the 64 KiB window.
+const int OBZ_HASH_BITS = 14;
+const size_t OBZ_MAX_OFFSET = 65535;
+
+// Worst case: incompressible input grows by one length byte per 255
+size_t obz_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+unsigned char* obz_write_length(unsigned char* out, size_t len) {
+    for (; len >= 255; len -= 255) *out++ = 255;
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+unsigned char* obz_write_sequence(unsigned char* out, const unsigned char* literals, size_t num_literals,
+                                  size_t offset, size_t match) {
+    size_t match_code = match ? match - OBZ_MIN_MATCH : 0;
+    *out++ = (unsigned char)((std::min(num_literals, (size_t)15) << 4) | std::min(match_code, (size_t)15));
+    if (num_literals >= 15) out = obz_write_length(out, num_literals - 15);
+    std::memcpy(out, literals, num_literals);
+    out += num_literals;
+    if (match) {
+        *out++ = (unsigned char)(offset & 255);
+        *out++ = (unsigned char)(offset >> 8);
+        if (match_code >= 15) out = obz_write_length(out, match_code - 15);
+    }
+    return out;
+}
+
+// Compress src into dst (obz_bound(size) bytes), returns the stored size
+size_t obz_compress_block(const unsigned char* src, size_t size, unsigned char* dst, uint32_t* table) {
+    std::memset(table, 0, sizeof(uint32_t) << OBZ_HASH_BITS);
+    unsigned char* out = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + OBZ_MIN_MATCH < size) {
+        uint32_t v;
+        std::memcpy(&v, src + i, 4);
+        uint32_t h = (v * 2654435761u) >> (32 - OBZ_HASH_BITS);
+        size_t candidate = table[h];    // position + 1, 0 for none
+        table[h] = (uint32_t)(i + 1);
+        if (candidate == 0 || i + 1 - candidate > OBZ_MAX_OFFSET ||
+            std::memcmp(src + candidate - 1, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t ref = candidate - 1;
+        size_t match = OBZ_MIN_MATCH;
+        while (i + match < size && src[ref + match] == src[i + match]) match++;
+        out = obz_write_sequence(out, src + anchor, i - anchor, i - ref, match);
+        i += match;
+        anchor = i;
+    }
+    out = obz_write_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dst;
+}
+
+struct AsyncWriteJob {
+    char* data;
+    size_t size;
+    long long offset;       // file offset of data[0]
+    bool direct;            // write through the O_DIRECT descriptor
+    bool release;           // return the buffer to the free list once written
+};
+
+struct AsyncWriter : std::streambuf {
+    int fd;                 // buffered descriptor
+    int direct_fd;          // O_DIRECT descriptor, -1 when writing through the page cache
+    long long buffer_offset;    // file offset of the current buffer's first byte
+    bool compress;          // write every queued buffer as one OBZ block
+    long long file_size;    // bytes in the file, kept by the writer thread when compressing
+    std::vector<char*> buffers;
+    std::vector<char*> free_buffers;
+    std::deque<AsyncWriteJob> jobs;
+    int busy;               // jobs taken by the writer thread and not finished
+    bool closing;
+    bool failed;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+    
+    AsyncWriter() : fd(-1), direct_fd(-1), buffer_offset(0), compress(false), file_size(0), busy(0),
+                    closing(false), failed(false) {}
+    ~AsyncWriter();
+    
+    void queue(char* data, size_t size, bool direct, bool release) {
+        AsyncWriteJob job = {data, size, buffer_offset, direct, release};
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+        changed.notify_all();
+    }
+    
+    // Continue in buffer, keeping the first fill bytes
+    void use_buffer(char* buffer, size_t fill) {
+        setp(buffer, buffer ? buffer + ASYNC_BUFFER_SIZE : NULL);
+        pbump((int)fill);
+    }
+    
+    // Queue the current buffer and continue in a free one. With O_DIRECT only
+    // whole blocks are queued and the unaligned tail moves to the next buffer.
+    bool hand_off() {
+        char* full = pbase();
+        size_t size = pptr() - pbase();
+        size_t whole = direct_fd >= 0 ? size - size % DIRECT_IO_ALIGN : size;
+        if (whole == 0) return !failed;
+        queue(full, whole, direct_fd >= 0, true);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        while (free_buffers.empty() && !failed) changed.wait(lock);
+        if (failed) return false;
+        char* next = free_buffers.back();
+        free_buffers.pop_back();
+        lock.unlock();
+        
+        // The writer thread only reads full, and only this thread takes buffers
+        std::memcpy(next, full + whole, size - whole);
+        buffer_offset += whole;
+        use_buffer(next, size - whole);
+        return true;
+    }
+    
+    // Wait until the writer thread has written everything queued
+    bool drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ((!jobs.empty() || busy > 0) && !failed) changed.wait(lock);
+        return !failed;
+    }
+    
+    int overflow(int c) {
+        if (!hand_off() || pptr() == epptr()) return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    
+    // flush(): everything written so far is in the file afterwards. An
+    // unaligned O_DIRECT tail is written buffered and rewritten with its block.
+    int sync() {
+        if (!hand_off()) return -1;
+        if (pptr() > pbase()) queue(pbase(), pptr() - pbase(), false, false);
+        return drain() ? 0 : -1;
+    }
+    
+    // Only the position query used by tellp(). Compressed, it is the file
+    // size, which is the output position right after flush().
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) {
+        if (off != 0 || dir != std::ios_base::cur) return pos_type(off_type(-1));
+        if (compress) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pos_type(off_type(file_size));
+        }
+        return pos_type(off_type(buffer_offset + (pptr() - pbase())));
+    }
+};
+
+#ifndef _WIN32
+bool pwrite_all(int fd, const char* data, size_t size, long long offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, data + done, size - done, (off_t)(offset + done));
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+void async_writer_thread(AsyncWriter* w) {
+    std::vector<unsigned char> block;
+    std::vector<uint32_t> table;
+    if (w->compress) {
+        block.resize(8 + obz_bound(ASYNC_BUFFER_SIZE));
+        table.resize((size_t)1 << OBZ_HASH_BITS);
+    }
+    
+    std::unique_lock<std::mutex> lock(w->mutex);
+    for (;;) {
+        while (w->jobs.empty() && !w->closing) w->changed.wait(lock);
+        if (w->jobs.empty()) break;
+        AsyncWriteJob job = w->jobs.front();
+        w->jobs.pop_front();
+        w->busy++;
+        long long file_size = w->file_size;
+        lock.unlock();
+        
+        bool ok;
+        if (w->compress) {
+            // [raw size][stored size][stored bytes], stored as is when it does not shrink
+            uint32_t sizes[2];
+            sizes[0] = (uint32_t)job.size;
+            sizes[1] = (uint32_t)obz_compress_block((const unsigned char*)job.data, job.size, &block[8], &table[0]);
+            if (sizes[1] >= sizes[0]) {
+                sizes[1] = sizes[0];
+                std::memcpy(&block[8], job.data, job.size);
+            }
+            std::memcpy(&block[0], sizes, 8);
+            ok = pwrite_all(w->fd, (const char*)&block[0], 8 + sizes[1], file_size);
+            file_size += 8 + sizes[1];
+        } else {
+            ok = pwrite_all(job.direct ? w->direct_fd : w->fd, job.data, job.size, job.offset);
+        }
+        
+        lock.lock();
+        w->busy--;
+        w->file_size = file_size;
+        if (!ok) w->failed = true;
+        if (job.release) w->free_buffers.push_back(job.data);
+        w->changed.notify_all();
+    }
+}
+#endif
+
+// Open output for the writer thread, appending at the end of the file when
+// append is set. False where there is no writer thread (Windows) or on error.
+bool open_async_writer(AsyncWriter& w, const std::string& filename, bool append, bool direct, bool compress) {
+#ifdef _WIN32
+    return false;
+#else
+    w.fd = open(filename.c_str(), O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    if (w.fd < 0) return false;
+    w.buffer_offset = append ? (long long)lseek(w.fd, 0, SEEK_END) : 0;
+    w.compress = compress;
+    w.file_size = w.buffer_offset;
+    if (compress) {
+        if (w.file_size == 0 && !pwrite_all(w.fd, OBZ_MAGIC, 4, 0)) w.failed = true;
+        if (w.file_size == 0) w.file_size = 4;
+        if (direct) std::cerr << "Compressed output is written through the page cache" << std::endl;
+        direct = false;
+    }
+    
+    for (int i = 0; i < ASYNC_BUFFERS; i++) {
+        void* p = NULL;
+        if (posix_memalign(&p, DIRECT_IO_ALIGN, ASYNC_BUFFER_SIZE) != 0) break;
+        w.buffers.push_back((char*)p);
+        w.free_buffers.push_back((char*)p);
+    }
+    if (w.buffers.size() < 2) {
+        for (size_t i = 0; i < w.buffers.size(); i++) free(w.buffers[i]);
+        close(w.fd);
+        w.fd = -1;
+        return false;
+    }
+    char* first = w.free_buffers.back();
+    w.free_buffers.pop_back();
+    size_t fill = 0;
+
+#ifdef O_DIRECT
+    if (direct) {
+        w.direct_fd = open(filename.c_str(), O_WRONLY | O_DIRECT);
+        if (w.direct_fd < 0) {
+            std::cerr << "O_DIRECT is not supported for " << filename << ", writing through the page cache" << std::endl;
+        } else {
+            // Start on a block boundary: the partial block already in the file is rewritten
+            fill = (size_t)(w.buffer_offset % DIRECT_IO_ALIGN);
+            w.buffer_offset -= fill;
+            if (fill > 0 && pread(w.fd, first, fill, (off_t)w.buffer_offset) != (ssize_t)fill) w.failed = true;
+        }
+    }
+#else
+    if (direct) std::cerr << "O_DIRECT is not supported on this platform, writing through the page cache" << std::endl;
+#endif
+    w.use_buffer(first, fill);
+    
+    w.thread = std::thread(async_writer_thread, &w);
+    return true;
+#endif
+}
+
+// Write what is left and stop the writer thread, false if any write failed
+bool close_async_writer(AsyncWriter& w) {
+#ifdef _WIN32
+    return true;
+#else
+    if (w.fd < 0) return true;
+    w.pubsync();
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.closing = true;
+        w.changed.notify_all();
+    }
+    if (w.thread.joinable()) w.thread.join();
+    bool ok = !w.failed;
+    if (w.direct_fd >= 0) close(w.direct_fd);
+    close(w.fd);
+    w.fd = -1;
+    w.direct_fd = -1;
+    w.use_buffer(NULL, 0);
+    for (size_t i = 0; i < w.buffers.size(); i++) free(w.buffers[i]);
+    w.buffers.clear();
+    w.free_buffers.clear();
+    return ok;
+#endif
+}
+
+AsyncWriter::~AsyncWriter() {
+    close_async_writer(*this);
+}
+
+// Output file of the replay: the writer thread (compressed with --compress)
+// unless --sync-output, a plain ofstream otherwise and where there is no
+// writer thread
+struct OutputStream {
+    AsyncWriter writer;
+    std::ofstream file;
+    std::ostream out;
+    
+    OutputStream() : out(NULL) {}
+    ~OutputStream();
+};
+
+bool open_output(OutputStream& o, const std::string& filename, bool append, const ReplayOptions& opts) {
+    if ((opts.async_output || opts.compress) &&
+        open_async_writer(o.writer, filename, append, opts.direct_io, opts.compress)) {
+        o.out.rdbuf(&o.writer);
+        return true;
+    }
+    if (opts.compress) std::cerr << "Compression needs the writer thread, writing " << filename << " uncompressed" << std::endl;
+    o.file.open(filename.c_str(), append ? std::ios::app : std::ios::trunc);
+    if (!o.file.is_open()) return false;
+    o.out.rdbuf(o.file.rdbuf());
+    return true;
+}
+
+// Write what is left, false if any write failed
+bool close_output(OutputStream& o) {
+    bool ok = true;
+    if (o.out.rdbuf() == &o.writer) {
+        ok = close_async_writer(o.writer);
+    } else if (o.file.is_open()) {
+        o.file.close();
+        ok = !o.file.fail();
+    }
+    o.out.rdbuf(NULL);
+    return ok;
+}
+
+OutputStream::~OutputStream() {
+    close_output(*this);
+}
+
+// Snapshot rows formatted to CSV on a pool of threads (process_events). The
+// replay thread moves each snapshot into the open chunk and hands full chunks
+// to the formatters; formatted chunks are appended to the output in chunk
+// order. Every row sets its own stream precision, so a chunk formatted on a
+// fresh stream gives the same bytes as the replay thread's stream.
+const size_t FORMAT_CHUNK_ROWS = 2048;
+
+struct FormatChunk {
+    std::vector<BookSnapshot> rows;
+    std::string text;
+    bool formatted;
+};
+
+struct SnapshotFormatter {
+    const ReplayOptions* opts;
+    FormatChunk* open;                  // chunk being filled by the replay thread
+    std::deque<FormatChunk*> in_flight; // submitted chunks in output order
+    std::deque<FormatChunk*> todo;      // submitted chunks not yet taken by a formatter
+    std::vector<FormatChunk*> spare;
+    size_t max_in_flight;
+    bool closing;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> threads;
+    
+    SnapshotFormatter() : opts(NULL), open(NULL), max_in_flight(0), closing(false) {}
+    ~SnapshotFormatter();
+};
+
+void snapshot_formatter_thread(SnapshotFormatter* f) {
+    std::unique_lock<std::mutex> lock(f->mutex);
+    for (;;) {
+        while (f->todo.empty() && !f->closing) f->changed.wait(lock);
+        if (f->todo.empty()) break;
+        FormatChunk* chunk = f->todo.front();
+        f->todo.pop_front();
+        lock.unlock();
+        
+        std::ostringstream text;
+        for (size_t i = 0; i < chunk->rows.size(); i++) {
+            write_snapshot_row(text, chunk->rows[i], *f->opts);
+        }
+        chunk->text = text.str();
+        chunk->rows.clear();
+        
+        lock.lock();
+        chunk->formatted = true;
+        f->changed.notify_all();
+    }
+}
+
+// Start the formatter threads, none when threads is 0 (rows are then written
+// directly by the replay thread)
+void start_snapshot_formatter(SnapshotFormatter& f, int threads, const ReplayOptions& opts) {
+    if (threads < 0) threads = std::min(8, (int)std::thread::hardware_concurrency() - 1);
+    if (threads <= 0) return;
+    f.opts = &opts;
+    f.max_in_flight = (size_t)threads * 4;
+    f.open = new FormatChunk();
+    f.open->formatted = false;
+    for (int i = 0; i < threads; i++) {
+        f.threads.push_back(std::thread(snapshot_formatter_thread, &f));
+    }
+}
+
+// Append formatted chunks from the front of the queue; with wait_all, wait
+// for every submitted chunk
+void write_formatted_chunks(SnapshotFormatter& f, std::ostream& out, bool wait_all) {
+    std::unique_lock<std::mutex> lock(f.mutex);
+    while (!f.in_flight.empty()) {
+        FormatChunk* chunk = f.in_flight.front();
+        if (!chunk->formatted) {
+            if (!wait_all && f.in_flight.size() < f.max_in_flight) break;
+            f.changed.wait(lock);
+            continue;
+        }
+        f.in_flight.pop_front();
+        lock.unlock();
+        out.write(chunk->text.data(), chunk->text.size());
+        chunk->text.clear();
+        chunk->formatted = false;
+        lock.lock();
+        f.spare.push_back(chunk);
+    }
+}
+
+void submit_format_chunk(SnapshotFormatter& f, std::ostream& out) {
+    {
+        std::lock_guard<std::mutex> lock(f.mutex);
+        f.in_flight.push_back(f.open);
+        f.todo.push_back(f.open);
+        if (f.spare.empty()) {
+            f.open = new FormatChunk();
+            f.open->formatted = false;
+        } else {
+            f.open = f.spare.back();
+            f.spare.pop_back();
+        }
+        f.changed.notify_all();
+    }
+    write_formatted_chunks(f, out, false);
+}
+
+// Queue one snapshot row, taking its contents
+void format_snapshot(SnapshotFormatter& f, std::ostream& out, BookSnapshot& snapshot) {
+    f.open->rows.push_back(BookSnapshot());
+    std::swap(f.open->rows.back(), snapshot);
+    if (f.open->rows.size() >= FORMAT_CHUNK_ROWS) submit_format_chunk(f, out);
+}
+
+// Write every queued row to out
+void flush_snapshot_formatter(SnapshotFormatter& f, std::ostream& out) {
+    if (f.threads.empty()) return;
+    if (!f.open->rows.empty()) submit_format_chunk(f, out);
+    write_formatted_chunks(f, out, true);
+}
+
+// Stop the threads; rows not yet written by a flush are dropped
+void stop_snapshot_formatter(SnapshotFormatter& f) {
+    if (f.threads.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(f.mutex);
+        f.closing = true;
+        f.changed.notify_all();
+    }
+    for (size_t i = 0; i < f.threads.size(); i++) {
+        f.threads[i].join();
+    }
+    f.threads.clear();
+    delete f.open;
+    f.open = NULL;
+    for (size_t i = 0; i < f.in_flight.size(); i++) delete f.in_flight[i];
+    f.in_flight.clear();
+    for (size_t i = 0; i < f.spare.size(); i++) delete f.spare[i];
+    f.spare.clear();
+}
+
+SnapshotFormatter::~SnapshotFormatter() {
+    stop_snapshot_formatter(*this);
+}
+
+// Publisher of the latest snapshot into shared memory, read with book_reader.h
+struct ShmPublisher {
+    std::string name;
+    ShmBook* shm;           // NULL when not publishing
+};
+
+// Create or reuse the segment; an empty name leaves the publisher off
+bool open_shm_publisher(ShmPublisher& pub, const std::string& name) {
+    pub.name = name;
+    pub.shm = NULL;
+    if (name.empty()) return true;
+#ifdef _WIN32
+    std::cerr << "Shared-memory publication is not supported on this platform" << std::endl;
+    return false;
+#else
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(ShmBook)) != 0) {
+        std::cerr << "Cannot create shared memory " << name << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, sizeof(ShmBook), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "Cannot map shared memory " << name << std::endl;
+        return false;
+    }
+    
+    pub.shm = (ShmBook*)p;
+    if (pub.shm->magic != SHM_BOOK_MAGIC || pub.shm->version != SHM_BOOK_VERSION) {
+        std::memset(p, 0, sizeof(ShmBook));
+        pub.shm->magic = SHM_BOOK_MAGIC;
+        pub.shm->version = SHM_BOOK_VERSION;
+    }
+    // A writer that died mid-update leaves seq odd
+    if (pub.shm->seq.load() & 1) shm_book_write_end(pub.shm);
+    return true;
+#endif
+}
+
+void copy_shm_levels(const std::vector<std::pair<double, int> >& levels, ShmBookLevel* out, int& count) {
+    count = (int)std::min(levels.size(), (size_t)SHM_BOOK_DEPTH);
+    for (int i = 0; i < count; i++) {
+        out[i].price = levels[i].first;
+        out[i].qty = levels[i].second;
+    }
+}
+
+// Overwrite the published snapshot; never waits for readers
+void publish_to_shm(ShmPublisher& pub, const BookSnapshot& snapshot) {
+    if (pub.shm == NULL) return;
+    ShmBook* shm = pub.shm;
+    shm_book_write_begin(shm);
+    ShmBookSnapshot& s = shm->snapshot;
+    s.clockatarrival = snapshot.clockatarrival;
+    s.transacttime = snapshot.transacttime;
+    copy_shm_levels(snapshot.best_bids, s.bids, s.num_bids);
+    copy_shm_levels(snapshot.best_asks, s.asks, s.num_asks);
+    s.cvl = snapshot.cvl;
+    s.lpr = snapshot.lpr;
+    s.cto = snapshot.cto;
+    s.nts = snapshot.nts;
+    s.opx = snapshot.opx;
+    s.has_auction = snapshot.has_auction ? 1 : 0;
+    s.iap = snapshot.iap;
+    s.iav = snapshot.iav;
+    s.iai = snapshot.iai;
+    shm->published++;
+    shm_book_write_end(shm);
+}
+
+// Unmap; the segment stays so readers keep the final book
+void close_shm_publisher(ShmPublisher& pub) {
+#ifndef _WIN32
+    if (pub.shm != NULL) munmap(pub.shm, sizeof(ShmBook));
+#endif
+    pub.shm = NULL;
+}
+
+// Event held in the look-ahead window
+struct PendingEvent {
+    bool is_order;
+    Order order;
+    Trade trade;
+    bool decided;       // immediate-trade decision is final
+    bool immediate;     // order was filled within IMMEDIATE_TRADE_WINDOW
+    std::chrono::steady_clock::time_point arrival;
+};
+
+// Bounded look-ahead for the immediate-trade rule. Market and best orders are
+// held until a matching fill arrives or the stream moves past the window; every
+// later event queues behind them so events are released in arrival order.
+struct LookaheadWindow {
+    std::deque<PendingEvent> pending;
+    long long head_seq;                                    // sequence number of pending.front()
+    std::multimap<int, long long> undecided;               // applseqnum -> sequence of held order
+    std::deque<std::pair<long long, int> > recent_fills;   // (time_ms, applseqnum) of fills inside the window
+    std::map<int, int> recent_fill_count;                  // applseqnum -> entries in recent_fills
+    long long now;                                         // latest event time_ms seen
+    size_t max_pending;                                    // deepest the window has been
+};
+
+void init_window(LookaheadWindow& w) {
+    w.pending.clear();
+    w.head_seq = 0;
+    w.undecided.clear();
+    w.recent_fills.clear();
+    w.recent_fill_count.clear();
+    w.now = 0;
+    w.max_pending = 0;
+}
+
+// Drop fills that can no longer be inside the window of a new order
+void prune_recent_fills(LookaheadWindow& w) {
+    while (!w.recent_fills.empty() && w.recent_fills.front().first < w.now - IMMEDIATE_TRADE_WINDOW) {
+        std::map<int, int>::iterator it = w.recent_fill_count.find(w.recent_fills.front().second);
+        if (--it->second == 0) w.recent_fill_count.erase(it);
+        w.recent_fills.pop_front();
+    }
+}
+
+void window_push_order(LookaheadWindow& w, const Order& order,
+                       std::chrono::steady_clock::time_point arrival) {
+    if (order.time_ms > w.now) w.now = order.time_ms;
+    prune_recent_fills(w);
+    
+    PendingEvent ev;
+    ev.is_order = true;
+    ev.order = order;
+    ev.arrival = arrival;
+    ev.immediate = false;
+    ev.decided = true;
+    
+    // Before the open the decision does not change how the order is applied
+    if (is_market_or_best(order) && !PHASE_INFO[get_session_phase(order.time_ms)].rests_immediate_orders) {
+        if (w.recent_fill_count.count(order.applseqnum) > 0) {
+            ev.immediate = true;
+        } else {
+            ev.decided = false;
+            w.undecided.insert(std::make_pair(order.applseqnum, w.head_seq + (long long)w.pending.size()));
+        }
+    }
+    w.pending.push_back(ev);
+    if (w.pending.size() > w.max_pending) w.max_pending = w.pending.size();
+}
+
+// Mark held orders filled by this trade as immediate
+void resolve_held_orders(LookaheadWindow& w, int applseqnum, const Trade& trade) {
+    std::multimap<int, long long>::iterator it = w.undecided.find(applseqnum);
+    while (it != w.undecided.end() && it->first == applseqnum) {
+        PendingEvent& held = w.pending[it->second - w.head_seq];
+        if (std::llabs(held.order.time_ms - trade.time_ms) <= IMMEDIATE_TRADE_WINDOW) {
+            held.immediate = true;
+            held.decided = true;
+            w.undecided.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void window_push_trade(LookaheadWindow& w, const Trade& trade,
+                       std::chrono::steady_clock::time_point arrival) {
+    if (trade.time_ms > w.now) w.now = trade.time_ms;
+    prune_recent_fills(w);
+    
+    if (trade.exectype == 'f') {
+        resolve_held_orders(w, trade.bidapplseqnum, trade);
+        resolve_held_orders(w, trade.offerapplseqnum, trade);
+        
+        w.recent_fills.push_back(std::make_pair(trade.time_ms, trade.bidapplseqnum));
+        w.recent_fill_count[trade.bidapplseqnum]++;
+        w.recent_fills.push_back(std::make_pair(trade.time_ms, trade.offerapplseqnum));
+        w.recent_fill_count[trade.offerapplseqnum]++;
+    }
+    
+    PendingEvent ev;
+    ev.is_order = false;
+    ev.trade = trade;
+    ev.arrival = arrival;
+    ev.immediate = false;
+    ev.decided = true;
+    w.pending.push_back(ev);
+    if (w.pending.size() > w.max_pending) w.max_pending = w.pending.size();
+}
+
+// Forget the undecided entry of a held order
+void drop_undecided(LookaheadWindow& w, int applseqnum, long long seq) {
+    std::multimap<int, long long>::iterator it = w.undecided.find(applseqnum);
+    while (it != w.undecided.end() && it->first == applseqnum) {
+        if (it->second == seq) {
+            w.undecided.erase(it);
+            return;
+        }
+        ++it;
+    }
+}
+
+// Release the oldest event once its decision is final. With end_of_stream set
+// held orders are released as not immediate.
+bool window_pop(LookaheadWindow& w, PendingEvent& out, bool end_of_stream) {
+    if (w.pending.empty()) return false;
+    
+    PendingEvent& head = w.pending.front();
+    if (!head.decided) {
+        if (!end_of_stream && head.order.time_ms + IMMEDIATE_TRADE_WINDOW >= w.now) {
+            return false;
+        }
+        drop_undecided(w, head.order.applseqnum, w.head_seq);
+        head.decided = true;
+    }
+    
+    out = head;
+    w.pending.pop_front();
+    w.head_seq++;
+    return true;
+}
+
+// Give up on held orders at the front of the window that have waited longer
+// than max_hold of wall time; they are released as not immediate. Returns how
+// many orders were given up on.
+int window_expire_held(LookaheadWindow& w, std::chrono::steady_clock::time_point now,
+                       std::chrono::milliseconds max_hold) {
+    int expired = 0;
+    for (size_t i = 0; i < w.pending.size(); i++) {
+        PendingEvent& ev = w.pending[i];
+        if (ev.decided) continue;
+        if (now - ev.arrival < max_hold) break;
+        
+        drop_undecided(w, ev.order.applseqnum, w.head_seq + (long long)i);
+        ev.decided = true;
+        expired++;
+    }
+    return expired;
+}
+
+// Apply a released event, returns true if a snapshot was taken
+template <typename Sink>
+bool apply_pending_event(OrderBook& book, const PendingEvent& ev, SessionState& session, Sink& sink) {
+    if (ev.is_order) {
+        return apply_order_event(book, ev.order, ev.immediate, session, sink);
+    }
+    return apply_trade_event(book, ev.trade, session, sink);
+}
+
+bool apply_pending_event(OrderBook& book, const PendingEvent& ev, SessionState& session) {
+    NullSink none;
+    return apply_pending_event(book, ev, session, none);
+}
+
+void write_feature_header(std::ostream& out) {
+    out << "clockatarrival,transacttime,event,bid,bid_qty,ask,ask_qty,mid,spread,imb,micro,wmid,ofi\n";
+}
+
+// Feature row for an applied event: 'o' order, 'f' fill, 'c' cancel
+void write_feature_row(std::ostream& out, const OrderBook& book, const PendingEvent& ev) {
+    std::vector<std::pair<double, int> > bids = get_top_bids(book, 5);
+    std::vector<std::pair<double, int> > asks = get_top_asks(book, 5);
+    if (ev.is_order) {
+        out << ev.order.clockatarrival << "," << ev.order.transacttime << ",o";
+    } else {
+        out << ev.trade.clockatarrival << "," << ev.trade.transacttime << ","
+            << (ev.trade.exectype == 'f' ? 'f' : 'c');
+    }
+    
+    if (bids.empty()) out << ",,";
+    else out << "," << std::fixed << std::setprecision(price_decimals) << bids[0].first << "," << bids[0].second;
+    if (asks.empty()) out << ",,";
+    else out << "," << std::fixed << std::setprecision(price_decimals) << asks[0].first << "," << asks[0].second;
+    write_features(out, compute_features(bids, asks, book.features.ofi));
+    out << "\n";
+}
+
+// Open opts.feature_stream if set, appending to it after a resume, else
+// truncating it and writing the header; false if it cannot be created
+bool open_feature_stream(std::ofstream& out, const ReplayOptions& opts, bool append) {
+    if (opts.feature_stream.empty()) return true;
+    out.open(opts.feature_stream.c_str(), append ? std::ios::app | std::ios::ate : std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Cannot create feature stream: " << opts.feature_stream << std::endl;
+        return false;
+    }
+    if (!append) write_feature_header(out);
+    return true;
+}
+
+// Scratch memory reused across replays by one worker
+struct ReplayWorkspace {
+    ParseBuffers parse;
+    OrderColumns orders;
+    TradeColumns trades;
+    std::vector<Event> events;
+    LookaheadWindow window;
+    SessionState session;
+    OrderBook book;
+};
+
+// Binary checkpoint of a replay. Records are appended to <output>.ckpt, each a
+// header followed by the book, session and look-ahead window. Every field is
+// written on its own with a fixed width in native byte order, so the same
+// state always gives the same bytes; only meant to be read back on the same
+// platform.
+const char CHECKPOINT_MAGIC[4] = { 'O', 'B', 'C', 'K' };
+const int CHECKPOINT_VERSION = 8;
+
+// Events between the in-memory checkpoints of the query service
+const long long QUERY_CHECKPOINT_INTERVAL = 4096;
+
+struct CheckpointHeader {
+    char magic[4];
+    int version;
+    long long body_size;
+    unsigned int checksum;      // FNV-1a of the body
+    long long num_orders;       // input the replay was run on
+    long long num_trades;
+    long long next_event;       // first event not yet pushed into the window
+    long long next_order_row;   // orders and trades pushed so far, the rows to read from on a seek
+    long long next_trade_row;
+    long long events_applied;
+    long long time_ms;          // time of the last applied event
+    long long output_offset;    // bytes of snapshot output written so far
+    long long feature_offset;   // bytes of the feature stream written so far, -1 without one
+    long long snapshots_written;
+    int features;               // 1 if the order-flow features were tracked from the start
+    long long ticks_per_unit;   // tick of the run that wrote it, see set_price_tick
+    int layout;                 // LAYOUT_* bits of the output options
+    int snapshot_phases;        // phases with order snapshots, then with trade snapshots from bit NUM_PHASES
+};
+
+// Output options that change the bytes of the snapshot output
+const int LAYOUT_AUCTION = 1;
+const int LAYOUT_FEATURES = 2;
+const int LAYOUT_ORDER_COUNTS = 4;
+const int LAYOUT_COMPRESS = 8;
+
+// Record the output options of a replay in a checkpoint header
+void set_checkpoint_layout(CheckpointHeader& h, const ReplayOptions& opts) {
+    h.layout = (opts.auction ? LAYOUT_AUCTION : 0) | (opts.features ? LAYOUT_FEATURES : 0) |
+               (opts.order_counts ? LAYOUT_ORDER_COUNTS : 0) | (opts.compress ? LAYOUT_COMPRESS : 0);
+    h.snapshot_phases = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        if (opts.session.snapshot_orders[i]) h.snapshot_phases |= 1 << i;
+        if (opts.session.snapshot_trades[i]) h.snapshot_phases |= 1 << (NUM_PHASES + i);
+    }
+}
+
+// Checkpoint found in a checkpoint file
+struct CheckpointEntry {
+    long long file_offset;
+    CheckpointHeader header;
+};
+
+unsigned int fnv1a(const std::string& data) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < data.size(); i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Fixed-width fields of a checkpoint
+void put_int64(std::string& buf, long long value) {
+    int64_t v = value;
+    buf.append((const char*)&v, sizeof(v));
+}
+
+void put_int32(std::string& buf, int value) {
+    int32_t v = value;
+    buf.append((const char*)&v, sizeof(v));
+}
+
+void put_byte(std::string& buf, char value) {
+    buf += value;
+}
+
+void put_flag(std::string& buf, bool value) {
+    buf += (char)(value ? 1 : 0);
+}
+
+void put_double(std::string& buf, double value) {
+    buf.append((const char*)&value, sizeof(value));
+}
+
+// Cursor over a checkpoint body
+struct CheckpointReader {
+    const char* pos;
+    const char* end;
+    bool ok;
+};
+
+// Next size bytes, NULL past the end
+const char* take_bytes(CheckpointReader& r, size_t size) {
+    if (!r.ok || (size_t)(r.end - r.pos) < size) {
+        r.ok = false;
+        return NULL;
+    }
+    const char* p = r.pos;
+    r.pos += size;
+    return p;
+}
+
+long long get_int64(CheckpointReader& r) {
+    int64_t v = 0;
+    const char* p = take_bytes(r, sizeof(v));
+    if (p) std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+int get_int32(CheckpointReader& r) {
+    int32_t v = 0;
+    const char* p = take_bytes(r, sizeof(v));
+    if (p) std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+char get_byte(CheckpointReader& r) {
+    const char* p = take_bytes(r, 1);
+    return p ? *p : 0;
+}
+
+bool get_flag(CheckpointReader& r) {
+    return get_byte(r) != 0;
+}
+
+double get_double(CheckpointReader& r) {
+    double v = 0;
+    const char* p = take_bytes(r, sizeof(v));
+    if (p) std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void serialize_order(std::string& buf, const Order& o) {
+    put_int64(buf, o.clockatarrival);
+    put_int32(buf, o.sequenceno);
+    put_int64(buf, o.transacttime);
+    put_int64(buf, o.time_ms);
+    put_int32(buf, o.applseqnum);
+    put_int32(buf, o.side);
+    put_byte(buf, o.ordertype);
+    put_double(buf, o.price);
+    put_int32(buf, o.orderqty);
+}
+
+void restore_order(CheckpointReader& r, Order& o) {
+    o.clockatarrival = get_int64(r);
+    o.sequenceno = get_int32(r);
+    o.transacttime = get_int64(r);
+    o.time_ms = get_int64(r);
+    o.applseqnum = get_int32(r);
+    o.side = get_int32(r);
+    o.ordertype = get_byte(r);
+    o.price = get_double(r);
+    o.orderqty = get_int32(r);
+}
+
+void serialize_trade(std::string& buf, const Trade& t) {
+    put_int64(buf, t.clockatarrival);
+    put_int32(buf, t.sequenceno);
+    put_int64(buf, t.transacttime);
+    put_int64(buf, t.time_ms);
+    put_int32(buf, t.applseqnum);
+    put_byte(buf, t.exectype);
+    put_double(buf, t.tradeprice);
+    put_int32(buf, t.tradeqty);
+    put_double(buf, t.trademoney);
+    put_int32(buf, t.bidapplseqnum);
+    put_int32(buf, t.offerapplseqnum);
+}
+
+void restore_trade(CheckpointReader& r, Trade& t) {
+    t.clockatarrival = get_int64(r);
+    t.sequenceno = get_int32(r);
+    t.transacttime = get_int64(r);
+    t.time_ms = get_int64(r);
+    t.applseqnum = get_int32(r);
+    t.exectype = get_byte(r);
+    t.tradeprice = get_double(r);
+    t.tradeqty = get_int32(r);
+    t.trademoney = get_double(r);
+    t.bidapplseqnum = get_int32(r);
+    t.offerapplseqnum = get_int32(r);
+}
+
+void serialize_book(std::string& buf, const OrderBook& book) {
+    put_int64(buf, book.cumulative_volume);
+    put_double(buf, book.last_price);
+    put_int32(buf, book.cumulative_trade_orders);
+    put_int32(buf, book.number_of_trades);
+    put_double(buf, book.opening_price);
+    put_flag(buf, book.has_opening_price);
+    put_int64(buf, book.next_arrival);
+    
+    const FeatureState& f = book.features;
+    put_flag(buf, f.started);
+    put_double(buf, f.bid);
+    put_int64(buf, f.bid_qty);
+    put_double(buf, f.ask);
+    put_int64(buf, f.ask_qty);
+    put_int64(buf, f.ofi);
+    
+    // Levels are rebuilt from the orders on restore
+    for (int side = 1; side <= 2; side++) {
+        const std::map<int, BookOrder>& orders = side == 1 ? book.bid_book.orders : book.ask_book.orders;
+        put_int64(buf, (long long)orders.size());
+        std::map<int, BookOrder>::const_iterator it;
+        for (it = orders.begin(); it != orders.end(); ++it) {
+            put_int32(buf, it->second.applseqnum);
+            put_double(buf, it->second.price);
+            put_int32(buf, it->second.qty);
+            put_int64(buf, it->second.order_time);
+            put_int64(buf, it->second.arrival);
+        }
+    }
+}
+
+void restore_book(CheckpointReader& r, OrderBook& book) {
+    book.cumulative_volume = get_int64(r);
+    book.last_price = get_double(r);
+    book.cumulative_trade_orders = get_int32(r);
+    book.number_of_trades = get_int32(r);
+    book.opening_price = get_double(r);
+    book.has_opening_price = get_flag(r);
+    book.next_arrival = get_int64(r);
+    
+    FeatureState& f = book.features;
+    f.started = get_flag(r);
+    f.bid = get_double(r);
+    f.bid_qty = get_int64(r);
+    f.ask = get_double(r);
+    f.ask_qty = get_int64(r);
+    f.ofi = get_int64(r);
+    
+    for (int side = 1; side <= 2; side++) {
+        long long count = get_int64(r);
+        for (long long i = 0; i < count && r.ok; i++) {
+            BookOrder order;
+            order.applseqnum = get_int32(r);
+            order.price = get_double(r);
+            order.qty = get_int32(r);
+            order.order_time = get_int64(r);
+            order.arrival = get_int64(r);
+            if (!r.ok) break;
+            LevelChange change = side == 1 ? book.bid_book.add_order(order) : book.ask_book.add_order(order);
+            on_level_change(book, side, change);
+        }
+    }
+}
+
+void serialize_session(std::string& buf, const SessionState& session) {
+    put_int32(buf, session.phase);
+    put_flag(buf, session.started);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        const PhaseStats& s = session.stats[i];
+        put_int64(buf, s.orders);
+        put_int64(buf, s.fills);
+        put_int64(buf, s.cancels);
+        put_int64(buf, s.volume);
+        put_int64(buf, s.snapshots);
+    }
+}
+
+void restore_session(CheckpointReader& r, SessionState& session) {
+    int phase = get_int32(r);
+    if (phase < 0 || phase >= NUM_PHASES) r.ok = false;
+    else session.phase = (SessionPhase)phase;
+    session.started = get_flag(r);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        PhaseStats& s = session.stats[i];
+        s.orders = get_int64(r);
+        s.fills = get_int64(r);
+        s.cancels = get_int64(r);
+        s.volume = get_int64(r);
+        s.snapshots = get_int64(r);
+    }
+}
+
+void serialize_window(std::string& buf, const LookaheadWindow& w) {
+    put_int64(buf, w.head_seq);
+    put_int64(buf, w.now);
+    put_int64(buf, (long long)w.pending.size());
+    for (size_t i = 0; i < w.pending.size(); i++) {
+        const PendingEvent& ev = w.pending[i];
+        put_flag(buf, ev.is_order);
+        put_flag(buf, ev.decided);
+        put_flag(buf, ev.immediate);
+        if (ev.is_order) serialize_order(buf, ev.order);
+        else serialize_trade(buf, ev.trade);
+    }
+    put_int64(buf, (long long)w.recent_fills.size());
+    for (size_t i = 0; i < w.recent_fills.size(); i++) {
+        put_int64(buf, w.recent_fills[i].first);
+        put_int32(buf, w.recent_fills[i].second);
+    }
+}
+
+// Restore the window; the undecided index and fill counts are rebuilt
+void restore_window(CheckpointReader& r, LookaheadWindow& w) {
+    init_window(w);
+    w.head_seq = get_int64(r);
+    w.now = get_int64(r);
+    
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    long long count = get_int64(r);
+    for (long long i = 0; i < count && r.ok; i++) {
+        PendingEvent ev;
+        ev.is_order = get_flag(r);
+        ev.decided = get_flag(r);
+        ev.immediate = get_flag(r);
+        if (ev.is_order) restore_order(r, ev.order);
+        else restore_trade(r, ev.trade);
+        ev.arrival = arrival;
+        if (ev.is_order && !ev.decided) {
+            w.undecided.insert(std::make_pair(ev.order.applseqnum, w.head_seq + i));
+        }
+        w.pending.push_back(ev);
+    }
+    w.max_pending = w.pending.size();
+    
+    count = get_int64(r);
+    for (long long i = 0; i < count && r.ok; i++) {
+        long long time_ms = get_int64(r);
+        int applseqnum = get_int32(r);
+        w.recent_fills.push_back(std::make_pair(time_ms, applseqnum));
+        w.recent_fill_count[applseqnum]++;
+    }
+}
+
+// Header record: magic, then the fields in declaration order
+void serialize_checkpoint_header(std::string& buf, const CheckpointHeader& h) {
+    buf.append(CHECKPOINT_MAGIC, 4);
+    put_int32(buf, h.version);
+    put_int64(buf, h.body_size);
+    put_int32(buf, (int)h.checksum);
+    put_int64(buf, h.num_orders);
+    put_int64(buf, h.num_trades);
+    put_int64(buf, h.next_event);
+    put_int64(buf, h.next_order_row);
+    put_int64(buf, h.next_trade_row);
+    put_int64(buf, h.events_applied);
+    put_int64(buf, h.time_ms);
+    put_int64(buf, h.output_offset);
+    put_int64(buf, h.feature_offset);
+    put_int64(buf, h.snapshots_written);
+    put_int32(buf, h.features);
+    put_int64(buf, h.ticks_per_unit);
+    put_int32(buf, h.layout);
+    put_int32(buf, h.snapshot_phases);
+}
+
+// Bytes of a serialized header
+const long long CHECKPOINT_HEADER_SIZE = 4 + 4 + 8 + 4 + 10 * 8 + 4 + 8 + 4 + 4;
+
+// False if the bytes are not a header of this version
+bool restore_checkpoint_header(const char* data, CheckpointHeader& h) {
+    CheckpointReader r;
+    r.pos = data;
+    r.end = data + CHECKPOINT_HEADER_SIZE;
+    r.ok = true;
+    const char* magic = take_bytes(r, 4);
+    std::memcpy(h.magic, magic, 4);
+    h.version = get_int32(r);
+    h.body_size = get_int64(r);
+    h.checksum = (unsigned int)get_int32(r);
+    h.num_orders = get_int64(r);
+    h.num_trades = get_int64(r);
+    h.next_event = get_int64(r);
+    h.next_order_row = get_int64(r);
+    h.next_trade_row = get_int64(r);
+    h.events_applied = get_int64(r);
+    h.time_ms = get_int64(r);
+    h.output_offset = get_int64(r);
+    h.feature_offset = get_int64(r);
+    h.snapshots_written = get_int64(r);
+    h.features = get_int32(r);
+    h.ticks_per_unit = get_int64(r);
+    h.layout = get_int32(r);
+    h.snapshot_phases = get_int32(r);
+    return r.ok && std::memcmp(h.magic, CHECKPOINT_MAGIC, 4) == 0 && h.version == CHECKPOINT_VERSION;
+}
+
+// Append one checkpoint record
+bool write_checkpoint(std::ofstream& out, CheckpointHeader& header, const OrderBook& book,
+                      const SessionState& session, const LookaheadWindow& window) {
+    std::string body;
+    serialize_book(body, book);
+    serialize_session(body, session);
+    serialize_window(body, window);
+    
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+    header.version = CHECKPOINT_VERSION;
+    header.ticks_per_unit = ticks_per_unit;
+    header.body_size = (long long)body.size();
+    header.checksum = fnv1a(body);
+    std::string record;
+    serialize_checkpoint_header(record, header);
+    out.write(record.data(), record.size());
+    out.write(body.data(), body.size());
+    out.flush();
+    return out.good();
+}
+
+// List the complete checkpoints in a file, stopping at a torn or foreign record
+void scan_checkpoints(const std::string& filename, std::vector<CheckpointEntry>& entries) {
+    entries.clear();
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.is_open()) return;
+    in.seekg(0, std::ios::end);
+    long long file_size = (long long)in.tellg();
+    
+    long long offset = 0;
+    CheckpointEntry entry;
+    char record[CHECKPOINT_HEADER_SIZE];
+    while (offset + CHECKPOINT_HEADER_SIZE <= file_size) {
+        in.seekg(offset);
+        if (!in.read(record, CHECKPOINT_HEADER_SIZE)) break;
+        if (!restore_checkpoint_header(record, entry.header)) break;
+        const CheckpointHeader& h = entry.header;
+        long long next = offset + CHECKPOINT_HEADER_SIZE + h.body_size;
+        if (h.body_size < 0 || next > file_size) break;
+        entry.file_offset = offset;
+        entries.push_back(entry);
+        offset = next;
+    }
+}
+
+// Read and verify the body of a checkpoint
+bool read_checkpoint_body(const std::string& filename, const CheckpointEntry& entry, std::string& body) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+    body.assign((size_t)entry.header.body_size, '\0');
+    in.seekg(entry.file_offset + CHECKPOINT_HEADER_SIZE);
+    if (!in.read(&body[0], body.size())) return false;
+    if (fnv1a(body) != entry.header.checksum) {
+        std::cerr << "Checkpoint at offset " << entry.file_offset << " is corrupt" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Restore a checkpoint body into a freshly reset book, session and window
+bool restore_checkpoint(const std::string& body, OrderBook& book, SessionState& session,
+                        LookaheadWindow& window) {
+    CheckpointReader r;
+    r.pos = body.data();
+    r.end = body.data() + body.size();
+    r.ok = true;
+    restore_book(r, book);
+    restore_session(r, session);
+    restore_window(r, window);
+    return r.ok && r.pos == r.end;
+}
+
+// Load a checkpoint from a file into a freshly reset book, session and window
+bool load_checkpoint(const std::string& filename, const CheckpointEntry& entry, OrderBook& book,
+                     SessionState& session, LookaheadWindow& window) {
+    std::string body;
+    return read_checkpoint_body(filename, entry, body) && restore_checkpoint(body, book, session, window);
+}
+
+// True if a checkpoint was taken on this input with the same tick, and with
+// the cumulative order-flow imbalance tracked when features are wanted
+bool checkpoint_matches(const CheckpointHeader& h, size_t num_orders, size_t num_trades, bool features) {
+    if (h.num_orders != (long long)num_orders || h.num_trades != (long long)num_trades) return false;
+    if (h.ticks_per_unit != ticks_per_unit) return false;
+    return h.features || !features;
+}
+
+// Latest usable checkpoint for this input no later than max_time_ms, -1 if none
+int find_checkpoint(const std::vector<CheckpointEntry>& entries, size_t num_orders, size_t num_trades,
+                    bool features, long long max_time_ms) {
+    for (int i = (int)entries.size() - 1; i >= 0; i--) {
+        const CheckpointHeader& h = entries[i].header;
+        if (!checkpoint_matches(h, num_orders, num_trades, features)) continue;
+        if (h.time_ms <= max_time_ms) return i;
+    }
+    return -1;
+}
+
+// True if the file holds at least size bytes
+bool file_reaches(const std::string& filename, long long size) {
+    long long file_size = 0;
+    long long mtime = 0;
+    return file_stamp(filename, file_size, mtime) && file_size >= size;
+}
+
+// Force a flushed file to disk, so a checkpoint never refers to bytes a crash can lose
+bool sync_file(const std::string& filename) {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#else
+    return true;
+#endif
+}
+
+// Cut a file back to size bytes
+bool truncate_file(const std::string& filename, long long size) {
+#ifndef _WIN32
+    return truncate(filename.c_str(), (off_t)size) == 0;
+#else
+    std::string data((size_t)size, '\0');
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if (!in.read(&data[0], data.size())) return false;
+    }
+    std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    return out.good();
+#endif
+}
+
+// True if the output, and the feature stream when one is written, hold all a
+// checkpoint refers to
+bool outputs_reach(const CheckpointHeader& h, const std::string& output_file, const ReplayOptions& opts) {
+    if (!file_reaches(output_file, h.output_offset)) return false;
+    return opts.feature_stream.empty() || (h.feature_offset >= 0 && file_reaches(opts.feature_stream, h.feature_offset));
+}
+
+// Cut the output and the feature stream back to a checkpoint
+bool truncate_outputs(const CheckpointHeader& h, const std::string& output_file, const ReplayOptions& opts) {
+    if (!truncate_file(output_file, h.output_offset)) return false;
+    return opts.feature_stream.empty() || truncate_file(opts.feature_stream, h.feature_offset);
+}
+
+// Returned by the replays instead of a snapshot count when an output cannot be written
+const size_t REPLAY_FAILED = (size_t)-1;
+
+// Empty book, session and window for a replay from the start
+void reset_replay_state(OrderBook& book, SessionState& session, LookaheadWindow& window, const ReplayOptions& opts) {
+    reset_orderbook(book);
+    book.track_auction = opts.auction;
+    book.track_features = opts.features || !opts.feature_stream.empty();
+    book.track_order_counts = opts.order_counts;
+    init_session_state(session, opts.session);
+    init_window(window);
+}
+
+// Process events, returns the number of snapshots written or REPLAY_FAILED. Snapshot rows are
+// streamed to the output; with opts.checkpoint_every set a checkpoint is
+// appended to <output>.ckpt every that many applied events, and opts.resume
+// continues from the last one.
+template <typename Sink>
+size_t process_events(const OrderColumns& orders, 
+                      const TradeColumns& trades,
+                      const std::string& output_file,
+                      const ReplayOptions& opts,
+                      ReplayWorkspace& ws,
+                      Sink& sink) {
+    OrderBook& book = ws.book;
+    SessionState& session = ws.session;
+    // Immediate trades are found with the same bounded look-ahead as live mode
+    LookaheadWindow& window = ws.window;
+    reset_replay_state(book, session, window, opts);
+    
+    StageTimer stage;
+    start_stage(stage);
+    std::vector<Event>& events = ws.events;
+    build_events(orders, trades, events);
+    end_stage(opts.report, "event sort", stage, (long long)events.size(), 0);
+    
+    std::string checkpoint_file = output_file + ".ckpt";
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.num_orders = (long long)orders.size();
+    header.num_trades = (long long)trades.size();
+    header.features = book.track_features;
+    header.feature_offset = -1;
+    set_checkpoint_layout(header, opts);
+    
+    if (opts.resume) {
+        std::vector<CheckpointEntry> entries;
+        scan_checkpoints(checkpoint_file, entries);
+        size_t num_entries = entries.size();
+        int found = find_checkpoint(entries, orders.size(), trades.size(), book.track_features, LLONG_MAX);
+        if (found >= 0 && (entries[found].header.layout != header.layout ||
+                           entries[found].header.snapshot_phases != header.snapshot_phases)) {
+            std::cerr << "Cannot resume " << output_file << ": it was written with other column, "
+                      << "compression or snapshot phase options" << std::endl;
+            return REPLAY_FAILED;
+        }
+        // Fall back to an older checkpoint when one is unreadable or ahead of the outputs
+        while (found >= 0 && !(outputs_reach(entries[found].header, output_file, opts) &&
+                               load_checkpoint(checkpoint_file, entries[found], book, session, window) &&
+                               truncate_outputs(entries[found].header, output_file, opts))) {
+            if (verbose_log) std::cout << "Checkpoint " << found + 1 << " does not match the output, skipped" << std::endl;
+            reset_replay_state(book, session, window, opts);
+            entries.resize(found);
+            found = find_checkpoint(entries, orders.size(), trades.size(), book.track_features, LLONG_MAX);
+        }
+        if (found >= 0) {
+            header = entries[found].header;
+            header.features = book.track_features;
+            if (opts.feature_stream.empty()) header.feature_offset = -1;
+            // Drop later or torn records so new checkpoints follow this one
+            truncate_file(checkpoint_file, entries[found].file_offset + CHECKPOINT_HEADER_SIZE + header.body_size);
+            if (verbose_log) {
+                std::cout << "Resumed at event " << header.events_applied << " of " << events.size()
+                          << " from checkpoint " << found + 1 << " of " << num_entries << std::endl;
+            }
+        } else if (verbose_log) {
+            std::cout << "No usable checkpoint, replaying from the start" << std::endl;
+        }
+    }
+    bool resumed = header.events_applied > 0 || header.next_event > 0;
+    
+    // Opened first so a bad name or path leaves the previous output untouched
+    ShmPublisher shm;
+    if (!open_shm_publisher(shm, opts.shm_name)) return REPLAY_FAILED;
+    
+    std::ofstream feature_out;
+    if (!open_feature_stream(feature_out, opts, resumed)) {
+        close_shm_publisher(shm);
+        return REPLAY_FAILED;
+    }
+    
+    OutputStream output;
+    if (!open_output(output, output_file, resumed, opts)) {
+        std::cerr << "Cannot create output file: " << output_file << std::endl;
+        close_shm_publisher(shm);
+        return REPLAY_FAILED;
+    }
+    std::ofstream checkpoints;
+    if (opts.checkpoint_every > 0) {
+        checkpoints.open(checkpoint_file.c_str(),
+                         std::ios::binary | (resumed ? std::ios::app : std::ios::trunc));
+        if (!checkpoints.is_open()) {
+            std::cerr << "Cannot create checkpoint file: " << checkpoint_file << std::endl;
+            close_output(output);
+            close_shm_publisher(shm);
+            return REPLAY_FAILED;
+        }
+    }
+    std::ostream& out = output.out;
+    if (!resumed) write_snapshot_header(out, opts);
+    SnapshotFormatter formatter;
+    start_snapshot_formatter(formatter, opts.format_threads, opts);
+    
+    long long next_checkpoint = header.events_applied + opts.checkpoint_every;
+    bool checkpoint_failed = false;
+    
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    // Per-call timing of the look-ahead and the output, only for --report
+    RunReport* report = opts.report;
+    std::chrono::steady_clock::time_point t0;
+    long long events_before = header.events_applied;
+    start_stage(stage);
+    
+    for (size_t i = (size_t)header.next_event; i <= events.size(); i++) {
+        bool end_of_stream = i == events.size();
+        if (report) t0 = std::chrono::steady_clock::now();
+        if (!end_of_stream) {
+            if (events[i].is_order) {
+                window_push_order(window, orders.get(events[i].index), arrival);
+                header.next_order_row++;
+            } else {
+                window_push_trade(window, trades.get(events[i].index), arrival);
+                header.next_trade_row++;
+            }
+        }
+        for (;;) {
+            bool popped = window_pop(window, ev, end_of_stream);
+            if (report) report->join_s += seconds_since(t0);
+            if (!popped) break;
+            if (apply_pending_event(book, ev, session, sink)) {
+                publish_to_shm(shm, book.snapshots.back());
+                if (report) t0 = std::chrono::steady_clock::now();
+                if (formatter.threads.empty()) {
+                    write_snapshot_row(out, book.snapshots.back(), opts);
+                } else {
+                    format_snapshot(formatter, out, book.snapshots.back());
+                }
+                if (report) report->write_s += seconds_since(t0);
+                book.snapshots.clear();
+                header.snapshots_written++;
+            }
+            if (feature_out.is_open()) write_feature_row(feature_out, book, ev);
+            header.events_applied++;
+            header.time_ms = ev.is_order ? ev.order.time_ms : ev.trade.time_ms;
+            if (report) t0 = std::chrono::steady_clock::now();
+        }
+        
+        if (checkpoints.is_open() && !end_of_stream && header.events_applied >= next_checkpoint) {
+            flush_snapshot_formatter(formatter, out);
+            out.flush();
+            sync_file(output_file);
+            if (feature_out.is_open()) {
+                feature_out.flush();
+                sync_file(opts.feature_stream);
+                header.feature_offset = (long long)feature_out.tellp();
+            }
+            header.next_event = (long long)i + 1;
+            header.output_offset = (long long)out.tellp();
+            if (!write_checkpoint(checkpoints, header, book, session, window)) {
+                std::cerr << "Error writing checkpoint to " << checkpoint_file << std::endl;
+                checkpoint_failed = true;
+                break;
+            }
+            next_checkpoint = header.events_applied + opts.checkpoint_every;
+        }
+    }
+    
+    if (report) {
+        long long applied = header.events_applied - events_before;
+        double wall = seconds_since(stage.wall);
+        add_stage(report, "replay", wall, thread_cpu_seconds() - stage.cpu, applied, 0);
+        add_stage(report, "  immediate-trade join", report->join_s, -1, applied, 0);
+        add_stage(report, "  book update", wall - report->join_s - report->write_s, -1, applied, 0);
+        add_stage(report, "  snapshot rows", report->write_s, -1, header.snapshots_written, 0);
+    }
+    
+    start_stage(stage);
+    flush_snapshot_formatter(formatter, out);
+    stop_snapshot_formatter(formatter);
+    bool written = close_output(output);
+    if (!written) std::cerr << "Error writing " << output_file << std::endl;
+    if (feature_out.is_open()) {
+        feature_out.close();
+        if (feature_out.fail()) {
+            std::cerr << "Error writing " << opts.feature_stream << std::endl;
+            written = false;
+        }
+    }
+    if (report) {
+        long long size = 0;
+        long long mtime = 0;
+        file_stamp(output_file, size, mtime);
+        end_stage(report, "write", stage, header.snapshots_written, size);
+    }
+    close_shm_publisher(shm);
+    if (verbose_log) {
+        std::cout << "Order book snapshots saved to " << output_file << std::endl;
+        std::cout << "Total snapshots: " << header.snapshots_written << std::endl;
+        if (opts.phase_stats) print_phase_stats(session, std::cout);
+    }
+    return written && !checkpoint_failed ? (size_t)header.snapshots_written : REPLAY_FAILED;
+}
+
+size_t process_events(const OrderColumns& orders, 
+                      const TradeColumns& trades,
+                      const std::string& output_file,
+                      const ReplayOptions& opts,
+                      ReplayWorkspace& ws) {
+    NullSink none;
+    return process_events(orders, trades, output_file, opts, ws, none);
+}
+
+size_t process_events(const OrderColumns& orders, 
+                      const TradeColumns& trades,
+                      const std::string& output_file,
+                      const ReplayOptions& opts) {
+    ReplayWorkspace ws;
+    return process_events(orders, trades, output_file, opts, ws);
+}
+
+// Consistency checks run as a book event handler (--check-book)
+struct BookCheckSink : BookEventSink<BookCheckSink> {
+    long long adds;
+    long long fills;
+    long long cancels;
+    long long resting_qty[3];   // per side, from the level changes alone
+    long long crossed_snapshots;
+    long long qty_mismatches;   // snapshots where the levels disagree with resting_qty
+    long long count_mismatches; // snapshots where the level order counts disagree with the orders
+    
+    BookCheckSink() : adds(0), fills(0), cancels(0), crossed_snapshots(0), qty_mismatches(0), count_mismatches(0) {
+        resting_qty[0] = resting_qty[1] = resting_qty[2] = 0;
+    }
+    
+    void on_add(const OrderBook&, const Order&) { adds++; }
+    void on_fill(const OrderBook&, const Trade&) { fills++; }
+    void on_cancel(const OrderBook&, const Trade&) { cancels++; }
+    void on_level_change(const OrderBook&, int side, const LevelChange& change) {
+        resting_qty[side] += change.qty_delta;
+    }
+    
+    void on_snapshot(const OrderBook& book, const BookSnapshot& snapshot) {
+        if (!snapshot.best_bids.empty() && !snapshot.best_asks.empty() &&
+            snapshot.best_bids[0].first >= snapshot.best_asks[0].first) {
+            crossed_snapshots++;
+        }
+        long long bid_qty = 0;
+        long long ask_qty = 0;
+        size_t bid_orders = 0;
+        size_t ask_orders = 0;
+        std::map<double, PriceLevel>::const_iterator it;
+        for (it = book.bid_book.levels.begin(); it != book.bid_book.levels.end(); ++it) {
+            bid_qty += it->second.qty;
+            bid_orders += it->second.orders;
+        }
+        for (it = book.ask_book.levels.begin(); it != book.ask_book.levels.end(); ++it) {
+            ask_qty += it->second.qty;
+            ask_orders += it->second.orders;
+        }
+        if (bid_qty != resting_qty[1] || ask_qty != resting_qty[2]) qty_mismatches++;
+        if (bid_orders != book.bid_book.orders.size() || ask_orders != book.ask_book.orders.size()) count_mismatches++;
+    }
+};
+
+void print_book_checks(const BookCheckSink& check, std::ostream& out) {
+    out << "Book checks: " << check.adds << " orders rested, " << check.fills << " fills, "
+        << check.cancels << " cancels" << std::endl;
+    out << "  crossed snapshots " << check.crossed_snapshots
+        << ", level/quantity mismatches " << check.qty_mismatches
+        << ", level/order count mismatches " << check.count_mismatches << std::endl;
+}
+
+// Bars built from the fills of the replay (--bars)
+enum BarKind { BAR_TIME, BAR_VOLUME, BAR_TICK };
+
+struct BarSpec {
+    BarKind kind;
+    long long size;         // milliseconds, shares or trades
+    std::string label;
+};
+
+struct Bar {
+    long long start;        // HHMMSSmmm: bucket start for time bars, else first trade
+    long long end;          // HHMMSSmmm: bucket end for time bars, else last trade
+    double open;
+    double high;
+    double low;
+    double close;
+    long long volume;
+    double turnover;        // sum of trademoney
+    long long trades;
+};
+
+struct BarSeries {
+    BarSpec spec;
+    bool active;            // a bar is open
+    long long bucket;       // time bucket of the open bar
+    Bar bar;
+};
+
+// Parse "500ms", "1s", "5m", "1h" (time), "v10000" (volume) or "t100" (tick)
+bool parse_bar_spec(const std::string& text, BarSpec& spec) {
+    spec.label = text;
+    if (text.size() < 2) return false;
+    char* end = 0;
+    if (text[0] == 'v' || text[0] == 't') {
+        spec.kind = text[0] == 'v' ? BAR_VOLUME : BAR_TICK;
+        spec.size = std::strtoll(text.c_str() + 1, &end, 10);
+        return *end == '\0' && spec.size > 0;
+    }
+    spec.kind = BAR_TIME;
+    spec.size = std::strtoll(text.c_str(), &end, 10);
+    std::string unit = end;
+    if (unit == "ms") spec.size *= 1;
+    else if (unit == "s") spec.size *= 1000;
+    else if (unit == "m") spec.size *= 60 * 1000;
+    else if (unit == "h") spec.size *= 60 * 60 * 1000;
+    else return false;
+    return spec.size > 0;
+}
+
+// Comma-separated list of bar specs
+bool parse_bar_specs(const std::string& list, std::vector<BarSpec>& specs) {
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        BarSpec spec;
+        if (!parse_bar_spec(item, spec)) {
+            std::cerr << "Bad bar spec: " << item << std::endl;
+            return false;
+        }
+        specs.push_back(spec);
+    }
+    return !specs.empty();
+}
+
+void write_bar_header(std::ostream& out) {
+    out << "bar,start,end,open,high,low,close,volume,turnover,vwap,trades\n";
+}
+
+void write_bar_row(std::ostream& out, const std::string& label, const Bar& bar) {
+    out << label << "," << bar.start << "," << bar.end << ","
+        << std::fixed << std::setprecision(price_decimals)
+        << bar.open << "," << bar.high << "," << bar.low << "," << bar.close << ","
+        << bar.volume << "," << bar.turnover << ","
+        << std::setprecision(4) << (bar.volume > 0 ? bar.turnover / bar.volume : 0.0) << ","
+        << bar.trades << "\n";
+}
+
+// Streams every series' bars as they close, in the same pass as the book
+struct BarSink : BookEventSink<BarSink> {
+    std::vector<BarSeries> series;
+    std::ostream* out;
+    long long bars_written;
+    
+    BarSink(const std::vector<BarSpec>& specs, std::ostream& o) : out(&o), bars_written(0) {
+        for (size_t i = 0; i < specs.size(); i++) {
+            BarSeries s;
+            s.spec = specs[i];
+            s.active = false;
+            s.bucket = 0;
+            series.push_back(s);
+        }
+    }
+    
+    void close_bar(BarSeries& s) {
+        write_bar_row(*out, s.spec.label, s.bar);
+        s.active = false;
+        bars_written++;
+    }
+    
+    void on_fill(const OrderBook&, const Trade& trade) {
+        for (size_t i = 0; i < series.size(); i++) {
+            BarSeries& s = series[i];
+            long long bucket = s.spec.kind == BAR_TIME ? trade.time_ms / s.spec.size : 0;
+            if (s.active && s.spec.kind == BAR_TIME && bucket != s.bucket) close_bar(s);
+            
+            Bar& bar = s.bar;
+            if (!s.active) {
+                s.active = true;
+                s.bucket = bucket;
+                bar.start = s.spec.kind == BAR_TIME ? ms_to_hhmmssmmm(bucket * s.spec.size) : trade.transacttime;
+                bar.end = s.spec.kind == BAR_TIME ? ms_to_hhmmssmmm((bucket + 1) * s.spec.size) : trade.transacttime;
+                bar.open = bar.high = bar.low = trade.tradeprice;
+                bar.volume = 0;
+                bar.turnover = 0;
+                bar.trades = 0;
+            }
+            bar.high = std::max(bar.high, trade.tradeprice);
+            bar.low = std::min(bar.low, trade.tradeprice);
+            bar.close = trade.tradeprice;
+            bar.volume += trade.tradeqty;
+            bar.turnover += trade.trademoney;
+            bar.trades++;
+            if (s.spec.kind != BAR_TIME) bar.end = trade.transacttime;
+            
+            // A volume bar closes on the trade that reaches its size, without splitting it
+            if ((s.spec.kind == BAR_VOLUME && bar.volume >= s.spec.size) ||
+                (s.spec.kind == BAR_TICK && bar.trades >= s.spec.size)) {
+                close_bar(s);
+            }
+        }
+    }
+    
+    // Close the bars still open at the end of the day
+    void finish() {
+        for (size_t i = 0; i < series.size(); i++) {
+            if (series[i].active) close_bar(series[i]);
+        }
+        out->flush();
+    }
+};
+
+// Market-by-price update derived from one level mutation
+struct MbpUpdate {
+    char type;              // 'A' new level, 'C' changed level, 'D' deleted level
+    int side;
+    double price;
+    int qty;                // new level qty, 0 for a delete
+};
+
+// Market-by-price incremental feed (--mbp). Every message carries a sequence
+// number; level updates of one event follow its trade message. A full refresh
+// ('S' with the level count, then one 'R' per level) is sent every
+// refresh_every messages so a consumer can join or recover mid-stream.
+struct MbpSink : BookEventSink<MbpSink> {
+    std::ostream* out;
+    long long seq;
+    long long refresh_every;        // 0 for no refreshes
+    long long since_refresh;
+    std::vector<MbpUpdate> pending; // level updates of the event being applied
+    
+    MbpSink(std::ostream& o, long long refresh) : out(&o), seq(0), refresh_every(refresh), since_refresh(0) {}
+    
+    void write_message(long long transacttime, char type, int side, double price, long long qty) {
+        *out << ++seq << "," << transacttime << "," << type << ",";
+        if (side) *out << side;
+        *out << "," << std::fixed << std::setprecision(price_decimals) << price << "," << qty << "\n";
+        since_refresh++;
+    }
+    
+    void on_level_change(const OrderBook& book, int side, const LevelChange& change) {
+        const std::map<double, PriceLevel>& levels = side == 1 ? book.bid_book.levels : book.ask_book.levels;
+        std::map<double, PriceLevel>::const_iterator it = levels.find(change.price);
+        MbpUpdate update;
+        update.side = side;
+        update.price = change.price;
+        update.qty = it == levels.end() ? 0 : it->second.qty;
+        update.type = it == levels.end() ? 'D' : (it->second.qty == change.qty_delta ? 'A' : 'C');
+        pending.push_back(update);
+    }
+    
+    void flush(const OrderBook& book, long long transacttime) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            const MbpUpdate& u = pending[i];
+            write_message(transacttime, u.type, u.side, u.price, u.qty);
+        }
+        pending.clear();
+        if (refresh_every > 0 && since_refresh >= refresh_every) write_refresh(book, transacttime);
+    }
+    
+    void write_refresh(const OrderBook& book, long long transacttime) {
+        *out << ++seq << "," << transacttime << ",S,,,"
+             << book.bid_book.levels.size() + book.ask_book.levels.size() << "\n";
+        std::map<double, PriceLevel>::const_reverse_iterator bid;
+        for (bid = book.bid_book.levels.rbegin(); bid != book.bid_book.levels.rend(); ++bid) {
+            write_message(transacttime, 'R', 1, bid->first, bid->second.qty);
+        }
+        std::map<double, PriceLevel>::const_iterator ask;
+        for (ask = book.ask_book.levels.begin(); ask != book.ask_book.levels.end(); ++ask) {
+            write_message(transacttime, 'R', 2, ask->first, ask->second.qty);
+        }
+        since_refresh = 0;
+    }
+    
+    void on_add(const OrderBook& book, const Order& order) { flush(book, order.transacttime); }
+    void on_fill(const OrderBook& book, const Trade& trade) {
+        write_message(trade.transacttime, 'T', 0, trade.tradeprice, trade.tradeqty);
+        flush(book, trade.transacttime);
+    }
+    void on_cancel(const OrderBook& book, const Trade& trade) { flush(book, trade.transacttime); }
+};
+
+void write_mbp_header(std::ostream& out) {
+    out << "seq,transacttime,type,side,price,qty\n";
+}
+
+const char LIFECYCLE_MAGIC[4] = {'O', 'B', 'L', 'C'};
+const uint32_t LIFECYCLE_VERSION = 1;
+const uint32_t LIFECYCLE_VERSION_DELTA = 2;
+
+// Lifetime of every order of the replay (--lifecycle), one column per field
+// and one row per order, about 31 bytes per order plus 4 per applseqnum of
+// the index. Times are milliseconds since midnight, -1 when not reached.
+// States: 'o' open, 'p' partially filled and open, 'f' filled, 'c' cancelled.
+struct LifecycleStore : BookEventSink<LifecycleStore> {
+    int base;                       // applseqnum of row_of[0]
+    std::vector<int> row_of;        // applseqnum - base -> row, -1 if none; applseqnums are dense per channel
+    
+    std::vector<int> applseqnum;
+    std::vector<char> side;
+    std::vector<char> ordertype;
+    std::vector<char> state;
+    std::vector<int> arrival_ms;
+    std::vector<int> price_tick;    // limit price in ticks, 0 for market orders
+    std::vector<int> orig_qty;
+    std::vector<int> filled_qty;
+    std::vector<int> first_fill_ms;
+    std::vector<int> final_ms;      // time the order was filled or cancelled
+    
+    LifecycleStore() : base(0) {}
+    
+    int find_row(int seq) const {
+        return seq >= base && seq - base < (int)row_of.size() ? row_of[seq - base] : -1;
+    }
+    
+    // A reused applseqnum replaces the order, so it starts a new row
+    void on_order(const OrderBook&, const Order& order) {
+        if (order.applseqnum <= 0) return;
+        if (row_of.empty()) base = order.applseqnum;
+        if (order.applseqnum < base) {
+            row_of.insert(row_of.begin(), base - order.applseqnum, -1);
+            base = order.applseqnum;
+        }
+        size_t index = order.applseqnum - base;
+        if (index >= row_of.size()) row_of.resize(std::max(index + 1, row_of.size() * 2), -1);
+        row_of[index] = (int)applseqnum.size();
+        applseqnum.push_back(order.applseqnum);
+        side.push_back((char)order.side);
+        ordertype.push_back(order.ordertype);
+        state.push_back('o');
+        arrival_ms.push_back((int)order.time_ms);
+        price_tick.push_back((int)price_to_tick(order.price));
+        orig_qty.push_back(order.orderqty);
+        filled_qty.push_back(0);
+        first_fill_ms.push_back(-1);
+        final_ms.push_back(-1);
+    }
+    
+    void fill(int seq, const Trade& trade) {
+        int row = find_row(seq);
+        if (row < 0 || state[row] == 'f' || state[row] == 'c') return;
+        filled_qty[row] += trade.tradeqty;
+        if (first_fill_ms[row] < 0) first_fill_ms[row] = (int)trade.time_ms;
+        if (filled_qty[row] >= orig_qty[row]) {
+            state[row] = 'f';
+            final_ms[row] = (int)trade.time_ms;
+        } else {
+            state[row] = 'p';
+        }
+    }
+    
+    void cancel(int seq, const Trade& trade) {
+        int row = find_row(seq);
+        if (row < 0 || state[row] == 'f' || state[row] == 'c') return;
+        state[row] = 'c';
+        final_ms[row] = (int)trade.time_ms;
+    }
+    
+    void on_fill(const OrderBook&, const Trade& trade) {
+        fill(trade.bidapplseqnum, trade);
+        fill(trade.offerapplseqnum, trade);
+    }
+    void on_cancel(const OrderBook&, const Trade& trade) {
+        cancel(trade.bidapplseqnum, trade);
+        cancel(trade.offerapplseqnum, trade);
+    }
+};
+
+template <typename T>
+void write_column(std::ostream& out, const std::vector<T>& column) {
+    if (!column.empty()) out.write((const char*)&column[0], column.size() * sizeof(T));
+}
+
+// Binary columnar export: "OBLC", version, row count, tick size, then each
+// column in full in the order of the LifecycleStore fields
+bool write_lifecycle_binary(const LifecycleStore& store, const std::string& path) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+    uint64_t rows = store.applseqnum.size();
+    out.write(LIFECYCLE_MAGIC, 4);
+    out.write((const char*)&LIFECYCLE_VERSION, sizeof(LIFECYCLE_VERSION));
+    out.write((const char*)&rows, sizeof(rows));
+    double tick = tick_to_price(1);
+    out.write((const char*)&tick, sizeof(tick));
+    write_column(out, store.applseqnum);
+    write_column(out, store.side);
+    write_column(out, store.ordertype);
+    write_column(out, store.state);
+    write_column(out, store.arrival_ms);
+    write_column(out, store.price_tick);
+    write_column(out, store.orig_qty);
+    write_column(out, store.filled_qty);
+    write_column(out, store.first_fill_ms);
+    write_column(out, store.final_ms);
+    return out.good();
+}
+
+bool write_lifecycle_csv(const LifecycleStore& store, const std::string& path) {
+    std::ofstream out(path.c_str());
+    if (!out.is_open()) return false;
+    out << "applseqnum,side,ordertype,state,arrival,price,orig_qty,filled_qty,first_fill,final\n";
+    for (size_t i = 0; i < store.applseqnum.size(); i++) {
+        out << store.applseqnum[i] << "," << (int)store.side[i] << "," << store.ordertype[i] << ","
+            << store.state[i] << "," << ms_to_hhmmssmmm(store.arrival_ms[i]) << ","
+            << std::fixed << std::setprecision(price_decimals) << tick_to_price(store.price_tick[i]) << ","
+            << store.orig_qty[i] << "," << store.filled_qty[i] << ",";
+        if (store.first_fill_ms[i] >= 0) out << ms_to_hhmmssmmm(store.first_fill_ms[i]);
+        out << ",";
+        if (store.final_ms[i] >= 0) out << ms_to_hhmmssmmm(store.final_ms[i]);
+        out << "\n";
+    }
+    return out.good();
+}
+
+// Column as the differences between consecutive values, zigzag varints
+// (obz_read_varint in book_reader.h), after its size in bytes
+void write_delta_column(std::ostream& out, const std::vector<int>& column) {
+    std::string bytes;
+    long long previous = 0;
+    for (size_t i = 0; i < column.size(); i++) {
+        long long delta = column[i] - previous;
+        previous = column[i];
+        unsigned long long v = ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63);
+        for (; v >= 128; v >>= 7) bytes += (char)(v | 128);
+        bytes += (char)v;
+    }
+    uint64_t size = bytes.size();
+    out.write((const char*)&size, sizeof(size));
+    out.write(bytes.data(), bytes.size());
+}
+
+// Version 2 of the binary export (--compress): the same header and column
+// order, the int columns delta coded and the char columns as they are
+bool write_lifecycle_delta(const LifecycleStore& store, const std::string& path) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+    uint64_t rows = store.applseqnum.size();
+    out.write(LIFECYCLE_MAGIC, 4);
+    out.write((const char*)&LIFECYCLE_VERSION_DELTA, sizeof(LIFECYCLE_VERSION_DELTA));
+    out.write((const char*)&rows, sizeof(rows));
+    double tick = tick_to_price(1);
+    out.write((const char*)&tick, sizeof(tick));
+    write_delta_column(out, store.applseqnum);
+    write_column(out, store.side);
+    write_column(out, store.ordertype);
+    write_column(out, store.state);
+    write_delta_column(out, store.arrival_ms);
+    write_delta_column(out, store.price_tick);
+    write_delta_column(out, store.orig_qty);
+    write_delta_column(out, store.filled_qty);
+    write_delta_column(out, store.first_fill_ms);
+    write_delta_column(out, store.final_ms);
+    return out.good();
+}
+
+// Export as CSV when path ends in .csv, binary columns otherwise
+bool write_lifecycle(const LifecycleStore& store, const std::string& path, bool compress) {
+    bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    if (csv) return write_lifecycle_csv(store, path);
+    return compress ? write_lifecycle_delta(store, path) : write_lifecycle_binary(store, path);
+}
+
+void print_lifecycle_summary(const LifecycleStore& store, std::ostream& out) {
+    long long counts[4] = {0, 0, 0, 0};
+    const char states[4] = {'o', 'p', 'f', 'c'};
+    for (size_t i = 0; i < store.state.size(); i++) {
+        for (int s = 0; s < 4; s++) {
+            if (store.state[i] == states[s]) counts[s]++;
+        }
+    }
+    size_t rows = store.applseqnum.size();
+    size_t bytes = rows * (7 * sizeof(int) + 3) + store.row_of.size() * sizeof(int);
+    out << "Order lifecycles: " << rows << " orders, " << counts[2] << " filled, " << counts[3]
+        << " cancelled, " << counts[0] + counts[1] << " open (" << counts[1] << " partially filled), "
+        << (rows ? bytes / rows : 0) << " bytes/order" << std::endl;
+}
+
+// Handlers chosen on the command line; each one is optional
+struct ReplaySinks {
+    BookCheckSink* check;
+    BarSink* bars;
+    MbpSink* mbp;
+    LifecycleStore* lifecycle;
+    
+    ReplaySinks() : check(0), bars(0), mbp(0), lifecycle(0) {}
+    bool any() const { return check || bars || mbp || lifecycle; }
+};
+
+// The chosen handlers are composed at compile time: each step puts its
+// handler in front of the chain when it is set and passes the chain on as it
+// is otherwise, so process_events is instantiated for the exact combination
+// (check, bars, MBP, lifecycle, in that order) and a handler that is off
+// costs nothing. The chain starts from a NullSink.
+template <typename Chain>
+size_t replay_with_check(const OrderColumns& orders, const TradeColumns& trades, const std::string& output_file,
+                         const ReplayOptions& opts, ReplayWorkspace& ws, const ReplaySinks& sinks, Chain chain) {
+    if (!sinks.check) return process_events(orders, trades, output_file, opts, ws, chain);
+    SinkPair<BookCheckSink, Chain> next = make_sink_pair(*sinks.check, chain);
+    return process_events(orders, trades, output_file, opts, ws, next);
+}
+
+template <typename Chain>
+size_t replay_with_bars(const OrderColumns& orders, const TradeColumns& trades, const std::string& output_file,
+                        const ReplayOptions& opts, ReplayWorkspace& ws, const ReplaySinks& sinks, Chain chain) {
+    if (!sinks.bars) return replay_with_check(orders, trades, output_file, opts, ws, sinks, chain);
+    return replay_with_check(orders, trades, output_file, opts, ws, sinks, make_sink_pair(*sinks.bars, chain));
+}
+
+template <typename Chain>
+size_t replay_with_mbp(const OrderColumns& orders, const TradeColumns& trades, const std::string& output_file,
+                       const ReplayOptions& opts, ReplayWorkspace& ws, const ReplaySinks& sinks, Chain chain) {
+    if (!sinks.mbp) return replay_with_bars(orders, trades, output_file, opts, ws, sinks, chain);
+    return replay_with_bars(orders, trades, output_file, opts, ws, sinks, make_sink_pair(*sinks.mbp, chain));
+}
+
+size_t replay_with_sinks(const OrderColumns& orders,
+                         const TradeColumns& trades,
+                         const std::string& output_file,
+                         const ReplayOptions& opts,
+                         ReplayWorkspace& ws,
+                         const ReplaySinks& sinks) {
+    NullSink none;
+    if (!sinks.lifecycle) return replay_with_mbp(orders, trades, output_file, opts, ws, sinks, none);
+    return replay_with_mbp(orders, trades, output_file, opts, ws, sinks, make_sink_pair(*sinks.lifecycle, none));
+}
+
+// Replay without snapshots, keeping a checkpoint body every interval applied events
+void capture_checkpoints(const OrderColumns& orders, const TradeColumns& trades,
+                         const std::vector<Event>& events, long long interval, bool auction, bool features,
+                         std::vector<CheckpointHeader>& headers, std::vector<std::string>& bodies) {
+    OrderBook book;
+    init_orderbook(book);
+    book.track_auction = auction;
+    book.track_features = features;
+    SessionPolicy no_snapshots;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        no_snapshots.snapshot_orders[i] = false;
+        no_snapshots.snapshot_trades[i] = false;
+    }
+    SessionState session;
+    init_session_state(session, no_snapshots);
+    LookaheadWindow window;
+    init_window(window);
+    
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.num_orders = (long long)orders.size();
+    header.num_trades = (long long)trades.size();
+    header.features = features;
+    
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    long long next_checkpoint = interval;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].is_order) {
+            window_push_order(window, orders.get(events[i].index), arrival);
+            header.next_order_row++;
+        } else {
+            window_push_trade(window, trades.get(events[i].index), arrival);
+            header.next_trade_row++;
+        }
+        while (window_pop(window, ev, false)) {
+            apply_pending_event(book, ev, session);
+            header.events_applied++;
+            header.time_ms = ev.is_order ? ev.order.time_ms : ev.trade.time_ms;
+        }
+        if (header.events_applied < next_checkpoint) continue;
+        
+        header.next_event = (long long)i + 1;
+        std::string body;
+        serialize_book(body, book);
+        serialize_session(body, session);
+        serialize_window(body, window);
+        headers.push_back(header);
+        bodies.push_back(body);
+        next_checkpoint = header.events_applied + interval;
+    }
+}
+
+// One time segment of a parallel replay
+struct ReplaySegment {
+    const std::string* start;   // checkpoint body to start from, NULL for the first segment
+    long long next_event;
+    long long events_applied;   // events applied before the segment
+    long long stop_applied;     // the next segment starts after this many, -1 for the last
+    
+    // Filled in by the worker
+    bool ok;                    // false if the start checkpoint could not be restored
+    std::string output;         // snapshot rows
+    size_t num_snapshots;
+    SessionState session;       // session at the end of the segment
+    long long snapshots_before[NUM_PHASES];
+};
+
+void replay_segment(const OrderColumns& orders, const TradeColumns& trades,
+                    const std::vector<Event>& events, const ReplayOptions& opts, ReplaySegment& seg) {
+    OrderBook book;
+    init_orderbook(book);
+    book.track_auction = opts.auction;
+    book.track_features = opts.features || !opts.feature_stream.empty();
+    book.track_order_counts = opts.order_counts;
+    init_session_state(seg.session, opts.session);
+    LookaheadWindow window;
+    init_window(window);
+    seg.ok = seg.start == NULL || restore_checkpoint(*seg.start, book, seg.session, window);
+    seg.num_snapshots = 0;
+    if (!seg.ok) return;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        seg.snapshots_before[i] = seg.session.stats[i].snapshots;
+    }
+    
+    std::ostringstream out;
+    long long applied = seg.events_applied;
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    for (size_t i = (size_t)seg.next_event; i <= events.size() && applied != seg.stop_applied; i++) {
+        bool end_of_stream = i == events.size();
+        if (!end_of_stream) {
+            if (events[i].is_order) {
+                window_push_order(window, orders.get(events[i].index), arrival);
+            } else {
+                window_push_trade(window, trades.get(events[i].index), arrival);
+            }
+        }
+        while (applied != seg.stop_applied && window_pop(window, ev, end_of_stream)) {
+            if (apply_pending_event(book, ev, seg.session)) {
+                write_snapshot_row(out, book.snapshots.back(), opts);
+                book.snapshots.clear();
+                seg.num_snapshots++;
+            }
+            applied++;
+        }
+    }
+    seg.output = out.str();
+}
+
+// Replay split into time segments run on parallel threads. Each segment starts
+// from a checkpoint, taken from <output>.ckpt when it matches the input or else
+// from a snapshot-free pre-pass; the segment outputs are concatenated, so the
+// result is identical to a serial run. Returns the number of snapshots written
+// or REPLAY_FAILED.
+size_t process_events_parallel(const OrderColumns& orders,
+                               const TradeColumns& trades,
+                               const std::string& output_file,
+                               const ReplayOptions& opts,
+                               int num_segments) {
+    std::vector<Event> events;
+    build_events(orders, trades, events);
+    if (num_segments < 1) num_segments = 1;
+    
+    std::vector<CheckpointHeader> headers;
+    std::vector<std::string> bodies;
+    bool features = opts.features || !opts.feature_stream.empty();
+    std::string checkpoint_file = output_file + ".ckpt";
+    std::vector<CheckpointEntry> entries;
+    scan_checkpoints(checkpoint_file, entries);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const CheckpointHeader& h = entries[i].header;
+        if (!checkpoint_matches(h, orders.size(), trades.size(), features)) continue;
+        std::string body;
+        if (!read_checkpoint_body(checkpoint_file, entries[i], body)) break;
+        headers.push_back(h);
+        bodies.push_back(body);
+    }
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool from_file = !headers.empty();
+    if (!from_file) {
+        long long interval = ((long long)events.size() + num_segments - 1) / num_segments;
+        capture_checkpoints(orders, trades, events, std::max(interval, 1LL), opts.auction, features,
+                            headers, bodies);
+    }
+    double prepass_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    // Spread the segment starts evenly over the available checkpoints
+    std::vector<ReplaySegment> segments(1);
+    segments[0].start = NULL;
+    segments[0].next_event = 0;
+    segments[0].events_applied = 0;
+    size_t step = std::max((size_t)1, headers.size() / num_segments + (headers.size() % num_segments ? 1 : 0));
+    if (!from_file) step = 1;
+    for (size_t i = step - 1; i < headers.size() && (int)segments.size() < num_segments; i += step) {
+        ReplaySegment seg;
+        seg.start = &bodies[i];
+        seg.next_event = headers[i].next_event;
+        seg.events_applied = headers[i].events_applied;
+        segments.push_back(seg);
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        segments[i].stop_applied = i + 1 < segments.size() ? segments[i + 1].events_applied : -1;
+    }
+    
+    // Workers stay quiet; the pre-pass already logged the session phases
+    bool was_verbose = verbose_log;
+    verbose_log = false;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < segments.size(); i++) {
+        threads.push_back(std::thread(replay_segment, std::cref(orders), std::cref(trades),
+                                      std::cref(events), std::cref(opts), std::ref(segments[i])));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    verbose_log = was_verbose;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (!segments[i].ok) {
+            std::cerr << "Cannot restore the checkpoint of segment " << i + 1 << " of " << segments.size() << std::endl;
+            return REPLAY_FAILED;
+        }
+    }
+    
+    OutputStream output;
+    if (!open_output(output, output_file, false, opts)) {
+        std::cerr << "Cannot create output file: " << output_file << std::endl;
+        return REPLAY_FAILED;
+    }
+    write_snapshot_header(output.out, opts);
+    size_t num_snapshots = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        output.out.write(segments[i].output.data(), segments[i].output.size());
+        num_snapshots += segments[i].num_snapshots;
+    }
+    if (!close_output(output)) {
+        std::cerr << "Error writing " << output_file << std::endl;
+        return REPLAY_FAILED;
+    }
+    
+    // The last segment carries the totals, except snapshots counted per segment
+    SessionState session = segments.back().session;
+    for (int p = 0; p < NUM_PHASES; p++) {
+        session.stats[p].snapshots = 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            session.stats[p].snapshots += segments[i].session.stats[p].snapshots - segments[i].snapshots_before[p];
+        }
+    }
+    
+    if (verbose_log) {
+        std::cout << "Replayed " << segments.size() << " segments in parallel, starting states "
+                  << (from_file ? "from " + checkpoint_file : "from a pre-pass") << " ("
+                  << std::fixed << std::setprecision(3) << prepass_secs << " s)" << std::endl;
+        std::cout << "Order book snapshots saved to " << output_file << std::endl;
+        std::cout << "Total snapshots: " << num_snapshots << std::endl;
+        if (opts.phase_stats) print_phase_stats(session, std::cout);
+    }
+    return num_snapshots;
+}
+
+// One (orders, trades, output) triple from a batch manifest
+struct BatchJob {
+    std::string order_path;
+    std::string trade_path;
+    std::string output_path;
+    long long input_bytes;
+    
+    // Filled in by the worker
+    bool ok;
+    size_t num_orders;
+    size_t num_trades;
+    size_t num_snapshots;
+    double seconds;
+};
+
+// Size of a file in bytes, 0 if it cannot be opened
+long long get_file_size(const std::string& filename) {
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return 0;
+    return (long long)file.tellg();
+}
+
+// Read batch manifest: one "orders,trades,output" triple per line, '#' starts a comment
+bool read_manifest(const std::string& filename, std::vector<BatchJob>& jobs) {
+    std::ifstream file(filename.c_str());
+    if (!file.is_open()) {
+        std::cerr << "Cannot open manifest: " << filename << std::endl;
+        return false;
+    }
+    
+    std::string line;
+    std::vector<std::string> fields;
+    int line_num = 0;
+    while (std::getline(file, line)) {
+        line_num++;
+        if (line.empty() || line[0] == '#' || line == "\r") continue;
+        
+        if (split_csv_line(line, fields) < 3) {
+            std::cerr << "Warning: Manifest line " << line_num << " needs orders,trades,output" << std::endl;
+            continue;
+        }
+        
+        BatchJob job;
+        job.order_path = fields[0];
+        job.trade_path = fields[1];
+        job.output_path = fields[2];
+        job.input_bytes = get_file_size(job.order_path) + get_file_size(job.trade_path);
+        job.ok = false;
+        job.num_orders = 0;
+        job.num_trades = 0;
+        job.num_snapshots = 0;
+        job.seconds = 0;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Largest input first, so the long jobs do not end up last on one worker
+bool compare_jobs_by_size_desc(const BatchJob* a, const BatchJob* b) {
+    return a->input_bytes > b->input_bytes;
+}
+
+// Shared state of the batch worker pool
+struct BatchQueue {
+    const ReplayOptions* opts;
+    std::vector<BatchJob*> order;   // jobs in scheduling order
+    std::atomic<size_t> next;
+    std::mutex log_mutex;
+};
+
+// Run one job using the worker's workspace
+void run_batch_job(BatchJob& job, const ReplayOptions& opts, ReplayWorkspace& ws) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    ws.orders.clear();
+    ws.trades.clear();
+    bool parsed = read_order_file(job.order_path, ws.orders, ws.parse);
+    parsed = read_trade_file(job.trade_path, ws.trades, ws.parse) && parsed;
+    
+    job.num_orders = ws.orders.size();
+    job.num_trades = ws.trades.size();
+    if (parsed && !ws.orders.empty()) {
+        job.num_snapshots = process_events(ws.orders, ws.trades, job.output_path, opts, ws);
+        job.ok = job.num_snapshots != REPLAY_FAILED;
+        if (!job.ok) job.num_snapshots = 0;
+    }
+    
+    job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Print throughput of a finished job
+void print_job_report(const BatchJob& job) {
+    size_t num_events = job.num_orders + job.num_trades;
+    double secs = job.seconds > 0 ? job.seconds : 1e-9;
+    std::cout << (job.ok ? "[done] " : "[FAIL] ") << job.output_path
+              << ": " << num_events << " events, " << job.num_snapshots << " snapshots, "
+              << std::fixed << std::setprecision(3) << job.seconds << " s, "
+              << std::setprecision(0) << num_events / secs << " events/s, "
+              << std::setprecision(1) << job.input_bytes / secs / 1e6 << " MB/s" << std::endl;
+}
+
+void batch_worker(BatchQueue& queue) {
+    ReplayWorkspace ws;
+    for (;;) {
+        size_t i = queue.next.fetch_add(1);
+        if (i >= queue.order.size()) break;
+        
+        BatchJob& job = *queue.order[i];
+        run_batch_job(job, *queue.opts, ws);
+        
+        std::lock_guard<std::mutex> lock(queue.log_mutex);
+        print_job_report(job);
+    }
+}
+
+// Replay every job of a manifest on a fixed pool of workers
+int run_batch(const std::string& manifest, int num_workers, const ReplayOptions& opts) {
+    std::vector<BatchJob> jobs;
+    if (!read_manifest(manifest, jobs)) return 1;
+    if (jobs.empty()) {
+        std::cerr << "Error: Manifest has no jobs!" << std::endl;
+        return 1;
+    }
+    
+    BatchQueue queue;
+    queue.opts = &opts;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        queue.order.push_back(&jobs[i]);
+    }
+    std::stable_sort(queue.order.begin(), queue.order.end(), compare_jobs_by_size_desc);
+    queue.next = 0;
+    
+    if (num_workers <= 0) num_workers = (int)std::thread::hardware_concurrency();
+    if (num_workers <= 0) num_workers = 1;
+    if ((size_t)num_workers > jobs.size()) num_workers = (int)jobs.size();
+    
+    std::cout << "Batch: " << jobs.size() << " jobs on " << num_workers << " workers" << std::endl;
+    
+    verbose_log = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    std::vector<std::thread> workers;
+    for (int i = 0; i < num_workers; i++) {
+        workers.push_back(std::thread(batch_worker, std::ref(queue)));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    
+    double total_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t total_events = 0;
+    long long total_bytes = 0;
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        total_events += jobs[i].num_orders + jobs[i].num_trades;
+        total_bytes += jobs[i].input_bytes;
+        if (!jobs[i].ok) failed++;
+    }
+    if (total_secs <= 0) total_secs = 1e-9;
+    
+    std::cout << "Batch complete: " << jobs.size() - failed << "/" << jobs.size() << " jobs, "
+              << total_events << " events in " << std::fixed << std::setprecision(3) << total_secs << " s ("
+              << std::setprecision(0) << total_events / total_secs << " events/s, "
+              << std::setprecision(1) << total_bytes / total_secs / 1e6 << " MB/s)" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// Live input: stdin ("-"), a file or FIFO path, "tcp:PORT" or "udp:PORT" on localhost
+struct LiveSource {
+    std::istream* stream;   // only used where descriptors cannot be polled
+    std::ifstream file;
+    int fd;                 // -1 when reading a stream
+    std::string buffer;
+    size_t buffer_pos;
+};
+
+// Results of read_live_line
+enum LiveRead {
+    LIVE_EOF,
+    LIVE_LINE,
+    LIVE_TIMEOUT
+};
+
+#ifndef _WIN32
+// Socket bound to "tcp:PORT" or "udp:PORT" on localhost, -1 on failure
+int bind_local_socket(const std::string& spec) {
+    bool udp = spec.compare(0, 4, "udp:") == 0;
+    int port = std::atoi(spec.c_str() + 4);
+    
+    int sock = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sock < 0) {
+        std::cerr << "Cannot create socket for " << spec << std::endl;
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Cannot bind " << spec << std::endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+#endif
+
+bool open_socket_source(LiveSource& src, const std::string& spec) {
+#ifdef _WIN32
+    std::cerr << "Socket input is not supported on this platform: " << spec << std::endl;
+    return false;
+#else
+    bool udp = spec.compare(0, 4, "udp:") == 0;
+    int sock = bind_local_socket(spec);
+    if (sock < 0) return false;
+    
+    if (udp) {
+        src.fd = sock;
+        return true;
+    }
+    
+    listen(sock, 1);
+    std::cerr << "Waiting for feed connection on " << spec << std::endl;
+    src.fd = accept(sock, NULL, NULL);
+    close(sock);
+    if (src.fd < 0) {
+        std::cerr << "Accept failed on " << spec << std::endl;
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool open_live_source(LiveSource& src, const std::string& spec) {
+    src.stream = NULL;
+    src.fd = -1;
+    src.buffer.clear();
+    src.buffer_pos = 0;
+    
+    if (spec.compare(0, 4, "tcp:") == 0 || spec.compare(0, 4, "udp:") == 0) {
+        return open_socket_source(src, spec);
+    }
+    
+#ifndef _WIN32
+    src.fd = spec == "-" ? 0 : open(spec.c_str(), O_RDONLY);
+    if (src.fd < 0) {
+        std::cerr << "Cannot open live source: " << spec << std::endl;
+        return false;
+    }
+    return true;
+#endif
+    
+    if (spec == "-") {
+        src.stream = &std::cin;
+        return true;
+    }
+    src.file.open(spec.c_str());
+    if (!src.file.is_open()) {
+        std::cerr << "Cannot open live source: " << spec << std::endl;
+        return false;
+    }
+    src.stream = &src.file;
+    return true;
+}
+
+// Next message line. Waits at most timeout_ms for new input (forever if negative).
+LiveRead read_live_line(LiveSource& src, std::string& line, int timeout_ms) {
+    if (src.stream != NULL) {
+        return std::getline(*src.stream, line) ? LIVE_LINE : LIVE_EOF;
+    }
+    
+#ifndef _WIN32
+    for (;;) {
+        size_t eol = src.buffer.find('\n', src.buffer_pos);
+        if (eol != std::string::npos) {
+            line.assign(src.buffer, src.buffer_pos, eol - src.buffer_pos);
+            src.buffer_pos = eol + 1;
+            return LIVE_LINE;
+        }
+        
+        src.buffer.erase(0, src.buffer_pos);
+        src.buffer_pos = 0;
+        
+        if (timeout_ms >= 0) {
+            pollfd pfd;
+            pfd.fd = src.fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, timeout_ms) == 0) return LIVE_TIMEOUT;
+        }
+        
+        char chunk[65536];
+        ssize_t n = read(src.fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            if (src.buffer.empty()) return LIVE_EOF;
+            line.swap(src.buffer);
+            src.buffer.clear();
+            return LIVE_LINE;
+        }
+        src.buffer.append(chunk, (size_t)n);
+    }
+#else
+    return LIVE_EOF;
+#endif
+}
+
+void close_live_source(LiveSource& src) {
+#ifndef _WIN32
+    if (src.fd > 0) close(src.fd);
+#endif
+    src.fd = -1;
+    if (src.file.is_open()) src.file.close();
+}
+
+// Arrival-to-publication latency of live snapshots, in microseconds
+struct LatencyStats {
+    std::vector<double> samples;
+};
+
+void print_latency_stats(LatencyStats& stats, std::ostream& out) {
+    if (stats.samples.empty()) {
+        out << "No snapshots published" << std::endl;
+        return;
+    }
+    std::vector<double>& v = stats.samples;
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (size_t i = 0; i < v.size(); i++) sum += v[i];
+    
+    out << "Latency (us) over " << v.size() << " snapshots: "
+        << std::fixed << std::setprecision(1)
+        << "mean " << sum / v.size()
+        << ", p50 " << v[v.size() / 2]
+        << ", p99 " << v[(v.size() * 99) / 100]
+        << ", max " << v.back() << std::endl;
+}
+
+// Publish snapshots taken since the last call and record their latency
+void publish_snapshots(OrderBook& book, std::ostream& out, ShmPublisher& shm, const ReplayOptions& opts,
+                       std::chrono::steady_clock::time_point arrival, LatencyStats& stats) {
+    if (book.snapshots.empty()) return;
+    for (size_t i = 0; i < book.snapshots.size(); i++) {
+        write_snapshot_row(out, book.snapshots[i], opts);
+    }
+    out.flush();
+    publish_to_shm(shm, book.snapshots.back());
+    
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - arrival).count();
+    for (size_t i = 0; i < book.snapshots.size(); i++) {
+        stats.samples.push_back(us);
+    }
+    book.snapshots.clear();
+}
+
+// Parse one live message into the window, false if it is malformed
+bool push_live_message(LookaheadWindow& window, const std::string& line,
+                       std::chrono::steady_clock::time_point arrival,
+                       std::string& body, std::vector<std::string>& fields) {
+    body.assign(line, line.size() > 2 ? 2 : line.size(), std::string::npos);
+    size_t field_count = split_csv_line(body, fields);
+    
+    if (line.compare(0, 2, "O,") == 0) {
+        Order order;
+        if (!parse_order_fields(fields, field_count, order) || !on_price_tick(order.price)) return false;
+        window_push_order(window, order, arrival);
+        return true;
+    }
+    if (line.compare(0, 2, "T,") == 0) {
+        Trade trade;
+        if (!parse_trade_fields(fields, field_count, trade) || !on_price_tick(trade.tradeprice)) return false;
+        window_push_trade(window, trade, arrival);
+        return true;
+    }
+    return false;
+}
+
+// Live mode: consume "O,<order fields>" / "T,<trade fields>" lines until "E" or end of input.
+// With max_hold_ms > 0 a held market/best order is released as not immediate
+// once the feed has been quiet for that long, bounding publication latency.
+int run_live(const std::string& source_spec, const std::string& output_file, int max_hold_ms,
+             const ReplayOptions& opts) {
+    LiveSource src;
+    if (!open_live_source(src, source_spec)) return 1;
+    
+    // Opened first so a bad name or path leaves the previous output untouched
+    ShmPublisher shm;
+    if (!open_shm_publisher(shm, opts.shm_name)) {
+        close_live_source(src);
+        return 1;
+    }
+    std::ofstream feature_out;
+    if (!open_feature_stream(feature_out, opts, false)) {
+        close_shm_publisher(shm);
+        close_live_source(src);
+        return 1;
+    }
+    
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (output_file != "-") {
+        file.open(output_file.c_str());
+        if (!file.is_open()) {
+            std::cerr << "Cannot create output file: " << output_file << std::endl;
+            close_shm_publisher(shm);
+            close_live_source(src);
+            return 1;
+        }
+        out = &file;
+    } else {
+        verbose_log = false;
+    }
+    write_snapshot_header(*out, opts);
+    out->flush();
+    
+    OrderBook book;
+    init_orderbook(book);
+    book.track_auction = opts.auction;
+    book.track_features = opts.features || !opts.feature_stream.empty();
+    book.track_order_counts = opts.order_counts;
+    LookaheadWindow window;
+    init_window(window);
+    LatencyStats stats;
+    SessionState session;
+    init_session_state(session, opts.session);
+    
+    std::string line;
+    std::string body;
+    std::vector<std::string> fields;
+    long long num_messages = 0;
+    long long num_rejected = 0;
+    long long num_hold_expired = 0;
+    PendingEvent ev;
+    
+    for (;;) {
+        int timeout_ms = (max_hold_ms > 0 && !window.undecided.empty()) ? max_hold_ms : -1;
+        LiveRead result = read_live_line(src, line, timeout_ms);
+        if (result == LIVE_EOF) break;
+        
+        std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+        if (result == LIVE_TIMEOUT) {
+            num_hold_expired += window_expire_held(window, arrival, std::chrono::milliseconds(max_hold_ms));
+        } else {
+            if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+            if (line.empty()) continue;
+            if (line == "E") break;
+            
+            num_messages++;
+            if (!push_live_message(window, line, arrival, body, fields)) num_rejected++;
+        }
+        
+        while (window_pop(window, ev, false)) {
+            apply_pending_event(book, ev, session);
+            publish_snapshots(book, *out, shm, opts, ev.arrival, stats);
+            if (feature_out.is_open()) {
+                write_feature_row(feature_out, book, ev);
+                feature_out.flush();
+            }
+        }
+    }
+    
+    while (window_pop(window, ev, true)) {
+        apply_pending_event(book, ev, session);
+        publish_snapshots(book, *out, shm, opts, ev.arrival, stats);
+        if (feature_out.is_open()) {
+            write_feature_row(feature_out, book, ev);
+            feature_out.flush();
+        }
+    }
+    close_live_source(src);
+    close_shm_publisher(shm);
+    
+    std::cerr << "Live stream ended: " << num_messages << " messages, "
+              << num_rejected << " rejected, "
+              << num_hold_expired << " held orders released on timeout, "
+              << "window depth max " << window.max_pending << std::endl;
+    print_latency_stats(stats, std::cerr);
+    if (opts.phase_stats) print_phase_stats(session, std::cerr);
+    return 0;
+}
+
+// Input file that is still being appended to. Appended bytes are read on
+// every poll; only complete lines are parsed, a partial last line waits in
+// the buffer for its newline.
+template <typename Record>
+struct FollowedFile {
+    std::ifstream file;
+    std::string buffer;
+    size_t buffer_pos;
+    bool header_read;
+    long long rows;
+    long long last_time_ms;     // time of the last row parsed, -1 before the first
+    std::deque<Record> pending;                                 // parsed, not yet merged
+    std::deque<std::chrono::steady_clock::time_point> arrivals; // when each pending row was read
+};
+
+template <typename Record>
+bool open_followed_file(FollowedFile<Record>& f, const std::string& filename) {
+    f.file.open(filename.c_str(), std::ios::binary);
+    if (!f.file.is_open()) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    f.buffer.clear();
+    f.buffer_pos = 0;
+    f.header_read = false;
+    f.rows = 0;
+    f.last_time_ms = -1;
+    return true;
+}
+
+// Parse the complete lines appended since the last poll, returns bytes read
+template <typename Record>
+size_t poll_followed_file(FollowedFile<Record>& f, ParseBuffers& buf,
+                          std::chrono::steady_clock::time_point now) {
+    f.buffer.erase(0, f.buffer_pos);
+    f.buffer_pos = 0;
+    size_t bytes = 0;
+    char chunk[65536];
+    for (;;) {
+        f.file.read(chunk, sizeof(chunk));
+        size_t n = (size_t)f.file.gcount();
+        f.file.clear();     // at the end of the file for now, not for good
+        if (n == 0) break;
+        f.buffer.append(chunk, n);
+        bytes += n;
+    }
+    
+    Record record;
+    for (;;) {
+        size_t eol = f.buffer.find('\n', f.buffer_pos);
+        if (eol == std::string::npos) break;
+        std::string& line = buf.line;
+        line.assign(f.buffer, f.buffer_pos, eol - f.buffer_pos);
+        f.buffer_pos = eol + 1;
+        if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+        if (!f.header_read) {
+            f.header_read = true;
+            continue;
+        }
+        if (line.empty()) continue;
+        size_t field_count = split_csv_line(line, buf.fields);
+        if (!parse_row(buf.fields, field_count, record)) {
+            std::cerr << "Warning: skipped malformed row " << f.rows + 1 << std::endl;
+            continue;
+        }
+        if (!on_price_tick(row_price(record))) {
+            std::cerr << "Error: skipped row " << f.rows + 1 << ", price " << std::setprecision(10) << row_price(record)
+                      << " is not a multiple of the " << std::fixed << std::setprecision(price_decimals)
+                      << tick_to_price(1) << " tick" << std::endl;
+            continue;
+        }
+        f.pending.push_back(record);
+        f.arrivals.push_back(now);
+        f.last_time_ms = row_time_ms(record);
+        f.rows++;
+    }
+    return bytes;
+}
+
+// Set by SIGINT/SIGTERM to end follow mode after draining what was read
+volatile std::sig_atomic_t follow_stop = 0;
+
+void request_follow_stop(int) {
+    follow_stop = 1;
+}
+
+// Follow mode: keep the book resident while the capture process appends to
+// the order and trade files, and append snapshots as rows arrive. The files
+// are merged in time order: a row is released once the other file has reached
+// its time, since rows are appended in time order. With max_hold_ms > 0 a row
+// waiting longer than that for the other file is released anyway.
+int run_follow(const std::string& order_path, const std::string& trade_path, const std::string& output_file,
+               int poll_ms, int max_hold_ms, int idle_exit_ms, const ReplayOptions& opts) {
+    FollowedFile<Order> orders;
+    FollowedFile<Trade> trades;
+    if (!open_followed_file(orders, order_path) || !open_followed_file(trades, trade_path)) return 1;
+    
+    // Opened first so a bad name or path leaves the previous output untouched
+    ShmPublisher shm;
+    if (!open_shm_publisher(shm, opts.shm_name)) return 1;
+    std::ofstream feature_out;
+    if (!open_feature_stream(feature_out, opts, false)) {
+        close_shm_publisher(shm);
+        return 1;
+    }
+    
+    std::ofstream out(output_file.c_str(), std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Cannot create output file: " << output_file << std::endl;
+        close_shm_publisher(shm);
+        return 1;
+    }
+    write_snapshot_header(out, opts);
+    out.flush();
+    
+    OrderBook book;
+    init_orderbook(book);
+    book.track_auction = opts.auction;
+    book.track_features = opts.features || !opts.feature_stream.empty();
+    book.track_order_counts = opts.order_counts;
+    LookaheadWindow window;
+    init_window(window);
+    SessionState session;
+    init_session_state(session, opts.session);
+    LatencyStats stats;
+    
+    signal(SIGINT, request_follow_stop);
+    signal(SIGTERM, request_follow_stop);
+    if (verbose_log) std::cout << "Following " << order_path << " and " << trade_path << std::endl;
+    
+    ParseBuffers buf;
+    PendingEvent ev;
+    std::chrono::milliseconds max_hold(max_hold_ms);
+    std::chrono::steady_clock::time_point last_data = std::chrono::steady_clock::now();
+    for (;;) {
+        bool stopping = follow_stop != 0;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        size_t bytes = poll_followed_file(orders, buf, now) + poll_followed_file(trades, buf, now);
+        if (bytes > 0) last_data = now;
+        if (idle_exit_ms > 0 && now - last_data >= std::chrono::milliseconds(idle_exit_ms)) stopping = true;
+        
+        // Merge: orders go first on equal times, like build_events
+        for (;;) {
+            bool take_order;
+            if (!orders.pending.empty() && !trades.pending.empty()) {
+                take_order = orders.pending.front().time_ms <= trades.pending.front().time_ms;
+            } else if (!orders.pending.empty()) {
+                take_order = true;
+                if (!stopping && trades.last_time_ms < orders.pending.front().time_ms &&
+                    (max_hold_ms <= 0 || now - orders.arrivals.front() < max_hold)) break;
+            } else if (!trades.pending.empty()) {
+                take_order = false;
+                if (!stopping && orders.last_time_ms <= trades.pending.front().time_ms &&
+                    (max_hold_ms <= 0 || now - trades.arrivals.front() < max_hold)) break;
+            } else {
+                break;
+            }
+            if (take_order) {
+                window_push_order(window, orders.pending.front(), orders.arrivals.front());
+                orders.pending.pop_front();
+                orders.arrivals.pop_front();
+            } else {
+                window_push_trade(window, trades.pending.front(), trades.arrivals.front());
+                trades.pending.pop_front();
+                trades.arrivals.pop_front();
+            }
+        }
+        if (max_hold_ms > 0) window_expire_held(window, now, max_hold);
+        
+        while (window_pop(window, ev, stopping)) {
+            apply_pending_event(book, ev, session);
+            publish_snapshots(book, out, shm, opts, ev.arrival, stats);
+            if (feature_out.is_open()) {
+                write_feature_row(feature_out, book, ev);
+                feature_out.flush();
+            }
+        }
+        if (stopping) break;
+        if (bytes == 0) std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+    }
+    
+    close_shm_publisher(shm);
+    if (verbose_log) {
+        std::cout << "Follow ended: " << orders.rows << " orders, " << trades.rows << " trades";
+        if (!orders.buffer.empty() || !trades.buffer.empty()) std::cout << ", incomplete last line left unread";
+        std::cout << std::endl;
+        print_latency_stats(stats, std::cout);
+        if (opts.phase_stats) print_phase_stats(session, std::cout);
+    }
+    return 0;
+}
+
+// Stage table of --report, then peak memory and allocations
+void print_run_report(const RunReport& report, std::ostream& out) {
+    out << std::left << std::setw(24) << "stage" << std::right << std::setw(9) << "wall s"
+        << std::setw(9) << "cpu s" << std::setw(12) << "items" << std::setw(12) << "items/s"
+        << std::setw(10) << "MB" << std::setw(9) << "MB/s" << std::endl;
+    for (size_t i = 0; i < report.stages.size(); i++) {
+        const StageStats& s = report.stages[i];
+        double wall = s.wall_s > 0 ? s.wall_s : 1e-9;
+        out << std::left << std::setw(24) << s.name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(9) << s.wall_s;
+        if (s.cpu_s >= 0) out << std::setw(9) << s.cpu_s;
+        else out << std::setw(9) << "-";
+        out << std::setw(12) << s.items << std::setprecision(0) << std::setw(12) << s.items / wall;
+        if (s.bytes > 0) {
+            out << std::setprecision(1) << std::setw(10) << s.bytes / 1e6 << std::setw(9) << s.bytes / wall / 1e6;
+        }
+        out << std::endl;
+    }
+    long long count = 0;
+    long long bytes = 0;
+    sum_allocations(count, bytes);
+    out << "Peak RSS " << std::setprecision(1) << peak_rss_bytes() / 1e6 << " MB, "
+        << count << " allocations (" << bytes / 1e6 << " MB)" << std::endl;
+}
+
+// JSON run report: the stages in order, then process totals
+bool write_run_report(const RunReport& report, const std::string& path) {
+    std::ofstream out(path.c_str());
+    if (!out.is_open()) return false;
+    long long count = 0;
+    long long bytes = 0;
+    sum_allocations(count, bytes);
+    out << std::fixed << std::setprecision(6) << "{\n  \"stages\": [";
+    for (size_t i = 0; i < report.stages.size(); i++) {
+        const StageStats& s = report.stages[i];
+        size_t first = s.name.find_first_not_of(' ');
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << s.name.substr(first) << "\", \"wall_s\": " << s.wall_s
+            << ", \"cpu_s\": ";
+        if (s.cpu_s >= 0) out << s.cpu_s;
+        else out << "null";
+        out << ", \"items\": " << s.items << ", \"bytes\": " << s.bytes << "}";
+    }
+    out << "\n  ],\n"
+        << "  \"wall_s\": " << seconds_since(report.start) << ",\n"
+        << "  \"cpu_s\": " << process_cpu_seconds() - report.start_cpu_s << ",\n"
+        << "  \"peak_rss_bytes\": " << peak_rss_bytes() << ",\n"
+        << "  \"allocations\": " << count << ",\n"
+        << "  \"allocated_bytes\": " << bytes << "\n}\n";
+    return out.good();
+}
+
+// Decode a --compress output to stdout with the book_reader.h reader
+int run_decompress(const std::string& path) {
+    ObzReader reader;
+    if (!obz_reader_open(reader, path.c_str())) {
+        std::cerr << "Not a compressed output: " << path << std::endl;
+        return 1;
+    }
+    std::vector<char> buf(1 << 16);
+    size_t n;
+    while ((n = obz_reader_read(reader, &buf[0], buf.size())) > 0) {
+        std::cout.write(&buf[0], n);
+    }
+    std::cout.flush();
+    if (!obz_reader_close(reader)) {
+        std::cerr << "Damaged compressed output: " << path << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Print the snapshot currently published in shared memory, a book_reader.h example
+int run_shm_read(const std::string& name) {
+#ifdef _WIN32
+    std::cerr << "Shared-memory publication is not supported on this platform" << std::endl;
+    return 1;
+#else
+    BookReader reader;
+    if (!book_reader_open(reader, name.c_str())) {
+        std::cerr << "No published book in shared memory " << name << std::endl;
+        return 1;
+    }
+    ShmBookSnapshot snap;
+    uint64_t published = 0;
+    bool ok = book_reader_read(reader, snap, &published);
+    book_reader_close(reader);
+    if (!ok) {
+        std::cout << "Nothing published yet" << std::endl;
+        return 0;
+    }
+    
+    std::cout << "snapshot " << published << " at " << snap.transacttime
+              << ": cvl " << snap.cvl << ", lpr " << std::fixed << std::setprecision(price_decimals) << snap.lpr
+              << ", nts " << snap.nts << std::endl;
+    for (int i = 0; i < SHM_BOOK_DEPTH; i++) {
+        if (i < snap.num_bids) std::cout << std::setw(10) << snap.bids[i].qty << " @ " << snap.bids[i].price;
+        else std::cout << std::setw(21) << "";
+        if (i < snap.num_asks) std::cout << "  |  " << snap.asks[i].price << " x " << snap.asks[i].qty;
+        std::cout << std::endl;
+    }
+    return 0;
+#endif
+}
+
+// Write the merged order/trade stream in live message format, stands in for a feed handler
+int run_emit_feed(const std::string& order_path, const std::string& trade_path) {
+    OrderColumns orders;
+    TradeColumns trades;
+    std::vector<Event> events;
+    verbose_log = false;
+    if (!read_order_file(order_path, orders) || !read_trade_file(trade_path, trades)) return 1;
+    build_events(orders, trades, events);
+    
+    std::ostream& out = std::cout;
+    out << std::setprecision(10);
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].is_order) {
+            Order o = orders.get(events[i].index);
+            out << "O," << o.clockatarrival << "," << o.sequenceno << "," << o.transacttime
+                << "," << o.applseqnum << "," << o.side << "," << o.ordertype
+                << "," << o.price << "," << o.orderqty << "\n";
+        } else {
+            Trade t = trades.get(events[i].index);
+            out << "T," << t.clockatarrival << "," << t.sequenceno << "," << t.transacttime
+                << "," << t.applseqnum << "," << t.exectype << "," << t.tradeprice
+                << "," << t.tradeqty << "," << t.trademoney << "," << t.bidapplseqnum
+                << "," << t.offerapplseqnum << "\n";
+        }
+    }
+    out << "E" << std::endl;
+    return 0;
+}
+
+// Resting order inside the matching engine
+struct MatchOrder {
+    int applseqnum;
+    int side;               // 1=buy, 2=sell
+    long long tick;
+    int qty;
+    int prev;               // neighbours in the level queue, -1 at the ends
+    int next;
+};
+
+// Orders resting at one price, oldest first
+struct MatchLevel {
+    int head;
+    int tail;
+    long long qty;
+};
+
+// Price-time priority matching engine fed by the order stream
+struct MatchingEngine {
+    std::vector<MatchOrder> pool;
+    std::vector<int> free_slots;
+    std::map<long long, MatchLevel> bids;      // tick -> queue
+    std::map<long long, MatchLevel> asks;
+    std::unordered_map<int, int> slot_of;      // applseqnum -> pool slot
+    std::vector<Trade> fills;
+    std::vector<Order> held;                   // taken during the pause, submitted when it ends
+    int next_trade_seq;
+    SessionPhase phase;
+    long long num_rejected;
+};
+
+void init_matching_engine(MatchingEngine& engine) {
+    engine.pool.clear();
+    engine.free_slots.clear();
+    engine.bids.clear();
+    engine.asks.clear();
+    engine.slot_of.clear();
+    engine.fills.clear();
+    engine.held.clear();
+    engine.next_trade_seq = 1;
+    engine.phase = PHASE_PRE_OPEN;
+    engine.num_rejected = 0;
+}
+
+// Append a resting order to the back of its level
+void rest_order(MatchingEngine& engine, int applseqnum, int side, long long tick, int qty) {
+    int slot;
+    if (!engine.free_slots.empty()) {
+        slot = engine.free_slots.back();
+        engine.free_slots.pop_back();
+    } else {
+        slot = (int)engine.pool.size();
+        engine.pool.push_back(MatchOrder());
+    }
+    
+    std::map<long long, MatchLevel>& side_levels = side == 1 ? engine.bids : engine.asks;
+    std::map<long long, MatchLevel>::iterator level_it = side_levels.find(tick);
+    if (level_it == side_levels.end()) {
+        MatchLevel level;
+        level.head = -1;
+        level.tail = -1;
+        level.qty = 0;
+        level_it = side_levels.insert(std::make_pair(tick, level)).first;
+    }
+    MatchLevel& level = level_it->second;
+    
+    MatchOrder& order = engine.pool[slot];
+    order.applseqnum = applseqnum;
+    order.side = side;
+    order.tick = tick;
+    order.qty = qty;
+    order.prev = level.tail;
+    order.next = -1;
+    
+    if (level.tail >= 0) {
+        engine.pool[level.tail].next = slot;
+    } else {
+        level.head = slot;
+    }
+    level.tail = slot;
+    level.qty += qty;
+    engine.slot_of[applseqnum] = slot;
+}
+
+// Unlink a resting order, dropping its level once empty
+void unlink_order(MatchingEngine& engine, int slot) {
+    MatchOrder& order = engine.pool[slot];
+    std::map<long long, MatchLevel>& side_levels = order.side == 1 ? engine.bids : engine.asks;
+    std::map<long long, MatchLevel>::iterator level_it = side_levels.find(order.tick);
+    MatchLevel& level = level_it->second;
+    
+    if (order.prev >= 0) engine.pool[order.prev].next = order.next;
+    else level.head = order.next;
+    if (order.next >= 0) engine.pool[order.next].prev = order.prev;
+    else level.tail = order.prev;
+    
+    level.qty -= order.qty;
+    if (level.head < 0) side_levels.erase(level_it);
+    
+    engine.slot_of.erase(order.applseqnum);
+    engine.free_slots.push_back(slot);
+}
+
+// Record one fill between an incoming (or auction) bid and ask
+void emit_fill(MatchingEngine& engine, long long clockatarrival, long long time_ms,
+               long long tick, int qty, int bid_seq, int offer_seq) {
+    Trade fill;
+    fill.clockatarrival = clockatarrival;
+    fill.sequenceno = engine.next_trade_seq;
+    fill.transacttime = ms_to_hhmmssmmm(time_ms);
+    fill.time_ms = time_ms;
+    fill.applseqnum = engine.next_trade_seq;
+    fill.exectype = 'f';
+    fill.tradeprice = tick_to_price(tick);
+    fill.tradeqty = qty;
+    fill.trademoney = fill.tradeprice * qty;
+    fill.bidapplseqnum = bid_seq;
+    fill.offerapplseqnum = offer_seq;
+    engine.fills.push_back(fill);
+    engine.next_trade_seq++;
+}
+
+// Match an incoming order against the opposite side, returns the unfilled qty.
+// Market orders take any price, limit orders stop at limit_tick.
+int match_incoming(MatchingEngine& engine, const Order& order, long long limit_tick, bool is_market) {
+    std::map<long long, MatchLevel>& opposite = order.side == 1 ? engine.asks : engine.bids;
+    int remaining = order.orderqty;
+    
+    while (remaining > 0 && !opposite.empty()) {
+        std::map<long long, MatchLevel>::iterator level_it =
+            order.side == 1 ? opposite.begin() : --opposite.end();
+        long long tick = level_it->first;
+        if (!is_market && (order.side == 1 ? tick > limit_tick : tick < limit_tick)) break;
+        
+        // Fill against the queue head until the level or the order is used up
+        bool level_done = false;
+        while (remaining > 0 && !level_done) {
+            int slot = level_it->second.head;
+            MatchOrder& resting = engine.pool[slot];
+            int qty = std::min(remaining, resting.qty);
+            
+            if (order.side == 1) {
+                emit_fill(engine, order.clockatarrival, order.time_ms, tick, qty, order.applseqnum, resting.applseqnum);
+            } else {
+                emit_fill(engine, order.clockatarrival, order.time_ms, tick, qty, resting.applseqnum, order.applseqnum);
+            }
+            remaining -= qty;
+            
+            if (qty == resting.qty) {
+                level_done = level_it->second.head == level_it->second.tail;
+                unlink_order(engine, slot);
+            } else {
+                resting.qty -= qty;
+                level_it->second.qty -= qty;
+            }
+        }
+    }
+    return remaining;
+}
+
+// Uncross the book at the call-auction price, all fills at one price
+void uncross_auction(MatchingEngine& engine, long long time_ms) {
+    if (engine.bids.empty() || engine.asks.empty()) return;
+    if (engine.bids.rbegin()->first < engine.asks.begin()->first) return;
+    
+    AuctionLadder ladder;
+    init_auction_ladder(ladder);
+    std::map<long long, MatchLevel>::const_iterator it;
+    for (it = engine.bids.begin(); it != engine.bids.end(); ++it) {
+        auction_update(ladder, 1, tick_to_price(it->first), it->second.qty);
+    }
+    for (it = engine.asks.begin(); it != engine.asks.end(); ++it) {
+        auction_update(ladder, 2, tick_to_price(it->first), it->second.qty);
+    }
+    AuctionResult auction = compute_auction(ladder);
+    long long tick = price_to_tick(auction.price);
+    long long volume = auction.volume;
+    long long clockatarrival = ms_to_hhmmssmmm(time_ms);
+    
+    while (volume > 0 && !engine.bids.empty() && !engine.asks.empty()) {
+        MatchLevel& bid_level = engine.bids.rbegin()->second;
+        MatchLevel& ask_level = engine.asks.begin()->second;
+        if (engine.bids.rbegin()->first < tick || engine.asks.begin()->first > tick) break;
+        
+        int bid_slot = bid_level.head;
+        int ask_slot = ask_level.head;
+        MatchOrder& bid = engine.pool[bid_slot];
+        MatchOrder& ask = engine.pool[ask_slot];
+        int qty = (int)std::min((long long)std::min(bid.qty, ask.qty), volume);
+        
+        emit_fill(engine, clockatarrival, time_ms, tick, qty, bid.applseqnum, ask.applseqnum);
+        volume -= qty;
+        
+        bool bid_done = qty == bid.qty;
+        bool ask_done = qty == ask.qty;
+        if (!bid_done) {
+            bid.qty -= qty;
+            bid_level.qty -= qty;
+        }
+        if (!ask_done) {
+            ask.qty -= qty;
+            ask_level.qty -= qty;
+        }
+        if (bid_done) unlink_order(engine, bid_slot);
+        if (ask_done) unlink_order(engine, ask_slot);
+    }
+}
+
+// Continuous matching happens only in the two continuous sessions
+bool is_continuous_phase(SessionPhase phase) {
+    return phase == PHASE_CONTINUOUS_AM || phase == PHASE_CONTINUOUS_PM;
+}
+
+void engine_submit(MatchingEngine& engine, const Order& order);
+
+// Run the call auctions that end between the engine's phase and the next one.
+// The pause after the opening auction only freezes matching: its orders are
+// matched in arrival order when continuous trading opens.
+void advance_engine_phase(MatchingEngine& engine, SessionPhase next) {
+    if (engine.phase <= PHASE_OPENING_AUCTION && next > PHASE_OPENING_AUCTION) {
+        uncross_auction(engine, PHASE_INFO[PHASE_PAUSE].start_ms);
+    }
+    if (engine.phase == PHASE_PAUSE && next > PHASE_PAUSE) {
+        engine.phase = PHASE_CONTINUOUS_AM;
+        std::vector<Order> held;
+        held.swap(engine.held);
+        for (size_t i = 0; i < held.size(); i++) {
+            held[i].time_ms = PHASE_INFO[PHASE_CONTINUOUS_AM].start_ms;
+            held[i].clockatarrival = ms_to_hhmmssmmm(held[i].time_ms);
+            engine_submit(engine, held[i]);
+        }
+    }
+    if (engine.phase == PHASE_CLOSING_AUCTION && next > PHASE_CLOSING_AUCTION) {
+        uncross_auction(engine, PHASE_INFO[PHASE_CLOSED].start_ms);
+    }
+    engine.phase = next;
+}
+
+// Submit an order: limit '2', market '1' (remainder cancelled) or best own side 'u'
+void engine_submit(MatchingEngine& engine, const Order& order) {
+    advance_engine_phase(engine, get_session_phase(order.time_ms));
+    if (order.orderqty <= 0 || (order.side != 1 && order.side != 2)) {
+        engine.num_rejected++;
+        return;
+    }
+    if (engine.phase == PHASE_PAUSE) {
+        engine.held.push_back(order);
+        return;
+    }
+    
+    bool continuous = is_continuous_phase(engine.phase);
+    long long tick = price_to_tick(order.price);
+    
+    if (order.ordertype == '1') {
+        // Only limit orders take part in call auctions
+        if (!continuous) {
+            engine.num_rejected++;
+            return;
+        }
+        match_incoming(engine, order, 0, true);
+        return;
+    }
+    
+    if (order.ordertype == 'u') {
+        std::map<long long, MatchLevel>& own = order.side == 1 ? engine.bids : engine.asks;
+        if (!continuous || own.empty()) {
+            engine.num_rejected++;
+            return;
+        }
+        tick = order.side == 1 ? own.rbegin()->first : own.begin()->first;
+    }
+    
+    int remaining = continuous ? match_incoming(engine, order, tick, false) : order.orderqty;
+    if (remaining > 0) {
+        rest_order(engine, order.applseqnum, order.side, tick, remaining);
+    }
+}
+
+// Cancel a resting order named by a cancel record
+void engine_cancel(MatchingEngine& engine, const Trade& cancel) {
+    advance_engine_phase(engine, get_session_phase(cancel.time_ms));
+    int ids[2] = { cancel.bidapplseqnum, cancel.offerapplseqnum };
+    for (int i = 0; i < 2; i++) {
+        if (ids[i] == 0) continue;
+        std::unordered_map<int, int>::iterator it = engine.slot_of.find(ids[i]);
+        if (it != engine.slot_of.end()) {
+            unlink_order(engine, it->second);
+            continue;
+        }
+        for (size_t j = 0; j < engine.held.size(); j++) {
+            if (engine.held[j].applseqnum == ids[i]) {
+                engine.held.erase(engine.held.begin() + j);
+                break;
+            }
+        }
+    }
+}
+
+// Run the order stream and the exchange cancels through the engine. The result
+// holds the synthesised fills plus the cancels, ordered like a trade file.
+void run_matching_engine(const OrderColumns& orders, const TradeColumns& trades,
+                         std::vector<Event>& events, MatchingEngine& engine,
+                         std::vector<Trade>& result) {
+    init_matching_engine(engine);
+    build_events(orders, trades, events);
+    result.clear();
+    
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].is_order) {
+            engine_submit(engine, orders.get(events[i].index));
+        } else {
+            Trade trade = trades.get(events[i].index);
+            if (trade.exectype != '4') continue;
+            engine_cancel(engine, trade);
+            
+            // Keep the cancel in sequence with the fills generated so far
+            result.insert(result.end(), engine.fills.begin(), engine.fills.end());
+            engine.fills.clear();
+            result.push_back(trade);
+        }
+    }
+    advance_engine_phase(engine, PHASE_CLOSED);
+    result.insert(result.end(), engine.fills.begin(), engine.fills.end());
+    engine.fills.clear();
+}
+
+// Key of a fill for cross-checking: (bid applseqnum, offer applseqnum)
+long long fill_key(const Trade& trade) {
+    return ((long long)trade.bidapplseqnum << 32) | (unsigned int)trade.offerapplseqnum;
+}
+
+// Compare synthesised fills with the exchange fills, matched on the order pair
+void print_fill_crosscheck(const TradeColumns& exchange, const std::vector<Trade>& synthesised) {
+    std::unordered_map<long long, long long> expected;
+    long long exchange_fills = 0;
+    for (size_t i = 0; i < exchange.size(); i++) {
+        if (exchange.exectype[i] != 'f') continue;
+        expected[fill_key(exchange.get(i))] += exchange.tradeqty[i];
+        exchange_fills++;
+    }
+    
+    std::unordered_map<long long, long long> produced;
+    long long engine_fills = 0;
+    for (size_t i = 0; i < synthesised.size(); i++) {
+        if (synthesised[i].exectype != 'f') continue;
+        produced[fill_key(synthesised[i])] += synthesised[i].tradeqty;
+        engine_fills++;
+    }
+    
+    long long same = 0;
+    long long qty_differs = 0;
+    long long exchange_only = 0;
+    std::unordered_map<long long, long long>::const_iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it) {
+        std::unordered_map<long long, long long>::const_iterator p = produced.find(it->first);
+        if (p == produced.end()) exchange_only++;
+        else if (p->second == it->second) same++;
+        else qty_differs++;
+    }
+    long long engine_only = (long long)produced.size() - same - qty_differs;
+    
+    std::cout << "Cross-check against exchange fills (by bid/offer order pair):" << std::endl;
+    std::cout << "  exchange fills " << exchange_fills << " in " << expected.size() << " pairs, "
+              << "engine fills " << engine_fills << " in " << produced.size() << " pairs" << std::endl;
+    std::cout << "  same qty " << same << ", different qty " << qty_differs
+              << ", exchange only " << exchange_only << ", engine only " << engine_only << std::endl;
+}
+
+// Write trades in the trade_new.csv layout
+bool write_trade_file(const std::string& filename, const std::vector<Trade>& trades) {
+    std::ofstream out(filename.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Cannot create output file: " << filename << std::endl;
+        return false;
+    }
+    
+    out << "clockatarrival,sequenceno,transacttime,applseqnum,exectype,tradeprice,tradeqty,"
+        << "trademoney,bidapplseqnum,offerapplseqnum\n";
+    for (size_t i = 0; i < trades.size(); i++) {
+        const Trade& t = trades[i];
+        out << t.clockatarrival << "," << t.sequenceno << "," << t.transacttime << "," << t.applseqnum
+            << "," << t.exectype
+            << "," << std::fixed << std::setprecision(price_decimals) << t.tradeprice
+            << "," << t.tradeqty
+            << "," << std::fixed << std::setprecision(price_decimals) << t.trademoney
+            << "," << t.bidapplseqnum << "," << t.offerapplseqnum << "\n";
+    }
+    return true;
+}
+
+// Matching mode: synthesise fills from the order stream and write them with the
+// exchange cancels as a drop-in trade file
+int run_match(const std::string& order_path, const std::string& trade_path, const std::string& output_file) {
+    OrderColumns orders;
+    TradeColumns trades;
+    if (!read_order_file(order_path, orders) || !read_trade_file(trade_path, trades)) return 1;
+    if (orders.empty()) {
+        std::cerr << "Error: No orders loaded!" << std::endl;
+        return 1;
+    }
+    
+    MatchingEngine engine;
+    std::vector<Event> events;
+    std::vector<Trade> result;
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run_matching_engine(orders, trades, events, engine, result);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    long long num_fills = engine.next_trade_seq - 1;
+    if (secs <= 0) secs = 1e-9;
+    std::cout << "Matched " << orders.size() << " orders into " << num_fills << " fills ("
+              << engine.num_rejected << " orders rejected) in "
+              << std::fixed << std::setprecision(3) << secs << " s, "
+              << std::setprecision(0) << num_fills / secs << " fills/s" << std::endl;
+    
+    print_fill_crosscheck(trades, result);
+    
+    if (!write_trade_file(output_file, result)) return 1;
+    std::cout << "Synthesised trades saved to " << output_file << std::endl;
+    return 0;
+}
+
+struct Backtest;
+
+// Strategy interface; called after every market event and for every own fill
+struct Strategy {
+    virtual ~Strategy() {}
+    virtual void on_book(Backtest& bt, const OrderBook& book, SessionPhase phase) = 0;
+    virtual void on_fill(Backtest& bt, const SimFill& fill) = 0;
+};
+
+// Delay between a strategy decision and its arrival at the exchange
+struct LatencyModel {
+    long long submit_ms;
+    long long cancel_ms;
+};
+
+// Strategy request still on its way to the exchange
+struct SimAction {
+    bool is_cancel;
+    int order_id;
+};
+
+// Backtest of simulated orders against the replayed book
+struct Backtest {
+    OrderBook* book;
+    SimBook sim;
+    LatencyModel latency;
+    std::multimap<long long, SimAction> in_flight;    // exchange arrival time -> request
+    long long now_ms;
+    size_t fills_reported;
+    
+    // Account
+    long long position;
+    double cash;
+    long long bought;
+    long long sold;
+    long long num_rejected;
+    long long num_cancelled;
+};
+
+void init_backtest(Backtest& bt, OrderBook& book, const LatencyModel& latency) {
+    bt.book = &book;
+    init_sim_book(bt.sim);
+    book.sim = &bt.sim;
+    bt.latency = latency;
+    bt.in_flight.clear();
+    bt.now_ms = 0;
+    bt.fills_reported = 0;
+    bt.position = 0;
+    bt.cash = 0;
+    bt.bought = 0;
+    bt.sold = 0;
+    bt.num_rejected = 0;
+    bt.num_cancelled = 0;
+}
+
+// Send a limit order, returns its id
+int backtest_submit(Backtest& bt, int side, double price, int qty) {
+    SimOrder order;
+    order.id = (int)bt.sim.orders.size();
+    order.side = side;
+    order.tick = price_to_tick(price);
+    order.qty = qty;
+    order.leaves = qty;
+    order.ahead = 0;
+    order.placed_arrival = 0;
+    order.state = 'p';
+    bt.sim.orders.push_back(order);
+    
+    SimAction action;
+    action.is_cancel = false;
+    action.order_id = order.id;
+    bt.in_flight.insert(std::make_pair(bt.now_ms + bt.latency.submit_ms, action));
+    return order.id;
+}
+
+// Request a cancel; fills can still arrive until it reaches the exchange
+void backtest_cancel(Backtest& bt, int order_id) {
+    SimAction action;
+    action.is_cancel = true;
+    action.order_id = order_id;
+    bt.in_flight.insert(std::make_pair(bt.now_ms + bt.latency.cancel_ms, action));
+}
+
+// True while an order is in flight or resting
+bool backtest_is_open(const Backtest& bt, int order_id) {
+    if (order_id < 0) return false;
+    char state = bt.sim.orders[order_id].state;
+    return state == 'p' || state == 'l';
+}
+
+// Real qty resting at a tick on one side of the book. Level prices are
+// tick_to_price of their tick, so the lookup is exact.
+long long real_level_qty(const std::map<double, PriceLevel>& levels, long long tick) {
+    std::map<double, PriceLevel>::const_iterator it = levels.find(tick_to_price(tick));
+    return it != levels.end() ? it->second.qty : 0;
+}
+
+// A new order reaches the exchange: it takes crossing real liquidity, the rest
+// joins the back of its level. Taking does not remove the real orders, and
+// levels already crossed by the real book are left to the orders crossing them.
+void activate_submit(Backtest& bt, int order_id, long long time_ms) {
+    SimBook& sim = bt.sim;
+    SimOrder& order = sim.orders[order_id];
+    if (order.state != 'p') return;
+    if (!sim.matching) {
+        order.state = 'r';
+        bt.num_rejected++;
+        return;
+    }
+    
+    const OrderBook& book = *bt.book;
+    long long transacttime = ms_to_hhmmssmmm(time_ms);
+    if (order.side == 1) {
+        long long real_bid = price_to_tick(get_best_bid_price(book));
+        std::map<double, PriceLevel>::const_iterator it = book.ask_book.levels.begin();
+        for (; it != book.ask_book.levels.end() && sim.orders[order_id].leaves > 0; ++it) {
+            long long tick = price_to_tick(it->first);
+            if (tick > order.tick) break;
+            if (tick <= real_bid) continue;
+            int qty = std::min(sim.orders[order_id].leaves, it->second.qty);
+            sim_fill(sim, order_id, qty, tick, 'T', time_ms, transacttime);
+        }
+    } else {
+        long long real_ask = price_to_tick(get_best_ask_price(book));
+        std::map<double, PriceLevel>::const_reverse_iterator it = book.bid_book.levels.rbegin();
+        for (; it != book.bid_book.levels.rend() && sim.orders[order_id].leaves > 0; ++it) {
+            long long tick = price_to_tick(it->first);
+            if (tick < order.tick) break;
+            if (real_ask > 0 && tick >= real_ask) continue;
+            int qty = std::min(sim.orders[order_id].leaves, it->second.qty);
+            sim_fill(sim, order_id, qty, tick, 'T', time_ms, transacttime);
         }
     }
     
-    file.close();
-    std::cout << "Read " << orders.size() << " orders" << std::endl;
+    SimOrder& rest = sim.orders[order_id];
+    if (rest.leaves == 0) return;
+    rest.state = 'l';
+    rest.ahead = real_level_qty(rest.side == 1 ? book.bid_book.levels : book.ask_book.levels, rest.tick);
+    rest.placed_arrival = book.next_arrival;
+    (rest.side == 1 ? sim.bids : sim.asks)[rest.tick].push_back(order_id);
 }
 
-// Read trades
-void read_trade_file(const std::string& filename, std::vector<Trade>& trades) {
-    std::ifstream file(filename.c_str());
-    
-    if (!file.is_open()) {
-        std::cout << "Cannot open file: " << filename << std::endl;
+void activate_cancel(Backtest& bt, int order_id) {
+    SimBook& sim = bt.sim;
+    SimOrder& order = sim.orders[order_id];
+    if (order.state == 'l') {
+        std::map<long long, std::vector<int> >& levels = order.side == 1 ? sim.bids : sim.asks;
+        std::map<long long, std::vector<int> >::iterator level_it = levels.find(order.tick);
+        std::vector<int>& ids = level_it->second;
+        ids.erase(std::find(ids.begin(), ids.end(), order_id));
+        if (ids.empty()) levels.erase(level_it);
+    } else if (order.state != 'p') {
         return;
     }
+    order.state = 'c';
+    bt.num_cancelled++;
+}
+
+// Deliver every request that reaches the exchange by time_ms
+void deliver_requests(Backtest& bt, long long time_ms) {
+    while (!bt.in_flight.empty() && bt.in_flight.begin()->first <= time_ms) {
+        std::multimap<long long, SimAction>::iterator it = bt.in_flight.begin();
+        SimAction action = it->second;
+        long long arrival_ms = it->first;
+        bt.in_flight.erase(it);
+        if (action.is_cancel) {
+            activate_cancel(bt, action.order_id);
+        } else {
+            activate_submit(bt, action.order_id, arrival_ms);
+        }
+    }
+}
+
+// Book new fills into the account and pass them to the strategy
+void report_fills(Backtest& bt, Strategy& strategy) {
+    while (bt.fills_reported < bt.sim.fills.size()) {
+        SimFill fill = bt.sim.fills[bt.fills_reported++];
+        double value = tick_to_price(fill.tick) * fill.qty;
+        if (fill.side == 1) {
+            bt.position += fill.qty;
+            bt.bought += fill.qty;
+            bt.cash -= value;
+        } else {
+            bt.position -= fill.qty;
+            bt.sold += fill.qty;
+            bt.cash += value;
+        }
+        strategy.on_fill(bt, fill);
+    }
+}
+
+// Example strategy: quote qty at the best bid and ask during continuous trading,
+// within +-max_position
+struct JoinBestStrategy : public Strategy {
+    int qty;
+    int max_position;
+    int bid_id;
+    int ask_id;
     
-    std::string line;
-    std::getline(file, line);  // Skip header
-    std::cout << "Header: " << line << std::endl;
+    JoinBestStrategy(int quote_qty, int position_limit)
+        : qty(quote_qty), max_position(position_limit), bid_id(-1), ask_id(-1) {}
     
-    int line_num = 1;
-    while (std::getline(file, line)) {
-        line_num++;
-        if (line.empty()) continue;
-        
-        try {
-            std::vector<std::string> fields;
-            std::string field = "";
-            
-            for (size_t i = 0; i < line.length(); i++) {
-                char c = line[i];
-                if (c == ',' || c == '\r') {
-                    if (c == ',') {
-                        fields.push_back(field);
-                        field = "";
-                    }
-                } else {
-                    field += c;
-                }
-            }
-            fields.push_back(field);  // Last field
-            
-            if (fields.size() >= 10) {
-                Trade trade;
-                trade.clockatarrival = std::atoll(fields[0].c_str());
-                trade.sequenceno = std::atoi(fields[1].c_str());
-                trade.transacttime = std::atoll(fields[2].c_str());
-                trade.applseqnum = std::atoi(fields[3].c_str());
-                trade.exectype = fields[4][0];
-                trade.tradeprice = std::atof(fields[5].c_str());
-                trade.tradeqty = std::atoi(fields[6].c_str());
-                trade.trademoney = std::atof(fields[7].c_str());
-                trade.bidapplseqnum = std::atoi(fields[8].c_str());
-                trade.offerapplseqnum = std::atoi(fields[9].c_str());
-                
-                trades.push_back(trade);
+    // Keep one order at price on a side, or none when price is 0
+    void quote(Backtest& bt, int side, int& id, double price) {
+        bool open = backtest_is_open(bt, id);
+        if (open && price > 0 && bt.sim.orders[id].tick == price_to_tick(price)) return;
+        if (open) backtest_cancel(bt, id);
+        id = price > 0 ? backtest_submit(bt, side, price, qty) : -1;
+    }
+    
+    void on_book(Backtest& bt, const OrderBook& book, SessionPhase phase) {
+        bool active = is_continuous_phase(phase);
+        double bid = active && bt.position + qty <= max_position ? get_best_bid_price(book) : 0;
+        double ask = active && bt.position - qty >= -max_position ? get_best_ask_price(book) : 0;
+        quote(bt, 1, bid_id, bid);
+        quote(bt, 2, ask_id, ask);
+    }
+    
+    void on_fill(Backtest&, const SimFill&) {}
+};
+
+// Write the fill report
+bool write_fill_report(const std::string& filename, const Backtest& bt) {
+    std::ofstream out(filename.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Cannot create output file: " << filename << std::endl;
+        return false;
+    }
+    
+    out << "transacttime,order_id,side,price,qty,leaves,liquidity,position\n";
+    long long position = 0;
+    for (size_t i = 0; i < bt.sim.fills.size(); i++) {
+        const SimFill& fill = bt.sim.fills[i];
+        position += fill.side == 1 ? fill.qty : -fill.qty;
+        out << fill.transacttime << "," << fill.order_id << "," << fill.side
+            << "," << std::fixed << std::setprecision(price_decimals) << tick_to_price(fill.tick)
+            << "," << fill.qty << "," << fill.leaves << "," << fill.liquidity << "," << position << "\n";
+    }
+    return true;
+}
+
+// Backtest mode: replay the day with the strategy's simulated orders in the book
+int run_backtest(const std::string& order_path, const std::string& trade_path,
+                 const std::string& output_file, Strategy& strategy, const LatencyModel& latency) {
+    ReplayWorkspace ws;
+    if (!read_order_file(order_path, ws.orders, ws.parse) || !read_trade_file(trade_path, ws.trades, ws.parse)) {
+        return 1;
+    }
+    if (ws.orders.empty()) {
+        std::cerr << "Error: No orders loaded!" << std::endl;
+        return 1;
+    }
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    // Same event path as a replay, without snapshots
+    OrderBook& book = ws.book;
+    reset_orderbook(book);
+    SessionPolicy policy;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        policy.snapshot_orders[i] = false;
+        policy.snapshot_trades[i] = false;
+    }
+    init_session_state(ws.session, policy);
+    build_events(ws.orders, ws.trades, ws.events);
+    init_window(ws.window);
+    
+    Backtest bt;
+    init_backtest(bt, book, latency);
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    size_t num_events = 0;
+    
+    for (size_t i = 0; i <= ws.events.size(); i++) {
+        bool end_of_stream = i == ws.events.size();
+        if (!end_of_stream) {
+            if (ws.events[i].is_order) {
+                window_push_order(ws.window, ws.orders.get(ws.events[i].index), arrival);
             } else {
-                std::cout << "Warning: Line " << line_num << " has only " << fields.size() << " fields" << std::endl;
+                window_push_trade(ws.window, ws.trades.get(ws.events[i].index), arrival);
             }
-        } catch (const std::exception& e) {
-            std::cout << "Error parsing line " << line_num << ": " << e.what() << std::endl;
-            std::cout << "Line content: " << line << std::endl;
+        }
+        while (window_pop(ws.window, ev, end_of_stream)) {
+            long long time_ms = ev.is_order ? ev.order.time_ms : ev.trade.time_ms;
+            bt.sim.matching = is_continuous_phase(get_session_phase(time_ms));
+            deliver_requests(bt, time_ms);
+            bt.now_ms = time_ms;
+            apply_pending_event(book, ev, ws.session);
+            report_fills(bt, strategy);
+            strategy.on_book(bt, book, ws.session.phase);
+            num_events++;
         }
     }
     
-    file.close();
-    std::cout << "Read " << trades.size() << " trades" << std::endl;
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (secs <= 0) secs = 1e-9;
+    
+    std::cout << "Backtest: " << num_events << " events in " << std::fixed << std::setprecision(3) << secs
+              << " s (" << std::setprecision(0) << num_events / secs << " events/s)" << std::endl;
+    std::cout << "  orders " << bt.sim.orders.size() << ", rejected " << bt.num_rejected
+              << ", cancelled " << bt.num_cancelled << ", fills " << bt.sim.fills.size() << std::endl;
+    std::cout << "  bought " << bt.bought << ", sold " << bt.sold << ", position " << bt.position
+              << ", cash " << std::setprecision(price_decimals) << bt.cash
+              << ", pnl at last price " << bt.cash + bt.position * book.last_price << std::endl;
+    
+    book.sim = NULL;
+    if (!write_fill_report(output_file, bt)) return 1;
+    std::cout << "Fill report saved to " << output_file << std::endl;
+    return 0;
 }
 
-// Comparison function for sorting events
-bool compare_events(const Event& a, const Event& b) {
-    if (a.time != b.time) return a.time < b.time;
-    return a.type == "order" && b.type == "trade";
+// Replay events from next_event until the first event after time_ms, returns
+// how many events were applied
+size_t replay_until(OrderBook& book, SessionState& session, LookaheadWindow& window,
+                    const std::vector<Event>& events, const OrderColumns& orders,
+                    const TradeColumns& trades, size_t next_event, long long time_ms) {
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    size_t replayed = 0;
+    for (size_t i = next_event; i <= events.size(); i++) {
+        bool end_of_stream = i == events.size();
+        if (!end_of_stream) {
+            if (events[i].time > time_ms && window.pending.empty()) break;
+            if (events[i].is_order) {
+                window_push_order(window, orders.get(events[i].index), arrival);
+            } else {
+                window_push_trade(window, trades.get(events[i].index), arrival);
+            }
+        }
+        while (window_pop(window, ev, end_of_stream)) {
+            long long ev_time = ev.is_order ? ev.order.time_ms : ev.trade.time_ms;
+            if (ev_time > time_ms) return replayed;
+            apply_pending_event(book, ev, session);
+            replayed++;
+        }
+    }
+    return replayed;
 }
 
-// Process events
-void process_events(const std::vector<Order>& orders, 
-                   const std::vector<Trade>& trades,
-                   const std::string& output_file) {
+// Day of one symbol held in memory for as-of queries
+struct SymbolHistory {
+    OrderColumns orders;
+    TradeColumns trades;
+    std::vector<Event> events;
+    std::vector<CheckpointHeader> headers;
+    std::vector<std::string> checkpoints;   // checkpoint bodies in time order
+    std::vector<long long> checkpoint_times;    // time index: last event time covered by each checkpoint
+};
+
+// Depth of one symbol at a point in time
+struct BookQuery {
+    long long time_ms;
+    SessionPhase phase;
+    std::vector<std::pair<double, int> > bids;
+    std::vector<std::pair<double, int> > asks;
+    long long cvl;
+    double lpr;
+    int cto;
+    int nts;
+    double opx;
+    long long checkpoint_time;  // -1 when replayed from the start
+    size_t replayed;            // events replayed after the checkpoint
+};
+
+// In-process as-of query API over any number of symbols
+struct BookQueryService {
+    std::map<std::string, SymbolHistory> symbols;
+    bool auction;
+    bool features;          // checkpoints carry the cumulative order-flow imbalance
+    bool order_counts;
+    
+    // Scratch state for the query being answered
     OrderBook book;
-    init_orderbook(book);
+    SessionState session;
+    LookaheadWindow window;
+};
+
+void init_query_service(BookQueryService& service, const ReplayOptions& opts) {
+    service.symbols.clear();
+    service.auction = opts.auction;
+    service.features = opts.features;
+    service.order_counts = opts.order_counts;
+    init_orderbook(service.book);
+}
+
+// Query state without snapshots
+void reset_query_state(BookQueryService& service) {
+    reset_orderbook(service.book);
+    service.book.track_auction = service.auction;
+    service.book.track_features = service.features;
+    service.book.track_order_counts = service.order_counts;
+    SessionPolicy no_snapshots;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        no_snapshots.snapshot_orders[i] = false;
+        no_snapshots.snapshot_trades[i] = false;
+    }
+    init_session_state(service.session, no_snapshots);
+    init_window(service.window);
+}
+
+// Replay a symbol once, keeping a checkpoint every interval events in memory
+void build_checkpoints(BookQueryService& service, SymbolHistory& history, long long interval) {
+    capture_checkpoints(history.orders, history.trades, history.events, interval, service.auction, service.features,
+                        history.headers, history.checkpoints);
+    for (size_t i = 0; i < history.headers.size(); i++) {
+        history.checkpoint_times.push_back(history.headers[i].time_ms);
+    }
+}
+
+// Take over the checkpoints in a checkpoint file, false if it has none for this input
+bool load_checkpoint_file(SymbolHistory& history, const std::string& filename, bool features) {
+    std::vector<CheckpointEntry> entries;
+    scan_checkpoints(filename, entries);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const CheckpointHeader& h = entries[i].header;
+        if (!checkpoint_matches(h, history.orders.size(), history.trades.size(), features)) continue;
+        std::string body;
+        if (!read_checkpoint_body(filename, entries[i], body)) break;
+        history.headers.push_back(h);
+        history.checkpoints.push_back(body);
+        history.checkpoint_times.push_back(h.time_ms);
+    }
+    return !history.checkpoints.empty();
+}
+
+// Load a symbol's day. Checkpoints come from checkpoint_file when it has any,
+// otherwise they are built with one replay.
+bool add_symbol(BookQueryService& service, const std::string& symbol, const std::string& order_path,
+                const std::string& trade_path, const std::string& checkpoint_file, long long interval) {
+    SymbolHistory& history = service.symbols[symbol];
+    ParseBuffers parse;
+    if (!read_order_file(order_path, history.orders, parse) || !read_trade_file(trade_path, history.trades, parse)) {
+        service.symbols.erase(symbol);
+        return false;
+    }
+    if (history.orders.empty()) {
+        std::cerr << "Error: No orders loaded for " << symbol << std::endl;
+        service.symbols.erase(symbol);
+        return false;
+    }
+    build_events(history.orders, history.trades, history.events);
     
-    // Define opening time (9:30:00)
-    const long long OPENING_TIME = 93000000;
-    bool market_opened = false;
+    if (checkpoint_file.empty() || !load_checkpoint_file(history, checkpoint_file, service.features)) {
+        build_checkpoints(service, history, interval);
+    }
+    if (verbose_log) {
+        std::cout << "Loaded " << symbol << ": " << history.events.size() << " events, "
+                  << history.checkpoints.size() << " checkpoints" << std::endl;
+    }
+    return true;
+}
+
+// Book of a symbol after every event up to time_ms, top depth levels per side.
+// Restores the nearest checkpoint at or before the time and replays from there;
+// service.book holds the state afterwards.
+bool query_book(BookQueryService& service, const std::string& symbol, long long time_ms, int depth,
+                BookQuery& result) {
+    std::map<std::string, SymbolHistory>::const_iterator found = service.symbols.find(symbol);
+    if (found == service.symbols.end()) return false;
+    const SymbolHistory& history = found->second;
     
-    // Build a map of order applseqnum to immediate trades
-    std::map<int, bool> order_has_immediate_trade;
-    for (size_t i = 0; i < trades.size(); i++) {
-        if (trades[i].exectype == 'f') {
-            for (size_t j = 0; j < orders.size(); j++) {
-                if ((orders[j].applseqnum == trades[i].bidapplseqnum || 
-                     orders[j].applseqnum == trades[i].offerapplseqnum) &&
-                    abs(orders[j].transacttime - trades[i].transacttime) <= 1000) {
-                    order_has_immediate_trade[orders[j].applseqnum] = true;
-                }
-            }
+    reset_query_state(service);
+    result.checkpoint_time = -1;
+    size_t next_event = 0;
+    std::vector<long long>::const_iterator it =
+        std::upper_bound(history.checkpoint_times.begin(), history.checkpoint_times.end(), time_ms);
+    if (it != history.checkpoint_times.begin()) {
+        size_t idx = (it - history.checkpoint_times.begin()) - 1;
+        if (restore_checkpoint(history.checkpoints[idx], service.book, service.session, service.window)) {
+            next_event = (size_t)history.headers[idx].next_event;
+            result.checkpoint_time = history.checkpoint_times[idx];
+        } else {
+            reset_query_state(service);
         }
     }
     
-    std::vector<Event> events;
+    result.replayed = replay_until(service.book, service.session, service.window, history.events,
+                                   history.orders, history.trades, next_event, time_ms);
     
-    for (size_t i = 0; i < orders.size(); i++) {
-        Event e;
-        e.type = "order";
-        e.time = orders[i].transacttime;
-        e.index = i;
-        events.push_back(e);
+    const OrderBook& book = service.book;
+    result.time_ms = time_ms;
+    result.phase = get_session_phase(time_ms);
+    result.bids = get_top_bids(book, depth);
+    result.asks = get_top_asks(book, depth);
+    result.cvl = book.cumulative_volume;
+    result.lpr = book.last_price;
+    result.cto = book.cumulative_trade_orders;
+    result.nts = book.number_of_trades;
+    result.opx = book.opening_price;
+    return true;
+}
+
+// Text answer of the query server, one "book" line, "bid"/"ask" levels, "end"
+void write_book_query(std::ostream& out, const std::string& symbol, const BookQuery& q) {
+    out << "book," << symbol << "," << ms_to_hhmmssmmm(q.time_ms) << "," << PHASE_INFO[q.phase].name
+        << "," << q.cvl << "," << std::fixed << std::setprecision(price_decimals) << q.lpr
+        << "," << q.cto << "," << q.nts << "," << q.opx << "\n";
+    for (size_t i = 0; i < q.bids.size(); i++) {
+        out << "bid," << std::fixed << std::setprecision(price_decimals) << q.bids[i].first << "," << q.bids[i].second << "\n";
+    }
+    for (size_t i = 0; i < q.asks.size(); i++) {
+        out << "ask," << std::fixed << std::setprecision(price_decimals) << q.asks[i].first << "," << q.asks[i].second << "\n";
     }
+    out << "end\n";
+}
+
+// Answer one request line "SYMBOL HHMMSSmmm [DEPTH]"
+std::string answer_query_line(BookQueryService& service, const std::string& line) {
+    std::istringstream in(line);
+    std::string symbol;
+    long long time = -1;
+    int depth = 5;
+    in >> symbol >> time;
+    if (symbol.empty() || time < 0) return "error,expected SYMBOL HHMMSSmmm [DEPTH]\n";
+    in >> depth;
     
-    for (size_t i = 0; i < trades.size(); i++) {
-        Event e;
-        e.type = "trade";
-        e.time = trades[i].transacttime;
-        e.index = i;
-        events.push_back(e);
+    BookQuery q;
+    if (!query_book(service, symbol, hhmmssmmm_to_ms(time), depth, q)) {
+        return "error,unknown symbol " + symbol + "\n";
+    }
+    std::ostringstream out;
+    write_book_query(out, symbol, q);
+    return out.str();
+}
+
+// Read "symbol,orders.csv,trades.csv" lines into the service
+bool read_symbol_list(BookQueryService& service, const std::string& filename, long long interval) {
+    std::ifstream file(filename.c_str());
+    if (!file.is_open()) {
+        std::cerr << "Cannot open symbol list: " << filename << std::endl;
+        return false;
     }
     
-    std::sort(events.begin(), events.end(), compare_events);
+    std::string line;
+    std::vector<std::string> fields;
+    int line_num = 0;
+    while (std::getline(file, line)) {
+        line_num++;
+        if (line.empty() || line[0] == '#' || line == "\r") continue;
+        if (split_csv_line(line, fields) < 3) {
+            std::cerr << "Warning: Symbol list line " << line_num << " needs symbol,orders,trades" << std::endl;
+            continue;
+        }
+        add_symbol(service, fields[0], fields[1], fields[2], "", interval);
+    }
+    return true;
+}
+
+// Serve queries on tcp:PORT, one request line per answer, any number of clients
+int run_query_server(BookQueryService& service, const std::string& spec) {
+#ifdef _WIN32
+    std::cerr << "The query server is not supported on this platform" << std::endl;
+    return 1;
+#else
+    int listener = bind_local_socket(spec);
+    if (listener < 0) return 1;
+    listen(listener, 16);
+    signal(SIGPIPE, SIG_IGN);   // a client hanging up must not end the server
+    std::cout << "Serving as-of queries on " << spec << std::endl;
     
-    for (size_t i = 0; i < events.size(); i++) {
-        if (events[i].type == "order") {
-            const Order& order = orders[events[i].index];
-            
-            bool is_immediate_market_order = 
-                (order.ordertype == '1' || order.ordertype == 'u') && 
-                order_has_immediate_trade.count(order.applseqnum) > 0;
-            
-            if (order.transacttime < OPENING_TIME || !is_immediate_market_order) {
-                add_order(book, order);
+    std::vector<pollfd> fds;
+    std::vector<std::string> buffers;
+    pollfd listen_fd;
+    listen_fd.fd = listener;
+    listen_fd.events = POLLIN;
+    fds.push_back(listen_fd);
+    buffers.push_back("");
+    
+    char chunk[4096];
+    while (true) {
+        if (poll(&fds[0], fds.size(), -1) < 0) break;
+        
+        if (fds[0].revents & POLLIN) {
+            int client = accept(listener, NULL, NULL);
+            if (client >= 0) {
+                pollfd client_fd;
+                client_fd.fd = client;
+                client_fd.events = POLLIN;
+                client_fd.revents = 0;
+                fds.push_back(client_fd);
+                buffers.push_back("");
+            }
+        }
+        
+        for (size_t i = fds.size() - 1; i >= 1; i--) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds.erase(fds.begin() + i);
+                buffers.erase(buffers.begin() + i);
+                continue;
             }
+            buffers[i].append(chunk, n);
             
-            if (order.transacttime >= OPENING_TIME && !is_immediate_market_order) {
-                if (!market_opened) {
-                    std::cout << "Market opened! Taking first snapshot..." << std::endl;
-                    market_opened = true;
+            size_t start = 0;
+            size_t end;
+            while ((end = buffers[i].find('\n', start)) != std::string::npos) {
+                std::string line = buffers[i].substr(start, end - start);
+                if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+                start = end + 1;
+                std::string answer = answer_query_line(service, line);
+                for (size_t sent = 0; sent < answer.size();) {
+                    ssize_t w = write(fds[i].fd, answer.data() + sent, answer.size() - sent);
+                    if (w <= 0) break;
+                    sent += w;
                 }
-                take_snapshot(book, order.clockatarrival, order.transacttime);
             }
+            buffers[i].erase(0, start);
+        }
+    }
+    close(listener);
+    return 0;
+#endif
+}
+
+// As-of query from the command line, printed as one snapshot row
+int run_as_of(const std::string& order_path, const std::string& trade_path,
+              const std::string& checkpoint_file, long long time_ms, const ReplayOptions& opts) {
+    BookQueryService service;
+    init_query_service(service, opts);
+    if (!add_symbol(service, "default", order_path, trade_path, checkpoint_file, QUERY_CHECKPOINT_INTERVAL)) return 1;
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    BookQuery q;
+    query_book(service, "default", time_ms, 5, q);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    
+    if (q.checkpoint_time >= 0) {
+        std::cout << "Restored checkpoint at " << ms_to_hhmmssmmm(q.checkpoint_time) << ", ";
+    }
+    std::cout << "replayed " << q.replayed << " events in " << std::fixed << std::setprecision(2)
+              << ms << " ms" << std::endl;
+    
+    long long transacttime = ms_to_hhmmssmmm(time_ms);
+    take_event_snapshot(service.book, transacttime, transacttime, q.phase);
+    write_snapshot_header(std::cout, opts);
+    write_snapshot_row(std::cout, service.book.snapshots.back(), opts);
+    return 0;
+}
+
+// Widen [from_ms, to_ms] to the blocks that can hold applseqnums in [seq_from, seq_to]
+void add_seq_blocks(const InputIndex& index, long long seq_from, long long seq_to,
+                    long long& from_ms, long long& to_ms) {
+    for (size_t b = 0; b < index.blocks.size(); b++) {
+        const IndexBlock& block = index.blocks[b];
+        if (block.max_seq < seq_from || block.min_seq > seq_to) continue;
+        from_ms = std::min(from_ms, (long long)block.min_time_ms);
+        to_ms = std::max(to_ms, (long long)block.max_time_ms);
+    }
+}
+
+// Applseqnum and time window of a partial replay; -1 leaves a bound open
+struct ReplayRange {
+    long long from_ms;
+    long long to_ms;
+    long long seq_from;
+    long long seq_to;
+};
+
+bool in_range(const ReplayRange& range, const PendingEvent& ev) {
+    long long time_ms = ev.is_order ? ev.order.time_ms : ev.trade.time_ms;
+    int seq = ev.is_order ? ev.order.applseqnum : ev.trade.applseqnum;
+    return time_ms >= range.from_ms && time_ms <= range.to_ms &&
+           (range.seq_from < 0 || seq >= range.seq_from) && (range.seq_to < 0 || seq <= range.seq_to);
+}
+
+// Replay a time or applseqnum window. The sidecar indexes turn an applseqnum
+// range into a time range; the book starts from the last checkpoint in
+// <output>.ckpt before the window, and only the rows from there to the end of
+// the window (plus the immediate-trade look-ahead) are parsed.
+int run_window(const std::string& order_path, const std::string& trade_path, const std::string& output_file,
+               ReplayRange range, const ReplayOptions& opts) {
+    InputIndex order_index;
+    InputIndex trade_index;
+    if (!load_input_index<Order>(order_path, order_index) || !load_input_index<Trade>(trade_path, trade_index)) {
+        return 1;
+    }
+    
+    if (range.seq_from >= 0 || range.seq_to >= 0) {
+        long long seq_from = std::max(range.seq_from, 0LL);
+        long long seq_to = range.seq_to < 0 ? LLONG_MAX : range.seq_to;
+        long long from_ms = LLONG_MAX;
+        long long to_ms = -1;
+        add_seq_blocks(order_index, seq_from, seq_to, from_ms, to_ms);
+        add_seq_blocks(trade_index, seq_from, seq_to, from_ms, to_ms);
+        if (to_ms < 0) {
+            std::cerr << "No input rows in applseqnum range " << seq_from << "-" << seq_to << std::endl;
+            return 1;
+        }
+        range.from_ms = std::max(range.from_ms, from_ms);
+        range.to_ms = range.to_ms < 0 ? to_ms : std::min(range.to_ms, to_ms);
+    }
+    if (range.from_ms < 0) range.from_ms = 0;
+    if (range.to_ms < 0) range.to_ms = INT_MAX;
+    
+    bool features = opts.features || !opts.feature_stream.empty();
+    OrderBook book;
+    init_orderbook(book);
+    book.track_auction = opts.auction;
+    book.track_features = features;
+    book.track_order_counts = opts.order_counts;
+    SessionState session;
+    init_session_state(session, opts.session);
+    LookaheadWindow window;
+    init_window(window);
+    
+    // Seeking needs time-sorted files: the rows already applied are then a prefix of each
+    long long order_row = 0;
+    long long trade_row = 0;
+    long long checkpoint_time = -1;
+    if (order_index.time_sorted && trade_index.time_sorted) {
+        std::string checkpoint_file = output_file + ".ckpt";
+        std::vector<CheckpointEntry> entries;
+        scan_checkpoints(checkpoint_file, entries);
+        int found = find_checkpoint(entries, order_index.num_rows, trade_index.num_rows, features,
+                                    range.from_ms - 1);
+        if (found >= 0 && load_checkpoint(checkpoint_file, entries[found], book, session, window)) {
+            order_row = entries[found].header.next_order_row;
+            trade_row = entries[found].header.next_trade_row;
+            checkpoint_time = entries[found].header.time_ms;
         } else {
-            const Trade& trade = trades[events[i].index];
-            execute_trade(book, trade);
-            take_snapshot(book, trade.clockatarrival, trade.transacttime);
+            init_orderbook(book);
+            book.track_auction = opts.auction;
+            book.track_features = features;
+            book.track_order_counts = opts.order_counts;
+            init_session_state(session, opts.session);
+            init_window(window);
         }
     }
     
-    std::ofstream out(output_file.c_str());
+    OrderColumns orders;
+    TradeColumns trades;
+    long long read_until = range.to_ms + IMMEDIATE_TRADE_WINDOW;
+    bool orders_done = read_rows<Order>(order_path, order_index, order_row, read_until, orders);
+    bool trades_done = read_rows<Trade>(trade_path, trade_index, trade_row, read_until, trades);
+    std::vector<Event> events;
+    build_events(orders, trades, events);
+    
+    std::ofstream feature_out;
+    if (!open_feature_stream(feature_out, opts, false)) return 1;
+    std::ofstream out(output_file.c_str(), std::ios::trunc);
     if (!out.is_open()) {
         std::cerr << "Cannot create output file: " << output_file << std::endl;
-        return;
+        return 1;
     }
+    write_snapshot_header(out, opts);
     
-    out << "clockatarrival,transacttime,"
-        << "best_bid_1_price,best_bid_1_qty,best_bid_2_price,best_bid_2_qty,"
-        << "best_bid_3_price,best_bid_3_qty,best_bid_4_price,best_bid_4_qty,"
-        << "best_bid_5_price,best_bid_5_qty,"
-        << "best_ask_1_price,best_ask_1_qty,best_ask_2_price,best_ask_2_qty,"
-        << "best_ask_3_price,best_ask_3_qty,best_ask_4_price,best_ask_4_qty,"
-        << "best_ask_5_price,best_ask_5_qty,"
-        << "worst_bid_1_price,worst_bid_1_qty,worst_bid_2_price,worst_bid_2_qty,"
-        << "worst_bid_3_price,worst_bid_3_qty,worst_bid_4_price,worst_bid_4_qty,"
-        << "worst_bid_5_price,worst_bid_5_qty,"
-        << "worst_ask_1_price,worst_ask_1_qty,worst_ask_2_price,worst_ask_2_qty,"
-        << "worst_ask_3_price,worst_ask_3_qty,worst_ask_4_price,worst_ask_4_qty,"
-        << "worst_ask_5_price,worst_ask_5_qty,"
-        << "cvl,lpr,cto,nts,opx\n";
-    
-    for (size_t snap_idx = 0; snap_idx < book.snapshots.size(); snap_idx++) {
-        const BookSnapshot& snapshot = book.snapshots[snap_idx];
-        out << snapshot.clockatarrival << "," << snapshot.transacttime;
-        
-        for (int i = 0; i < 5; i++) {
-            if (i < (int)snapshot.best_bids.size()) {
-                out << "," << std::fixed << std::setprecision(2) 
-                    << snapshot.best_bids[i].first << "," << snapshot.best_bids[i].second;
-            } else {
-                out << ",,";
-            }
-        }
-        
-        for (int i = 0; i < 5; i++) {
-            if (i < (int)snapshot.best_asks.size()) {
-                out << "," << std::fixed << std::setprecision(2)
-                    << snapshot.best_asks[i].first << "," << snapshot.best_asks[i].second;
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+    PendingEvent ev;
+    long long snapshots = 0;
+    bool past_window = false;
+    for (size_t i = 0; i <= events.size() && !past_window; i++) {
+        bool end_of_stream = i == events.size() && orders_done && trades_done;
+        if (i < events.size()) {
+            if (events[i].is_order) {
+                window_push_order(window, orders.get(events[i].index), arrival);
             } else {
-                out << ",,";
+                window_push_trade(window, trades.get(events[i].index), arrival);
             }
         }
-        
-        for (int i = 0; i < 5; i++) {
-            if (i < (int)snapshot.worst_bids.size()) {
-                out << "," << std::fixed << std::setprecision(2)
-                    << snapshot.worst_bids[i].first << "," << snapshot.worst_bids[i].second;
-            } else {
-                out << ",,";
+        while (window_pop(window, ev, end_of_stream)) {
+            if ((ev.is_order ? ev.order.time_ms : ev.trade.time_ms) > range.to_ms) {
+                past_window = true;
+                break;
             }
-        }
-        
-        for (int i = 0; i < 5; i++) {
-            if (i < (int)snapshot.worst_asks.size()) {
-                out << "," << std::fixed << std::setprecision(2)
-                    << snapshot.worst_asks[i].first << "," << snapshot.worst_asks[i].second;
-            } else {
-                out << ",,";
+            if (apply_pending_event(book, ev, session) && in_range(range, ev)) {
+                write_snapshot_row(out, book.snapshots.back(), opts);
+                snapshots++;
             }
+            if (feature_out.is_open() && in_range(range, ev)) write_feature_row(feature_out, book, ev);
+            book.snapshots.clear();
         }
-        
-        out << "," << snapshot.cvl
-            << "," << std::fixed << std::setprecision(2) << snapshot.lpr
-            << "," << snapshot.cto
-            << "," << snapshot.nts
-            << "," << std::fixed << std::setprecision(2) << snapshot.opx;
-        
-        out << "\n";
     }
     
-    out.close();
-    std::cout << "Order book snapshots saved to " << output_file << std::endl;
-    std::cout << "Total snapshots: " << book.snapshots.size() << std::endl;
+    if (verbose_log) {
+        if (checkpoint_time >= 0) std::cout << "Started from checkpoint at " << ms_to_hhmmssmmm(checkpoint_time) << ", ";
+        std::cout << "parsed " << orders.size() << " of " << order_index.num_rows << " orders and "
+                  << trades.size() << " of " << trade_index.num_rows << " trades" << std::endl;
+        std::cout << "Window " << ms_to_hhmmssmmm(range.from_ms) << "-";
+        if (range.to_ms < INT_MAX) std::cout << ms_to_hhmmssmmm(range.to_ms);
+        std::cout << ": " << snapshots << " snapshots saved to " << output_file << std::endl;
+    }
+    return 0;
+}
+
+void print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [--orders FILE --trades FILE] [--output FILE]\n"
+              << "           replay order_new.csv/trade_new.csv (searched for if not given)\n"
+              << "       " << prog << " --match [--orders FILE --trades FILE] [--output FILE]\n"
+              << "           synthesise fills from the order stream, cross-check them and write trade_match.csv\n"
+              << "       " << prog << " --backtest [--orders FILE --trades FILE] [--output FILE]\n"
+              << "                 [--quote-qty N] [--max-position N] [--latency-ms N]\n"
+              << "           quote the best bid/ask with simulated orders and write fills_backtest.csv\n"
+              << "       " << prog << " --batch MANIFEST [--workers N]\n"
+              << "           MANIFEST lines: orders.csv,trades.csv,output.csv\n"
+              << "       " << prog << " --follow [--orders FILE --trades FILE] [--output FILE] [--poll-ms N]\n"
+              << "                 [--max-hold-ms N] [--idle-exit-ms N]\n"
+              << "           keep replaying as rows are appended to the files, until SIGINT/SIGTERM\n"
+              << "           or N ms without new rows\n"
+              << "       " << prog << " --live SOURCE [--output FILE] [--max-hold-ms N]\n"
+              << "           SOURCE: - (stdin), FILE or FIFO, tcp:PORT, udp:PORT; FILE - writes to stdout\n"
+              << "       " << prog << " --emit-feed ORDERS TRADES   write the live message stream to stdout\n"
+              << "       " << prog << " --shm-read NAME   print the book published with --shm NAME\n"
+              << "       " << prog << " --decompress FILE   write a --compress output to stdout\n"
+              << "       " << prog << " --serve tcp:PORT [--symbols LIST | --orders FILE --trades FILE]\n"
+              << "           answer \"SYMBOL HHMMSSmmm [DEPTH]\" lines with the book at that time;\n"
+              << "           LIST lines: symbol,orders.csv,trades.csv (otherwise the one day is symbol \"default\")\n"
+              << "Replay options:\n"
+              << "  --snapshot-phases LIST   snapshot only in these phases (preopen,auction,pause,am,lunch,pm,close,closed)\n"
+              << "  --continuous-only        same as --snapshot-phases am,pm\n"
+              << "  --phase-stats            print order/fill/cancel/volume/snapshot counts per session phase\n"
+              << "  --auction                add indicative auction price/volume/imbalance (iap,iav,iai) in call-auction phases\n"
+              << "  --tick T                 minimum price increment (default: 0.01), 1/N of a unit, e.g. 0.001\n"
+              << "  --checkpoint-every N     append a binary checkpoint to OUTPUT.ckpt every N events\n"
+              << "  --resume                 continue an interrupted replay from its last checkpoint\n"
+              << "  --shm NAME               publish every snapshot to POSIX shared memory NAME (e.g. /obr_book)\n"
+              << "  --check-book             count crossed snapshots and level/quantity mismatches during the replay\n"
+              << "  --features               add mid,spread,imb,micro,wmid,ofi columns to the snapshots\n"
+              << "  --feature-stream FILE    write the best levels and features after every event to FILE\n"
+              << "  --bars SPECS             build bars from the fills, e.g. 1s,1m,5m,v10000,t100\n"
+              << "  --bar-output FILE        bar file (default: <output>.bars.csv)\n"
+              << "  --mbp FILE               write a market-by-price incremental feed to FILE\n"
+              << "  --mbp-refresh N          full refresh every N feed messages (default: 10000, 0 for none)\n"
+              << "  --order-counts           add the number of orders at each best level to the snapshots\n"
+              << "  --lifecycle FILE         export every order's lifetime to FILE (CSV if it ends in .csv, else binary columns)\n"
+              << "  --from HHMMSSmmm, --to HHMMSSmmm\n"
+              << "                           replay only this time window (indexes the inputs in FILE.idx,\n"
+              << "                           starts from the last OUTPUT.ckpt checkpoint before it)\n"
+              << "  --seq-from N, --seq-to N replay only this applseqnum range, same way\n"
+              << "  --sync-output            write snapshots from the replay thread instead of a writer thread\n"
+              << "  --format-threads N       threads formatting snapshot rows (default: one per spare core, 0 = replay thread)\n"
+              << "  --direct-io              write snapshots with O_DIRECT, for outputs much larger than memory\n"
+              << "  --report FILE            print wall/CPU time, throughput and memory per stage, write them to FILE as JSON\n"
+              << "  --compress               compress the snapshot, bar and MBP outputs in blocks (read with\n"
+              << "                           book_reader.h or --decompress), delta code the binary lifecycles\n"
+              << "  --segments N             replay N time segments in parallel (starting from OUTPUT.ckpt if present),\n"
+              << "                           without sinks, --shm, --feature-stream or checkpointing\n"
+              << "  --as-of HHMMSSmmm        print the book at that time, starting from the checkpoint before it" << std::endl;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    std::string manifest_path;
+    int num_workers = 0;
+    std::string live_source;
+    std::string order_path;
+    std::string trade_path;
+    std::string output_path;
+    bool match_mode = false;
+    bool backtest_mode = false;
+    long long as_of = -1;
+    std::string serve_spec;
+    std::string shm_read;
+    std::string decompress_path;
+    std::string report_path;
+    std::string symbol_list;
+    int quote_qty = 100;
+    int max_position = 1000;
+    LatencyModel latency;
+    latency.submit_ms = 0;
+    latency.cancel_ms = 0;
+    int max_hold_ms = 0;
+    bool follow_mode = false;
+    int poll_ms = 200;
+    int idle_exit_ms = 0;
+    int num_segments = 0;
+    bool check_book = false;
+    std::string bar_list;
+    std::string bar_path;
+    std::string mbp_path;
+    long long mbp_refresh = 10000;
+    std::string lifecycle_path;
+    ReplayRange range;
+    range.from_ms = -1;
+    range.to_ms = -1;
+    range.seq_from = -1;
+    range.seq_to = -1;
+    ReplayOptions opts;
+    init_replay_options(opts);
+    std::string feed_orders;
+    std::string feed_trades;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            manifest_path = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            num_workers = std::atoi(argv[++i]);
+        } else if (arg == "--features") {
+            opts.features = true;
+        } else if (arg == "--feature-stream" && i + 1 < argc) {
+            opts.feature_stream = argv[++i];
+        } else if (arg == "--bars" && i + 1 < argc) {
+            bar_list = argv[++i];
+        } else if (arg == "--bar-output" && i + 1 < argc) {
+            bar_path = argv[++i];
+        } else if (arg == "--mbp" && i + 1 < argc) {
+            mbp_path = argv[++i];
+        } else if (arg == "--mbp-refresh" && i + 1 < argc) {
+            mbp_refresh = std::atoll(argv[++i]);
+        } else if (arg == "--order-counts") {
+            opts.order_counts = true;
+        } else if (arg == "--lifecycle" && i + 1 < argc) {
+            lifecycle_path = argv[++i];
+        } else if (arg == "--from" && i + 1 < argc) {
+            range.from_ms = hhmmssmmm_to_ms(std::atoll(argv[++i]));
+        } else if (arg == "--to" && i + 1 < argc) {
+            range.to_ms = hhmmssmmm_to_ms(std::atoll(argv[++i]));
+        } else if (arg == "--seq-from" && i + 1 < argc) {
+            range.seq_from = std::atoll(argv[++i]);
+        } else if (arg == "--seq-to" && i + 1 < argc) {
+            range.seq_to = std::atoll(argv[++i]);
+        } else if (arg == "--sync-output") {
+            opts.async_output = false;
+        } else if (arg == "--format-threads" && i + 1 < argc) {
+            opts.format_threads = std::atoi(argv[++i]);
+        } else if (arg == "--report" && i + 1 < argc) {
+            report_path = argv[++i];
+        } else if (arg == "--compress") {
+            opts.compress = true;
+        } else if (arg == "--decompress" && i + 1 < argc) {
+            decompress_path = argv[++i];
+        } else if (arg == "--direct-io") {
+            opts.direct_io = true;
+        } else if (arg == "--check-book") {
+            check_book = true;
+        } else if (arg == "--segments" && i + 1 < argc) {
+            num_segments = std::atoi(argv[++i]);
+        } else if (arg == "--follow") {
+            follow_mode = true;
+        } else if (arg == "--poll-ms" && i + 1 < argc) {
+            poll_ms = std::atoi(argv[++i]);
+        } else if (arg == "--idle-exit-ms" && i + 1 < argc) {
+            idle_exit_ms = std::atoi(argv[++i]);
+        } else if (arg == "--live" && i + 1 < argc) {
+            live_source = argv[++i];
+        } else if (arg == "--orders" && i + 1 < argc) {
+            order_path = argv[++i];
+        } else if (arg == "--trades" && i + 1 < argc) {
+            trade_path = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--match") {
+            match_mode = true;
+        } else if (arg == "--backtest") {
+            backtest_mode = true;
+        } else if (arg == "--quote-qty" && i + 1 < argc) {
+            quote_qty = std::atoi(argv[++i]);
+        } else if (arg == "--max-position" && i + 1 < argc) {
+            max_position = std::atoi(argv[++i]);
+        } else if (arg == "--latency-ms" && i + 1 < argc) {
+            latency.submit_ms = std::atoi(argv[++i]);
+            latency.cancel_ms = latency.submit_ms;
+        } else if (arg == "--max-hold-ms" && i + 1 < argc) {
+            max_hold_ms = std::atoi(argv[++i]);
+        } else if (arg == "--tick" && i + 1 < argc) {
+            if (!set_price_tick(argv[++i])) return 1;
+        } else if (arg == "--snapshot-phases" && i + 1 < argc) {
+            if (!set_snapshot_phases(opts.session, argv[++i])) return 1;
+        } else if (arg == "--continuous-only") {
+            set_snapshot_phases(opts.session, "am,pm");
+        } else if (arg == "--phase-stats") {
+            opts.phase_stats = true;
+        } else if (arg == "--auction") {
+            opts.auction = true;
+        } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            opts.checkpoint_every = std::atoll(argv[++i]);
+        } else if (arg == "--resume") {
+            opts.resume = true;
+        } else if (arg == "--shm" && i + 1 < argc) {
+            opts.shm_name = argv[++i];
+        } else if (arg == "--shm-read" && i + 1 < argc) {
+            shm_read = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serve_spec = argv[++i];
+        } else if (arg == "--symbols" && i + 1 < argc) {
+            symbol_list = argv[++i];
+        } else if (arg == "--as-of" && i + 1 < argc) {
+            as_of = hhmmssmmm_to_ms(std::atoll(argv[++i]));
+        } else if (arg == "--emit-feed" && i + 2 < argc) {
+            feed_orders = argv[++i];
+            feed_trades = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+    
+    // These modes may write data to stdout, so they skip the banner
+    if (!feed_orders.empty()) {
+        return run_emit_feed(feed_orders, feed_trades);
+    }
+    if (!shm_read.empty()) {
+        return run_shm_read(shm_read);
+    }
+    if (!decompress_path.empty()) {
+        return run_decompress(decompress_path);
+    }
+    if (!live_source.empty()) {
+        return run_live(live_source, output_path.empty() ? "book_live.csv" : output_path, max_hold_ms, opts);
+    }
+    
     std::cout << "========== Order Book Reconstruction ==========" << std::endl;
     
+    if (!manifest_path.empty()) {
+        // The batch workers already use the cores
+        if (opts.format_threads < 0) opts.format_threads = 0;
+        return run_batch(manifest_path, num_workers, opts);
+    }
+    if (!serve_spec.empty() && !symbol_list.empty()) {
+        BookQueryService service;
+        init_query_service(service, opts);
+        if (!read_symbol_list(service, symbol_list, QUERY_CHECKPOINT_INTERVAL)) return 1;
+        return run_query_server(service, serve_spec);
+    }
+    
     std::vector<std::string> paths_to_try;
     paths_to_try.push_back("order_new.csv");
     paths_to_try.push_back("../order_new.csv");
@@ -686,12 +6670,19 @@ int main() {
     paths_to_try.push_back("../../../order_new.csv");
     paths_to_try.push_back("../../../../order_new.csv");
     
-    std::string order_path;
-    std::string trade_path;
-    std::string output_path;
+    std::string output_name = "book_new.csv";
+    if (match_mode) output_name = "trade_match.csv";
+    if (backtest_mode) output_name = "fills_backtest.csv";
+    
+    // Explicit --orders/--trades skip the search
+    bool found = !order_path.empty() && !trade_path.empty();
+    if (found && output_path.empty()) output_path = output_name;
+    if (!found && (!order_path.empty() || !trade_path.empty())) {
+        std::cerr << "Error: --orders and --trades must be given together" << std::endl;
+        return 1;
+    }
     
-    bool found = false;
-    for (size_t i = 0; i < paths_to_try.size(); i++) {
+    for (size_t i = 0; i < paths_to_try.size() && !found; i++) {
         std::ifstream test(paths_to_try[i].c_str());
         if (test.good()) {
             test.close();
@@ -703,15 +6694,16 @@ int main() {
                 trade_path.replace(pos, 13, "trade_new.csv");
             }
             
-            output_path = paths_to_try[i];
-            pos = output_path.find("order_new.csv");
-            if (pos != std::string::npos) {
-                output_path.replace(pos, 13, "book_new.csv");
+            if (output_path.empty()) {
+                output_path = paths_to_try[i];
+                pos = output_path.find("order_new.csv");
+                if (pos != std::string::npos) {
+                    output_path.replace(pos, 13, output_name);
+                }
             }
             
             std::cout << "Found files at: " << paths_to_try[i] << std::endl;
             found = true;
-            break;
         }
     }
     
@@ -720,18 +6712,139 @@ int main() {
         return 1;
     }
     
-    std::vector<Order> orders;
-    std::vector<Trade> trades;
+    if (match_mode) {
+        return run_match(order_path, trade_path, output_path);
+    }
+    if (follow_mode) {
+        return run_follow(order_path, trade_path, output_path, poll_ms, max_hold_ms, idle_exit_ms, opts);
+    }
+    if (!serve_spec.empty()) {
+        BookQueryService service;
+        init_query_service(service, opts);
+        if (!add_symbol(service, "default", order_path, trade_path, "", QUERY_CHECKPOINT_INTERVAL)) return 1;
+        return run_query_server(service, serve_spec);
+    }
+    if (as_of >= 0) {
+        return run_as_of(order_path, trade_path, output_path + ".ckpt", as_of, opts);
+    }
+    if (range.from_ms >= 0 || range.to_ms >= 0 || range.seq_from >= 0 || range.seq_to >= 0) {
+        return run_window(order_path, trade_path, output_path, range, opts);
+    }
+    if (backtest_mode) {
+        JoinBestStrategy strategy(quote_qty, max_position);
+        return run_backtest(order_path, trade_path, output_path, strategy, latency);
+    }
+    
+    // Segments write their rows only after all have run and carry no state out
+    if (num_segments > 0 && (check_book || !bar_list.empty() || !mbp_path.empty() || !lifecycle_path.empty() ||
+                             !opts.shm_name.empty() || !opts.feature_stream.empty() ||
+                             opts.checkpoint_every > 0 || opts.resume)) {
+        std::cerr << "Error: --segments cannot be combined with --check-book, --bars, --mbp, --lifecycle, "
+                  << "--shm, --feature-stream, --checkpoint-every or --resume" << std::endl;
+        return 1;
+    }
+    
+    RunReport report;
+    init_run_report(report);
+    if (!report_path.empty()) {
+        opts.report = &report;
+        count_allocations = true;
+    }
+    long long stamp = 0;
+    long long bytes = 0;
+    
+    OrderColumns orders;
+    TradeColumns trades;
     
-    read_order_file(order_path, orders);
-    read_trade_file(trade_path, trades);
+    StageTimer stage;
+    start_stage(stage);
+    if (!read_order_file(order_path, orders)) return 1;
+    if (opts.report) file_stamp(order_path, bytes, stamp);
+    end_stage(opts.report, "read orders", stage, (long long)orders.size(), bytes);
+    start_stage(stage);
+    if (!read_trade_file(trade_path, trades)) return 1;
+    if (opts.report) file_stamp(trade_path, bytes, stamp);
+    end_stage(opts.report, "read trades", stage, (long long)trades.size(), bytes);
     
     if (orders.empty()) {
         std::cerr << "Error: No orders loaded!" << std::endl;
         return 1;
     }
     
-    process_events(orders, trades, output_path);
+    ReplaySinks sinks;
+    BookCheckSink check;
+    if (check_book) sinks.check = &check;
+    
+    std::vector<BarSpec> specs;
+    OutputStream bar_out;
+    if (!bar_list.empty()) {
+        if (!parse_bar_specs(bar_list, specs)) return 1;
+        if (bar_path.empty()) bar_path = output_path + ".bars.csv";
+        if (!open_output(bar_out, bar_path, false, opts)) {
+            std::cerr << "Cannot create bar file: " << bar_path << std::endl;
+            return 1;
+        }
+        write_bar_header(bar_out.out);
+    }
+    BarSink bars(specs, bar_out.out);
+    if (!specs.empty()) sinks.bars = &bars;
+    
+    OutputStream mbp_out;
+    if (!mbp_path.empty()) {
+        if (!open_output(mbp_out, mbp_path, false, opts)) {
+            std::cerr << "Cannot create MBP feed: " << mbp_path << std::endl;
+            return 1;
+        }
+        write_mbp_header(mbp_out.out);
+    }
+    MbpSink mbp(mbp_out.out, mbp_refresh);
+    if (!mbp_path.empty()) sinks.mbp = &mbp;
+    
+    LifecycleStore lifecycle;
+    if (!lifecycle_path.empty()) sinks.lifecycle = &lifecycle;
+    
+    if (sinks.any()) {
+        // Bars, the MBP feed and lifecycles are not checkpointed, so they come from a full serial pass
+        if (sinks.bars || sinks.mbp || sinks.lifecycle) opts.resume = false;
+        ReplayWorkspace ws;
+        if (replay_with_sinks(orders, trades, output_path, opts, ws, sinks) == REPLAY_FAILED) return 1;
+        if (sinks.check) print_book_checks(check, std::cout);
+        if (sinks.bars) {
+            bars.finish();
+            if (!close_output(bar_out)) std::cerr << "Error writing " << bar_path << std::endl;
+            std::cout << "Bars: " << bars.bars_written << " saved to " << bar_path << std::endl;
+        }
+        if (sinks.mbp) {
+            if (!close_output(mbp_out)) std::cerr << "Error writing " << mbp_path << std::endl;
+            std::cout << "MBP messages: " << mbp.seq << " saved to " << mbp_path << std::endl;
+        }
+        if (sinks.lifecycle) {
+            if (!write_lifecycle(lifecycle, lifecycle_path, opts.compress)) {
+                std::cerr << "Cannot write order lifecycles: " << lifecycle_path << std::endl;
+                return 1;
+            }
+            print_lifecycle_summary(lifecycle, std::cout);
+        }
+    } else if (num_segments > 0) {
+        // The segments run on their own threads, so this stage counts the CPU time of the process
+        start_stage(stage);
+        double cpu = process_cpu_seconds();
+        size_t num_snapshots = process_events_parallel(orders, trades, output_path, opts, num_segments);
+        if (num_snapshots == REPLAY_FAILED) return 1;
+        if (opts.report) file_stamp(output_path, bytes, stamp);
+        add_stage(opts.report, "segment replay", seconds_since(stage.wall), process_cpu_seconds() - cpu,
+                  (long long)num_snapshots, bytes);
+    } else if (process_events(orders, trades, output_path, opts) == REPLAY_FAILED) {
+        return 1;
+    }
+    
+    if (opts.report) {
+        print_run_report(report, std::cout);
+        if (!write_run_report(report, report_path)) {
+            std::cerr << "Cannot write run report: " << report_path << std::endl;
+            return 1;
+        }
+    }
     
     std::cout << "Processing complete!" << std::endl;
     std::cout << "Output saved to: " << output_path << std::endl;
@@ -0,0 +1,215 @@
+// Unit tests of book_reader.h: the seqlock snapshot reader, the OBZ block
+// decoder and stream reader, and the varints of the delta-coded formats.
+//     book_reader_test <test> <work dir>
+// Exits 0 when the test passes.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include "book_reader.h"
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Every field of snapshot i holds i, so a torn copy mixes two values
+void fill_snapshot(ShmBookSnapshot& s, long long i) {
+    s.clockatarrival = i;
+    s.transacttime = i;
+    s.num_bids = (int)(i % SHM_BOOK_DEPTH);
+    s.num_asks = (int)(i % SHM_BOOK_DEPTH);
+    for (int k = 0; k < SHM_BOOK_DEPTH; k++) {
+        s.bids[k].price = (double)i;
+        s.bids[k].qty = i;
+        s.asks[k].price = (double)i;
+        s.asks[k].qty = i;
+    }
+    s.cvl = i;
+    s.lpr = (double)i;
+    s.cto = i;
+    s.nts = i;
+    s.opx = (double)i;
+    s.has_auction = (int)(i & 1);
+    s.iap = (double)i;
+    s.iav = i;
+    s.iai = i;
+}
+
+bool snapshot_is(const ShmBookSnapshot& s, long long i) {
+    ShmBookSnapshot expected;
+    std::memset(&expected, 0, sizeof(expected));
+    fill_snapshot(expected, i);
+    return std::memcmp(&s, &expected, sizeof(s)) == 0;
+}
+
+void shm_writer(ShmBook* shm, long long count) {
+    for (long long i = 1; i <= count; i++) {
+        shm_book_write_begin(shm);
+        fill_snapshot(shm->snapshot, i);
+        shm->published = (uint64_t)i;
+        shm_book_write_end(shm);
+    }
+}
+
+// A reader racing the writer only ever sees whole snapshots, in order
+void test_seqlock() {
+    ShmBook* shm = new ShmBook;
+    std::memset((void*)shm, 0, sizeof(ShmBook));
+    shm->magic = SHM_BOOK_MAGIC;
+    shm->version = SHM_BOOK_VERSION;
+
+    ShmBookSnapshot snap;
+    check(!shm_book_read(shm, snap), "nothing published reads as empty");
+
+    const long long count = 200000;
+    std::thread writer(shm_writer, shm, count);
+    long long last = 0;
+    long long reads = 0;
+    while (last < count) {
+        uint64_t published = 0;
+        if (!shm_book_read(shm, snap, &published)) continue;
+        reads++;
+        if (!snapshot_is(snap, (long long)published)) {
+            check(false, "torn snapshot " + std::to_string(published));
+            break;
+        }
+        if ((long long)published < last) {
+            check(false, "snapshots out of order");
+            break;
+        }
+        last = (long long)published;
+    }
+    writer.join();
+    check(reads > 0, "reader saw snapshots");
+    check(shm_book_read(shm, snap) && snapshot_is(snap, count), "last snapshot");
+
+    // A writer that died mid-update leaves seq odd; the reader waits for it
+    check((shm->seq.load() & 1) == 0, "seq even after the writer");
+    delete shm;
+}
+
+std::string decode(const std::string& stored, size_t size, bool& ok) {
+    std::string out(size, '\0');
+    ok = obz_decode_block((const unsigned char*)stored.data(), stored.size(),
+                          (unsigned char*)&out[0], size);
+    return out;
+}
+
+// Hand-built blocks in the documented sequence format
+void test_obz_decode() {
+    bool ok;
+    // 3 literals, then a match of 9 at offset 3 overlapping its own output, then 1 literal
+    std::string lz("\x35" "abc" "\x03\x00" "\x10" "X", 8);
+    check(decode(lz, 13, ok) == "abcabcabcabcX" && ok, "overlapping match");
+
+    // 20 literals: 15 in the token and 5 in a continuation byte
+    std::string literals = std::string("\xf0\x05", 2) + "0123456789abcdefghij";
+    check(decode(literals, 20, ok) == "0123456789abcdefghij" && ok, "long literal run");
+
+    // Match of 4 + 15 + 255 + 3 = 277 bytes of 'a' continued over two bytes
+    std::string long_match = std::string("\x1f" "a" "\x01\x00" "\xff\x03" "\x00", 7);
+    check(decode(long_match, 278, ok) == std::string(278, 'a') && ok, "long match");
+
+    // A block that did not shrink is stored as is
+    check(decode("stored", 6, ok) == "stored" && ok, "stored block");
+
+    decode(std::string("\x35" "abc" "\x00\x00" "\x10" "X", 8), 13, ok);
+    check(!ok, "offset 0 is damage");
+    decode(std::string("\x35" "abc" "\x04\x00" "\x10" "X", 8), 13, ok);
+    check(!ok, "offset before the block start is damage");
+    decode(lz.substr(0, 5), 13, ok);
+    check(!ok, "cut sequence is damage");
+    decode(lz, 12, ok);
+    check(!ok, "overrun of the raw size is damage");
+    decode(lz, 14, ok);
+    check(!ok, "short of the raw size is damage");
+}
+
+bool read_varint(const std::string& bytes, int64_t& value) {
+    const unsigned char* p = (const unsigned char*)bytes.data();
+    return obz_read_varint(p, p + bytes.size(), value) && p == (const unsigned char*)bytes.data() + bytes.size();
+}
+
+void test_varint() {
+    int64_t v = 0;
+    check(read_varint(std::string("\x00", 1), v) && v == 0, "varint 0");
+    check(read_varint("\x01", v) && v == -1, "varint -1");
+    check(read_varint("\x02", v) && v == 1, "varint 1");
+    check(read_varint("\xd8\x04", v) && v == 300, "varint 300");
+    check(read_varint("\xd7\x04", v) && v == -300, "varint -300");
+    check(!read_varint("\x80", v), "cut varint");
+    check(!read_varint(std::string(10, '\x80'), v), "overlong varint");
+}
+
+void put_block(std::string& file, const std::string& stored, uint32_t raw_size) {
+    uint32_t sizes[2] = {raw_size, (uint32_t)stored.size()};
+    file.append((const char*)sizes, sizeof(sizes));
+    file += stored;
+}
+
+bool write_bytes(const std::string& path, const std::string& bytes) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+    return out.good();
+}
+
+// Read a whole file through ObzReader in small pieces; ok is the close result
+std::string read_obz(const std::string& path, bool& ok) {
+    ObzReader reader;
+    ok = false;
+    if (!obz_reader_open(reader, path.c_str())) return "";
+    std::string out;
+    char buf[5];
+    size_t n;
+    while ((n = obz_reader_read(reader, buf, sizeof(buf))) > 0) out.append(buf, n);
+    ok = obz_reader_close(reader);
+    return out;
+}
+
+void test_obz_reader(const std::string& dir) {
+    std::string file(OBZ_MAGIC, 4);
+    put_block(file, std::string("\x35" "abc" "\x03\x00" "\x10" "X", 8), 13);
+    put_block(file, "stored", 6);
+    std::string path = dir + "/blocks.obz";
+    check(write_bytes(path, file), "write " + path);
+
+    bool ok;
+    check(read_obz(path, ok) == "abcabcabcabcXstored" && ok, "two blocks");
+
+    check(write_bytes(path, file.substr(0, file.size() - 2)), "write " + path);
+    read_obz(path, ok);
+    check(!ok, "cut last block is damage");
+
+    std::string bad_size = file;
+    bad_size[4] = 12;    // raw size of the first block
+    check(write_bytes(path, bad_size), "write " + path);
+    read_obz(path, ok);
+    check(!ok, "wrong raw size is damage");
+
+    check(write_bytes(path, "OBZ0"), "write " + path);
+    ObzReader reader;
+    check(!obz_reader_open(reader, path.c_str()), "foreign magic is refused");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " seqlock|obz_decode|varint|obz_reader WORK_DIR" << std::endl;
+        return 2;
+    }
+    std::string test = argv[1];
+    if (test == "seqlock") test_seqlock();
+    else if (test == "obz_decode") test_obz_decode();
+    else if (test == "varint") test_varint();
+    else if (test == "obz_reader") test_obz_reader(argv[2]);
+    else {
+        std::cerr << "Unknown test: " << test << std::endl;
+        return 2;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,313 @@
+// Behavioural tests of the reconstructor, run through the test1 binary on the
+// sample day of the source tree:
+//     replay_test <test> <test1> <source dir> <work dir>
+// Each test replays copies of order_new.csv and trade_new.csv in its own work
+// dir, so sidecar indexes and checkpoints never land in the source tree.
+// Exits 0 when the test passes.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include "book_reader.h"
+
+int failures = 0;
+std::string test1;
+std::string dir;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::ostringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+bool write_file(const std::string& path, const std::string& data) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    return out.good();
+}
+
+bool copy_file(const std::string& from, const std::string& to) {
+    return write_file(to, read_file(from));
+}
+
+bool same_file(const std::string& a, const std::string& b) {
+    std::string data = read_file(a);
+    return !data.empty() && data == read_file(b);
+}
+
+std::string in_dir(const std::string& name) {
+    return dir + "/" + name;
+}
+
+// Run test1 with its output in run.log, or only its messages there when the
+// standard output goes to stdout_file; true if it exited 0
+bool run(const std::string& args, const std::string& stdout_file = "") {
+    std::string log = "\"" + in_dir("run.log") + "\"";
+    std::string command = "\"" + test1 + "\" " + args;
+    if (stdout_file.empty()) command += " > " + log + " 2>&1";
+    else command += " > \"" + in_dir(stdout_file) + "\" 2> " + log;
+    return std::system(command.c_str()) == 0;
+}
+
+// Replay the sample day into output with extra options
+bool replay(const std::string& output, const std::string& args) {
+    return run("--orders \"" + in_dir("order_new.csv") + "\" --trades \"" + in_dir("trade_new.csv") +
+               "\" --output \"" + in_dir(output) + "\" " + args);
+}
+
+bool log_contains(const std::string& text) {
+    return read_file(in_dir("run.log")).find(text) != std::string::npos;
+}
+
+// Interrupted runs continue from their checkpoints to the bytes of an
+// uninterrupted run, checkpoints included
+void test_resume() {
+    check(replay("full.csv", "--checkpoint-every 10"), "full run");
+    std::string full = read_file(in_dir("full.csv"));
+    std::string checkpoints = read_file(in_dir("full.csv.ckpt"));
+    check(!checkpoints.empty(), "checkpoints written");
+
+    // Killed part way: the output holds more than the last checkpoint covers
+    // of the earlier ones and less than the later ones refer to
+    write_file(in_dir("part.csv"), full.substr(0, full.size() / 2));
+    write_file(in_dir("part.csv.ckpt"), checkpoints);
+    check(replay("part.csv", "--checkpoint-every 10 --resume"), "resume");
+    check(log_contains("Resumed at event"), "resumed from a checkpoint");
+    check(same_file(in_dir("part.csv"), in_dir("full.csv")), "resumed output");
+    check(same_file(in_dir("part.csv.ckpt"), in_dir("full.csv.ckpt")), "resumed checkpoints");
+
+    // Killed while writing a checkpoint: the torn record is dropped
+    write_file(in_dir("torn.csv"), full);
+    write_file(in_dir("torn.csv.ckpt"), checkpoints.substr(0, checkpoints.size() - 7));
+    check(replay("torn.csv", "--checkpoint-every 10 --resume"), "resume after a torn checkpoint");
+    check(log_contains("Resumed at event"), "resumed from an earlier checkpoint");
+    check(same_file(in_dir("torn.csv"), in_dir("full.csv")), "output after a torn checkpoint");
+    check(same_file(in_dir("torn.csv.ckpt"), in_dir("full.csv.ckpt")), "checkpoints after a torn checkpoint");
+
+    // Other columns would be appended under the old header: refused, output kept
+    std::string part = full.substr(0, full.size() / 2);
+    write_file(in_dir("columns.csv"), part);
+    write_file(in_dir("columns.csv.ckpt"), checkpoints);
+    check(!replay("columns.csv", "--auction --checkpoint-every 10 --resume"), "resume with other columns fails");
+    check(log_contains("Cannot resume"), "other columns reported");
+    check(read_file(in_dir("columns.csv")) == part, "output kept after a refused resume");
+
+    // Checkpoints without the cumulative features cannot seed a run that prints them
+    check(replay("features.csv", "--features"), "features run");
+    write_file(in_dir("plain.csv"), full);
+    write_file(in_dir("plain.csv.ckpt"), checkpoints);
+    check(replay("plain.csv", "--features --checkpoint-every 10 --resume"), "features resume");
+    check(same_file(in_dir("plain.csv"), in_dir("features.csv")), "features resumed from plain checkpoints");
+
+    // The feature stream is cut back to the checkpoint and appended to, like the output
+    std::string stream_option = " --feature-stream \"" + in_dir("stream.features.csv") + "\"";
+    check(replay("stream.csv", "--checkpoint-every 10" + stream_option), "feature stream run");
+    std::string output = read_file(in_dir("stream.csv"));
+    std::string stream = read_file(in_dir("stream.features.csv"));
+    write_file(in_dir("stream.csv"), output.substr(0, output.size() * 9 / 10));
+    write_file(in_dir("stream.features.csv"), stream.substr(0, stream.size() * 9 / 10));
+    check(replay("stream.csv", "--checkpoint-every 10 --resume" + stream_option), "feature stream resume");
+    check(log_contains("Resumed at event"), "feature stream resumed from a checkpoint");
+    check(read_file(in_dir("stream.csv")) == output, "output resumed with a feature stream");
+    check(read_file(in_dir("stream.features.csv")) == stream, "resumed feature stream");
+}
+
+// Segments started from checkpoints give the serial output
+void test_segments() {
+    check(replay("serial.csv", "--checkpoint-every 10"), "serial run");
+    check(replay("prepass.csv", "--segments 3"), "segments from a pre-pass");
+    check(same_file(in_dir("prepass.csv"), in_dir("serial.csv")), "segments from a pre-pass");
+    copy_file(in_dir("serial.csv.ckpt"), in_dir("stored.csv.ckpt"));
+    check(replay("stored.csv", "--segments 3"), "segments from checkpoints");
+    check(same_file(in_dir("stored.csv"), in_dir("serial.csv")), "segments from checkpoints");
+
+    check(replay("features.csv", "--features"), "serial features run");
+    copy_file(in_dir("serial.csv.ckpt"), in_dir("features_seg.csv.ckpt"));
+    check(replay("features_seg.csv", "--features --segments 3"), "features segments");
+    check(same_file(in_dir("features_seg.csv"), in_dir("features.csv")), "features segments with plain checkpoints");
+
+    // Options the segments cannot honour are refused, not dropped
+    check(!replay("stream_seg.csv", "--segments 3 --feature-stream \"" + in_dir("stream.csv") + "\""),
+          "segments with a feature stream fail");
+    check(log_contains("--segments cannot be combined"), "segment conflict reported");
+    check(!replay("check_seg.csv", "--segments 3 --check-book"), "segments with a sink fail");
+}
+
+// Rows of a snapshot CSV whose transacttime lies in [from, to], header first
+std::string slice_rows(const std::string& csv, long long from, long long to) {
+    std::istringstream in(csv);
+    std::string line;
+    std::getline(in, line);
+    std::string out = line + "\n";
+    while (std::getline(in, line)) {
+        size_t comma = line.find(',');
+        long long time = std::atoll(line.c_str() + comma + 1);
+        if (time >= from && time <= to) out += line + "\n";
+    }
+    return out;
+}
+
+// A time window gives the rows of the full replay in that window, with or
+// without a checkpoint to start from
+void test_window() {
+    check(replay("full.csv", "--checkpoint-every 10"), "full run");
+    std::string expected = slice_rows(read_file(in_dir("full.csv")), 93000300, 93001500);
+    check(expected.find('\n') + 1 < expected.size(), "window has rows");
+
+    check(replay("window.csv", "--from 093000300 --to 093001500"), "window run");
+    check(read_file(in_dir("window.csv")) == expected, "window from the start");
+
+    copy_file(in_dir("full.csv.ckpt"), in_dir("seeked.csv.ckpt"));
+    check(replay("seeked.csv", "--from 093000300 --to 093001500"), "window run from a checkpoint");
+    check(read_file(in_dir("seeked.csv")) == expected, "window from a checkpoint");
+}
+
+// Last line of a text, without its newline
+std::string last_line(const std::string& text) {
+    size_t end = text.find_last_not_of('\n');
+    if (end == std::string::npos) return "";
+    size_t start = text.rfind('\n', end);
+    start = start == std::string::npos ? 0 : start + 1;
+    return text.substr(start, end + 1 - start);
+}
+
+// An as-of query prints the row of the full replay at that time, extra
+// columns included, from checkpoints with or without the features
+void test_asof() {
+    std::string columns = "--features --order-counts";
+    check(replay("full.csv", columns + " --checkpoint-every 10"), "full run");
+    std::string expected = last_line(slice_rows(read_file(in_dir("full.csv")), 0, 93000500));
+    expected = expected.substr(expected.find(','));
+
+    check(run("--orders \"" + in_dir("order_new.csv") + "\" --trades \"" + in_dir("trade_new.csv") +
+              "\" --output \"" + in_dir("full.csv") + "\" --as-of 093000500 " + columns, "asof.txt"), "as-of query");
+    std::string row = last_line(read_file(in_dir("asof.txt")));
+    check(row.substr(row.find(',')) == expected, "as-of row from feature checkpoints");
+
+    check(replay("plain.csv", "--checkpoint-every 10"), "plain run");
+    check(run("--orders \"" + in_dir("order_new.csv") + "\" --trades \"" + in_dir("trade_new.csv") +
+              "\" --output \"" + in_dir("plain.csv") + "\" --as-of 093000500 " + columns, "asof_plain.txt"),
+          "as-of query over plain checkpoints");
+    row = last_line(read_file(in_dir("asof_plain.txt")));
+    check(row.substr(row.find(',')) == expected, "as-of row from plain checkpoints");
+}
+
+// Compressed outputs decode to the plain output, and damage is reported
+void test_compress() {
+    check(replay("plain.csv", ""), "plain run");
+    check(replay("packed.obz", "--compress"), "compressed run");
+    std::string packed = read_file(in_dir("packed.obz"));
+    check(packed.compare(0, 4, OBZ_MAGIC, 4) == 0, "compressed output");
+
+    check(run("--decompress \"" + in_dir("packed.obz") + "\"", "unpacked.csv"), "decompress");
+    check(same_file(in_dir("unpacked.csv"), in_dir("plain.csv")), "decompressed output");
+
+    ObzReader reader;
+    std::string decoded;
+    check(obz_reader_open(reader, in_dir("packed.obz").c_str()), "open with the reader");
+    char buf[4096];
+    size_t n;
+    while ((n = obz_reader_read(reader, buf, sizeof(buf))) > 0) decoded.append(buf, n);
+    check(obz_reader_close(reader), "reader close");
+    check(decoded == read_file(in_dir("plain.csv")), "output read with book_reader.h");
+
+    write_file(in_dir("cut.obz"), packed.substr(0, packed.size() - 5));
+    check(!run("--decompress \"" + in_dir("cut.obz") + "\""), "cut output fails to decompress");
+}
+
+// Prices are kept as whole ticks, 0.01 unless --tick says otherwise; a finer
+// price stops the run instead of being merged into the nearest level
+void test_tick() {
+    check(replay("ticks.csv", ""), "run on tick prices");
+
+    std::istringstream in(read_file(in_dir("order_new.csv")));
+    std::string line;
+    std::string orders;
+    bool changed = false;
+    std::string fine_price;
+    while (std::getline(in, line)) {
+        // The first limit price with two decimals gets a third one
+        size_t field = 0;
+        size_t start = 0;
+        for (size_t i = 0; i < line.size() && field < 6; i++) {
+            if (line[i] == ',' && ++field == 6) start = i + 1;
+        }
+        size_t end = line.find(',', start);
+        if (!changed && field == 6 && end != std::string::npos && end - start > 3 && line[end - 3] == '.') {
+            line.insert(end, "5");
+            fine_price = line.substr(start, end + 1 - start);
+            changed = true;
+        }
+        orders += line + "\n";
+    }
+    check(changed, "sample has a two-decimal price");
+    write_file(in_dir("order_new.csv"), orders);
+
+    check(!replay("fine.csv", ""), "run on a three-decimal price fails");
+    check(log_contains("is not a multiple of the 0.01 tick"), "tick error reported");
+    check(!replay("fine_window.csv", "--from 093000300 --to 093001500"), "window on a three-decimal price fails");
+
+    check(replay("fine_tick.csv", "--tick 0.001"), "run with a 0.001 tick");
+    check(read_file(in_dir("fine_tick.csv")).find("," + fine_price + ",") != std::string::npos,
+          "three-decimal level printed");
+    check(!replay("bad_tick.csv", "--tick 0.03"), "tick that is not 1/N of a unit fails");
+}
+
+// The pause after the opening auction freezes matching without an auction:
+// its crossed orders trade in arrival order when continuous trading opens
+void test_pause() {
+    std::string orders = "clockatarrival,sequenceno,transacttime,applseqnum,side,ordertype,price,orderqty\n"
+                         "92600000,1,92600000,1,1,2,100.00,500\n"
+                         "92700000,2,92700000,2,2,2,99.90,300\n"
+                         "92800000,3,92800000,3,2,2,99.95,400\n";
+    write_file(in_dir("pause_orders.csv"), orders);
+    write_file(in_dir("pause_trades.csv"), "clockatarrival,sequenceno,transacttime,applseqnum,exectype,"
+                                           "tradeprice,tradeqty,trademoney,bidapplseqnum,offerapplseqnum\n");
+    check(run("--match --orders \"" + in_dir("pause_orders.csv") + "\" --trades \"" + in_dir("pause_trades.csv") +
+              "\" --output \"" + in_dir("pause_fills.csv") + "\""), "match run");
+    std::string fills = read_file(in_dir("pause_fills.csv"));
+    check(fills.find("93000000,1,93000000,1,f,100.00,300,30000.00,1,2\n") != std::string::npos, "first fill at the open");
+    check(fills.find("93000000,2,93000000,2,f,100.00,200,20000.00,1,3\n") != std::string::npos, "second fill at the open");
+    check(fills.find("92500000") == std::string::npos, "no auction fill at the pause");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " resume|segments|window|compress|tick|pause|asof TEST1 SOURCE_DIR WORK_DIR"
+                  << std::endl;
+        return 2;
+    }
+    std::string test = argv[1];
+    test1 = argv[2];
+    std::string source = argv[3];
+    dir = argv[4];
+    if (!copy_file(source + "/order_new.csv", in_dir("order_new.csv")) ||
+        !copy_file(source + "/trade_new.csv", in_dir("trade_new.csv"))) {
+        std::cerr << "Cannot copy the sample day to " << dir << std::endl;
+        return 2;
+    }
+
+    if (test == "resume") test_resume();
+    else if (test == "segments") test_segments();
+    else if (test == "window") test_window();
+    else if (test == "compress") test_compress();
+    else if (test == "tick") test_tick();
+    else if (test == "pause") test_pause();
+    else if (test == "asof") test_asof();
+    else {
+        std::cerr << "Unknown test: " << test << std::endl;
+        return 2;
+    }
+    if (failures) std::cerr << "See " << in_dir("run.log") << " for the last run" << std::endl;
+    return failures ? 1 : 0;
+}